@@ -2,6 +2,8 @@
 
 #include "visitor.h"
 
+#include <algorithm>
+
 namespace Verve {
 namespace AST {
 
@@ -77,6 +79,10 @@ void Program::visit(Visitor *visitor) {
   visitor->visitProgram(this);
 }
 
+unsigned Program::lineFor(const Loc &loc) const {
+  return std::upper_bound(lineStarts.begin(), lineStarts.end(), loc.start) - lineStarts.begin();
+}
+
 void DataType::visit(Visitor *visitor) {
   visitor->visitDataType(this);
 }
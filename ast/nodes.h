@@ -4,6 +4,8 @@
 #include "parser/token.h"
 #include "parser/type.h"
 
+#include "utils/phases.h"
+
 #include <cassert>
 #include <memory>
 #include <string>
@@ -25,11 +27,13 @@
     static inline __class##Ptr create##__class(Loc loc) { \
        auto node = std::make_shared<__class>(loc); \
       node->m_loc = loc; \
+      Phases::allocated(sizeof(__class)); \
       return node; \
     } \
 
 #define CLONE_AST(__type) \
   NodePtr clone() const { \
+    Phases::allocated(sizeof(__type)); \
     return std::make_shared<__type>(*this); \
   }
 
@@ -119,7 +123,11 @@ namespace AST {
     virtual NodePtr clone() const;
     virtual void visit(Visitor *);
 
+    unsigned lineFor(const Loc &loc) const;
+
     std::vector<ProgramPtr> imports;
+    std::string filename;
+    std::vector<unsigned> lineStarts;
   };
 
   struct Number : public Node {
@@ -142,7 +150,7 @@ namespace AST {
 
     std::string name;
     std::string ns;
-    bool isCaptured;
+    bool isCaptured = false;
     bool isFunctionParameter = false;
     unsigned index;
   };
@@ -173,6 +181,8 @@ namespace AST {
 
     NodePtr callee;
     std::vector<NodePtr> arguments;
+    // explicit, as in `make_channel<int>(1)`
+    std::vector<AbstractTypePtr> typeArguments;
   };
 
   struct If : public Node {
@@ -395,7 +405,11 @@ namespace AST {
   };
 
   struct Prototype : public FunctionType, public FunctionInterface {
-    using FunctionType::FunctionType;
+    // the flags are bit fields, they can't have initializers
+    Prototype(Loc loc) : FunctionType(loc) {
+      isExternal = false;
+      isVirtual = false;
+    }
 
     virtual Type *typeof(EnvPtr env);
     virtual NodePtr clone() const;
@@ -428,7 +442,7 @@ namespace AST {
     std::string name;
     std::vector<FunctionParameterPtr> parameters;
     BlockPtr body;
-    bool needsScope;
+    bool needsScope = false;
     bool capturesScope;
     std::unordered_map<std::string, FunctionPtr> instances;
   };
@@ -0,0 +1,46 @@
+// Runs a command and prints its wall time in milliseconds and its peak
+// resident set size in kilobytes, separated by a tab. The command's output
+// is discarded. Used by run.sh, which can't get the peak RSS portably.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: measure <command> [args...]\n");
+    return EXIT_FAILURE;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto pid = fork();
+  if (pid == 0) {
+    auto null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    execvp(argv[1], argv + 1);
+    perror("measure");
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "measure: `%s` failed\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+#if __APPLE__
+  auto rss = usage.ru_maxrss / 1024;
+#else
+  auto rss = usage.ru_maxrss;
+#endif
+  printf("%.1f\t%ld\n", std::chrono::duration<double, std::milli>(elapsed).count(), (long)rss);
+  return EXIT_SUCCESS;
+}
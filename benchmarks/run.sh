@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+#
+# Runs every benchmark RUNS times and reports its median time and peak RSS
+# next to the ones stored in baseline.tsv. With --update the results are
+# saved as the new baseline instead.
+#
+# usage: benchmarks/run.sh <verve> <measure> <runs> [--update]
+
+set -e
+
+VERVE=$1
+MEASURE=$2
+RUNS=$3
+UPDATE=$4
+
+DIR=$(dirname "$0")
+BASELINE="$DIR/baseline.tsv"
+
+baseline() {
+  if [[ -f "$BASELINE" ]]; then
+    awk -F '\t' -v name="$1" -v column="$2" '$1 == name { print $column }' "$BASELINE"
+  fi
+}
+
+change() {
+  if [[ -z "$2" ]]; then
+    echo "-"
+    return
+  fi
+  awk -v now="$1" -v before="$2" 'BEGIN { printf "%+.1f%%", (now - before) * 100 / before }'
+}
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+
+printf "%-12s %10s %10s %8s %10s %10s %8s\n" benchmark "time ms" baseline change "rss kb" baseline change
+for program in "$DIR"/*.vrv; do
+  name=$(basename "$program" .vrv)
+
+  times=()
+  rss=0
+  for ((i = 0; i < RUNS; i++)); do
+    result=$("$MEASURE" "$VERVE" "$program")
+    read -r time kb <<< "$result"
+    times+=("$time")
+    if (( kb > rss )); then
+      rss=$kb
+    fi
+  done
+  median=$(printf "%s\n" "${times[@]}" | sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }')
+
+  base_time=$(baseline "$name" 2)
+  base_rss=$(baseline "$name" 3)
+  printf "%-12s %10s %10s %8s %10s %10s %8s\n" \
+    "$name" "$median" "${base_time:--}" "$(change "$median" "$base_time")" \
+    "$rss" "${base_rss:--}" "$(change "$rss" "$base_rss")"
+  printf "%s\t%s\t%s\n" "$name" "$median" "$rss" >> "$results"
+done
+
+if [[ "$UPDATE" == "--update" ]]; then
+  cp "$results" "$BASELINE"
+  echo "Saved the results as the new baseline"
+fi
@@ -12,12 +12,12 @@ namespace Verve {
     m_width = std::ceil(std::log10(size + 1)) + 1;
   }
 
-  Disassembler::HelperStream Disassembler::write(double offset) {
+  Disassembler::HelperStream Disassembler::write() {
     std::cout
       << "["
       << std::setfill(' ')
       << std::setw(m_width)
-      << ((int)m_bytecode.tellg() - (offset * WORD_SIZE))
+      << m_start
       << "] "
       << m_padding;
 
@@ -30,6 +30,12 @@ namespace Verve {
     return value;
   }
 
+  int32_t Disassembler::readOperand() {
+    int32_t value;
+    m_bytecode.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+  }
+
   std::string Disassembler::readStr() {
     std::stringstream dest;
     m_bytecode.get(*dest.rdbuf(), '\0');
@@ -39,7 +45,7 @@ namespace Verve {
   }
 
   int Disassembler::calculateJmpTarget(int target) {
-    return (int)m_bytecode.tellg() - WORD_SIZE + target;
+    return m_start + target;
   }
 
   void Disassembler::dump() {
@@ -48,12 +54,14 @@ namespace Verve {
 
     dumpStrings();
     dumpFunctions();
+    dumpLines();
     dumpText();
 
     assert(m_bytecode.eof());
   }
 
   void Disassembler::dumpStrings() {
+    m_start = m_bytecode.tellg();
     auto header = read();
     if (header != Section::Strings) {
       m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
@@ -61,7 +69,7 @@ namespace Verve {
     }
 
     m_padding = "";
-    write(2) << "STRINGS:";
+    write() << "STRINGS:";
     m_padding = "  ";
 
     unsigned str_index = 0;
@@ -71,17 +79,18 @@ namespace Verve {
         return;
       }
       m_bytecode.seekg(-sizeof(verve), m_bytecode.cur);
-      auto p = m_bytecode.tellg();
+      m_start = m_bytecode.tellg();
       auto str = readStr();
       while (m_bytecode.peek() == '\1') {
         m_bytecode.get();
       }
       m_strings.push_back(str);
-      write((float)(m_bytecode.tellg() - p)/WORD_SIZE) <<  "$" << str_index++ << ": " << str;
+      write() <<  "$" << str_index++ << ": " << str;
     }
   }
 
   void Disassembler::dumpFunctions() {
+    m_start = m_bytecode.tellg();
     auto header = read();
     if (header != Section::Functions) {
       m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
@@ -89,59 +98,89 @@ namespace Verve {
     }
 
     m_padding = "";
-    write(2) << "FUNCTIONS:";
+    write() << "FUNCTIONS:";
     m_padding = "  ";
 
+    // collect all the names first, closures might refer to functions declared later
     auto pos = m_bytecode.tellg();
-    while (true) {
-      auto header = read();
-      if (header == Section::Header) {
-        break;
-      }
-      if (header == Section::FunctionHeader) {
-        auto fnID = read();
-        m_functions.push_back(m_strings[fnID]);
-      }
+    while (read() == Section::FunctionHeader) {
+      auto fnID = readOperand();
+      auto argCount = readOperand();
+      m_bytecode.seekg(argCount * OPERAND_SIZE, m_bytecode.cur);
+      auto size = readOperand();
+      m_bytecode.seekg(size, m_bytecode.cur);
+      m_functions.push_back(m_strings[fnID]);
     }
     m_bytecode.seekg(pos);
 
     while (true) {
+      m_start = m_bytecode.tellg();
       auto header = read();
       if (header == Section::Header) {
         return;
       }
       assert(header == Section::FunctionHeader);
 
-      auto fnID = read();
-      auto argCount = read();
-
-      m_functions.push_back(m_strings[fnID]);
+      auto fnID = readOperand();
+      auto argCount = readOperand();
 
       std::stringstream args;
       for (int i = 0; i < argCount; i++) {
-        auto argID = read();
+        auto argID = readOperand();
         if (i) args << ", ";
         args << "$" << i << ": " << m_strings[argID];
       }
+      auto size = readOperand();
 
       m_padding = "";
-      write(2 + argCount) << m_strings[fnID] << "(" << args.str() << "):";
+      write() << m_strings[fnID] << "(" << args.str() << "):";
       m_padding = "  ";
 
-      while (true) {
-        auto header = read();
-        m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
-        if (header == Section::FunctionHeader || header == Section::Header) {
-          break;
-        }
-
-        auto opcode = read();
+      auto end = m_bytecode.tellg() + (std::streamoff)size;
+      while (m_bytecode.tellg() < end) {
+        m_start = m_bytecode.tellg();
+        auto opcode = m_bytecode.get();
         printOpcode(static_cast<Opcode::Type>(opcode));
       }
     }
   }
 
+  void Disassembler::dumpLines() {
+    m_start = m_bytecode.tellg();
+    auto header = read();
+    if (header != Section::Lines) {
+      m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
+      return;
+    }
+
+    m_padding = "";
+    write() << "LINES:";
+
+    auto tableCount = read();
+    for (int64_t i = 0; i < tableCount; i++) {
+      m_start = m_bytecode.tellg();
+      auto chunk = readOperand();
+      auto entryCount = readOperand();
+
+      m_padding = "  ";
+      write() << (chunk < 0 ? "TEXT" : m_functions[chunk]) << ":";
+      m_padding = "    ";
+
+      for (int32_t j = 0; j < entryCount; j++) {
+        m_start = m_bytecode.tellg();
+        auto offset = readOperand();
+        auto file = readOperand();
+        auto line = readOperand();
+        write() << "+" << offset << ": " << m_strings[file] << ":" << line;
+      }
+    }
+
+    auto verve = read();
+    assert(verve == Section::Header);
+  }
+
   void Disassembler::dumpText() {
+    m_start = m_bytecode.tellg();
     auto header = read();
     if (header != Section::Text) {
       m_bytecode.seekg(-sizeof(header), m_bytecode.cur);
@@ -149,13 +188,14 @@ namespace Verve {
     }
 
     m_padding = "";
-    write(2) << "TEXT:";
+    write() << "TEXT:";
     m_padding = "  ";
 
     // skip size of lookup table
     m_bytecode.seekg(WORD_SIZE, m_bytecode.cur);
     while (true) {
-      auto opcode = read();
+      m_start = m_bytecode.tellg();
+      auto opcode = m_bytecode.get();
       if (m_bytecode.eof() || m_bytecode.fail()) {
         break;
       }
@@ -167,7 +207,7 @@ namespace Verve {
     switch (opcode) {
       case Opcode::push: {
         auto value = read();
-        write(2)
+        write()
           << "push 0x"
           << std::setbase(16)
           << value
@@ -175,100 +215,122 @@ namespace Verve {
         break;
       }
       case Opcode::call: {
-        auto argc = read();
-        write(2) << "call (" << argc << ")";
+        auto argc = readOperand();
+        write() << "call (" << argc << ")";
+        break;
+      }
+      case Opcode::tail_call: {
+        auto argc = readOperand();
+        auto freeSlots = readOperand() ? "true" : "false";
+        write() << "tail_call (" << argc << ") [freeSlots=" << freeSlots << "]";
         break;
       }
       case Opcode::load_string: {
-        auto stringID = read();
-        write(2) << "load_string $" << m_strings[stringID];
+        auto stringID = readOperand();
+        write() << "load_string $" << m_strings[stringID];
         break;
       }
       case Opcode::lookup: {
-        auto symbol = read();
-        auto cacheSlot = read();
-        write(3) << "lookup $" << symbol << "(" << m_strings[symbol] << ") [cacheSlot=" << cacheSlot << "]";
+        auto symbol = readOperand();
+        auto cacheSlot = readOperand();
+        write() << "lookup $" << symbol << "(" << m_strings[symbol] << ") [cacheSlot=" << cacheSlot << "]";
         break;
       }
       case Opcode::create_closure: {
-        auto fnID = read();
-        auto capturesScope = read() ? "true" : "false";
-        write(3) << "create_closure " << m_functions[fnID] << " [capturesScope=" << capturesScope << "]";
+        auto fnID = readOperand();
+        auto capturesScope = readOperand() ? "true" : "false";
+        write() << "create_closure " << m_functions[fnID] << " [capturesScope=" << capturesScope << "]";
         break;
       }
       case Opcode::jmp: {
-        auto target = read();
-        write(2) << "jmp [" << calculateJmpTarget(target) << "]";
+        auto target = readOperand();
+        write() << "jmp [" << calculateJmpTarget(target) << "]";
         break;
       }
       case Opcode::jz: {
-        auto target = read();
-        write(2) << "jz [" << calculateJmpTarget(target) << "]";
+        auto target = readOperand();
+        write() << "jz [" << calculateJmpTarget(target) << "]";
+        break;
+      }
+      case Opcode::switch_tag: {
+        auto count = readOperand();
+        std::stringstream table;
+        for (int i = 0; i < count; i++) {
+          auto target = readOperand();
+          if (i) table << ", ";
+          table << "#" << i << ": ";
+          if (target) {
+            table << calculateJmpTarget(target);
+          } else {
+            table << "fail";
+          }
+        }
+        write() << "switch_tag [" << table.str() << "]";
         break;
       }
       case Opcode::push_arg: {
-        auto argID = read();
-        write(2) << "push_arg $" << argID;
+        auto argID = readOperand();
+        write() << "push_arg $" << argID;
         break;
       }
       case Opcode::put_to_scope: {
-        auto argID = read();
-        write(2) << "put_to_scope $" << m_strings[argID];
+        auto argID = readOperand();
+        write() << "put_to_scope $" << m_strings[argID];
         break;
       }
       case Opcode::bind: {
-        auto stringID = read();
-        write(2) << "bind $" << m_strings[stringID];
+        auto stringID = readOperand();
+        write() << "bind $" << m_strings[stringID];
         break;
       }
       case Opcode::alloc_obj: {
-        auto size = read();
-        auto tag = read();
-        write(3) << "alloc_obj (size=" << size << ", tag=" << tag << ")";
+        auto size = readOperand();
+        auto tag = readOperand();
+        write() << "alloc_obj (size=" << size << ", tag=" << tag << ")";
         break;
       }
       case Opcode::alloc_list: {
-        auto size = read();
-        write(2) << "alloc_list (size=" << size << ")";
+        auto size = readOperand();
+        write() << "alloc_list (size=" << size << ")";
         break;
       }
       case Opcode::obj_store_at: {
-        auto index = read();
-        write(2) << "obj_store_at #" << index;
+        auto index = readOperand();
+        write() << "obj_store_at #" << index;
         break;
       }
       case Opcode::obj_tag_test: {
-        auto tag = read();
-        write(2) << "obj_tag_test #" << tag;
+        auto tag = readOperand();
+        write() << "obj_tag_test #" << tag;
         break;
       }
       case Opcode::obj_load: {
-        auto offset = read();
-        write(2) << "obj_load #" << offset;
+        auto offset = readOperand();
+        write() << "obj_load #" << offset;
         break;
       }
       case Opcode::stack_alloc: {
-        auto size = read();
-        write(2) << "stack_alloc #" << size;
+        auto size = readOperand();
+        write() << "stack_alloc #" << size;
         break;
       }
       case Opcode::stack_store: {
-        auto slot = read();
-        write(2) << "stack_store #" << slot;
+        auto slot = readOperand();
+        write() << "stack_store #" << slot;
         break;
       }
       case Opcode::stack_load: {
-        auto slot = read();
-        write(2) << "stack_load #" << slot;
+        auto slot = readOperand();
+        write() << "stack_load #" << slot;
         break;
       }
       case Opcode::stack_free: {
-        auto size = read();
-        write(2) << "stack_free #" << size;
+        auto size = readOperand();
+        write() << "stack_free #" << size;
         break;
       }
       default:
-        write(1) << Opcode::typeName(static_cast<Opcode::Type>(opcode));
+        write() << Opcode::typeName(static_cast<Opcode::Type>(opcode));
     }
   }
 }
@@ -25,18 +25,21 @@ private:
     }
   };
 
-  HelperStream write(double offset);
+  HelperStream write();
   int64_t read();
+  int32_t readOperand();
   std::string readStr();
   int calculateJmpTarget(int target);
   void printOpcode(Opcode::Type opcode);
   void dumpStrings();
   void dumpFunctions();
+  void dumpLines();
   void dumpText();
 
   std::stringstream &m_bytecode;
   std::vector<std::string> m_strings;
   std::vector<std::string> m_functions;
+  std::streamoff m_start; // offset of the entry being printed
   size_t m_width;
   std::string m_padding = "  ";
 };
@@ -1,25 +1,31 @@
 #include "generator.h"
 #include "opcodes.h"
+#include "optimizer.h"
 #include "sections.h"
 
 #include "parser/parser.h"
 
+#include "utils/phases.h"
+
 #include <algorithm>
 
 namespace Verve {
 
-void Generator::generate(AST::NodePtr node, bool shouldLink, std::stringstream *bytecode) {
-  Generator gen{shouldLink, bytecode};
+void Generator::generate(AST::NodePtr node, std::stringstream *bytecode) {
+  Phases::Timer timer(Phases::Generation);
+  Generator gen{bytecode};
   node->visit(&gen);
+  gen.emitOpcode(Opcode::exit);
 
-  auto text = gen.m_output->str();
+  auto text = gen.optimize(gen.m_output->str(), -1);
   gen.m_output->str(std::string());
   gen.m_output->clear();
 
   if (gen.m_functions.size()) {
     for (unsigned i = 0; i < gen.m_functions.size(); i++) {
       gen.write(Section::FunctionHeader);
-      gen.generateFunctionSource(gen.m_functions[i]);
+      gen.m_program = gen.m_functionPrograms[i];
+      gen.generateFunctionSource(gen.m_functions[i], i);
     }
   }
 
@@ -47,71 +53,169 @@ void Generator::generate(AST::NodePtr node, bool shouldLink, std::stringstream *
     *gen.m_output << functions;
   }
 
+  if (gen.m_lineTables.size()) {
+    gen.write(Section::Header);
+    gen.write(Section::Lines);
+    gen.write(gen.m_lineTables.size());
+    for (const auto &table : gen.m_lineTables) {
+      gen.writeOperand(table.chunk);
+      gen.writeOperand(table.entries.size());
+      for (const auto &entry : table.entries) {
+        gen.writeOperand(entry.offset);
+        gen.writeOperand(entry.file);
+        gen.writeOperand(entry.line);
+      }
+    }
+  }
+
   gen.write(Section::Header);
   gen.write(Section::Text);
   gen.write(gen.lookupID);
   *gen.m_output << text;
 
-  gen.emitOpcode(Opcode::exit);
   gen.m_output->seekg(0);
 }
 
-void Generator::generateFunctionSource(AST::Function *fn) {
+void Generator::generateFunctionSource(AST::Function *fn, unsigned index) {
   std::string fnName = fn->name;
   if (fnName == "_") {
     static unsigned id = 0;
     fnName = "_" + std::to_string(id++);
   }
-  write(uniqueString(fnName));
-  write(fn->parameters.size());
+  writeOperand(uniqueString(fnName));
+  writeOperand(fn->parameters.size());
 
   std::vector<unsigned> captured;
   for (unsigned i = 0; i < fn->parameters.size(); i++) {
-    write(uniqueString(fn->parameters[i]->name));
+    writeOperand(uniqueString(fn->parameters[i]->name));
 
     if (fn->parameters[i]->isCaptured) {
       captured.push_back(i);
     }
   }
 
+  std::stringstream code;
+  auto output = m_output;
+  m_output = &code;
+
   if (fn->needsScope) {
     emitOpcode(Opcode::create_lex_scope);
   }
 
   for (auto i : captured) {
     emitOpcode(Opcode::push_arg);
-    write(i);
+    writeOperand(i);
     emitOpcode(Opcode::put_to_scope);
-    write(uniqueString(fn->parameters[i]->name));
+    writeOperand(uniqueString(fn->parameters[i]->name));
   }
 
   m_slots.clear();
+  m_tailCalls.clear();
+  m_function = fn;
   stackSlot = 0;
   capturesScope = fn->body->env->capturesScope;
+  collectTailCalls(fn->body.get());
   fn->body->visit(this);
+  m_function = nullptr;
 
   if (fn->needsScope) {
     emitOpcode(Opcode::release_lex_scope);
   }
 
   emitOpcode(Opcode::ret);
+  m_output = output;
+
+  // the size of the function's code, so the loader can skip over it
+  auto optimized = optimize(code.str(), index);
+  writeOperand(optimized.size());
+  *m_output << optimized;
+}
+
+// calls whose value is returned right away from the function
+void Generator::collectTailCalls(AST::NodeInterface *node) {
+  if (auto call = dynamic_cast<AST::Call *>(node)) {
+    m_tailCalls.insert(call);
+  } else if (auto block = dynamic_cast<AST::Block *>(node)) {
+    if (block->nodes.size()) {
+      collectTailCalls(block->nodes.back().get());
+    }
+  } else if (auto iff = dynamic_cast<AST::If *>(node)) {
+    collectTailCalls(iff->ifBody.get());
+    if (iff->elseBody) {
+      collectTailCalls(iff->elseBody.get());
+    }
+  } else if (auto match = dynamic_cast<AST::Match *>(node)) {
+    for (const auto &kase : match->cases) {
+      collectTailCalls(kase->body.get());
+    }
+  } else if (auto let = dynamic_cast<AST::Let *>(node)) {
+    collectTailCalls(let->block.get());
+  }
+}
+
+// optimizes a chunk of code, keeping its line table in sync
+std::string Generator::optimize(const std::string &code, int32_t chunk) {
+  std::vector<unsigned> offsets;
+  for (const auto &entry : m_lines) {
+    offsets.push_back(entry.offset);
+  }
+  auto optimized = Optimizer::optimize(code, &offsets);
+  Phases::allocated(optimized.size());
+
+  LineTable table { chunk, {} };
+  for (unsigned i = 0; i < m_lines.size(); i++) {
+    auto entry = m_lines[i];
+    entry.offset = offsets[i];
+    // the instructions of the previous entry were removed
+    if (table.entries.size() && table.entries.back().offset == entry.offset) {
+      table.entries.pop_back();
+    }
+    if (table.entries.empty() || table.entries.back().line != entry.line || table.entries.back().file != entry.file) {
+      table.entries.push_back(entry);
+    }
+  }
+  m_lines.clear();
+
+  if (table.entries.size()) {
+    m_lineTables.push_back(std::move(table));
+  }
+  return optimized;
+}
+
+// the following instructions were generated for the code at `loc`
+void Generator::markLocation(const Loc &loc) {
+  if (!m_program) {
+    return;
+  }
+
+  auto it = m_files.find(m_program);
+  if (it == m_files.end()) {
+    it = m_files.emplace(m_program, uniqueString(m_program->filename)).first;
+  }
+
+  LineEntry entry { (unsigned)m_output->tellp(), it->second, m_program->lineFor(loc) };
+  if (m_lines.size() && m_lines.back().offset == entry.offset) {
+    m_lines.back() = entry;
+  } else if (m_lines.empty() || m_lines.back().line != entry.line || m_lines.back().file != entry.file) {
+    m_lines.push_back(entry);
+  }
 }
 
 void Generator::write(int64_t data) {
   m_output->write(reinterpret_cast<char *>(&data), sizeof(data));
 }
 
+void Generator::writeOperand(int32_t data) {
+  m_output->write(reinterpret_cast<char *>(&data), sizeof(data));
+}
+
 void Generator::write(const std::string &data) {
   *m_output << data;
   m_output->put(0);
 }
 
 void Generator::emitOpcode(Opcode::Type opcode) {
-  if (m_shouldLink) {
-    write(Opcode::address(opcode));
-  } else {
-    write(opcode);
-  }
+  m_output->put(static_cast<uint8_t>(opcode));
 }
 
 void Generator::emitJmp(Opcode::Type jmpType, AST::BlockPtr &body)  {
@@ -119,18 +223,26 @@ void Generator::emitJmp(Opcode::Type jmpType, AST::BlockPtr &body)  {
 }
 
 void Generator::emitJmp(Opcode::Type jmpType, AST::BlockPtr &body, bool skipNextJump)  {
+  unsigned jmpPosition = m_output->tellp();
   emitOpcode(jmpType);
-  unsigned beforePos = m_output->tellp();
-  write(0); // placeholder
+  writeOperand(0); // placeholder
 
   body->visit(this);
 
-  unsigned afterPos = m_output->tellp();
-  m_output->seekp(beforePos);
-  write((afterPos - beforePos)
-      + (skipNextJump ? (3 * WORD_SIZE) : WORD_SIZE) // special case for if with else
-  );
-  m_output->seekp(afterPos);
+  unsigned target = m_output->tellp();
+  if (skipNextJump) {
+    // special case for if with else
+    target += Opcode::instructionSize(Opcode::jmp);
+  }
+  patchJmp(jmpPosition, target);
+}
+
+// jump offsets are relative to the jump instruction itself
+void Generator::patchJmp(unsigned jmpPosition, unsigned target) {
+  unsigned position = m_output->tellp();
+  m_output->seekp(jmpPosition + OPCODE_SIZE);
+  writeOperand(target - jmpPosition);
+  m_output->seekp(position);
 }
 
 unsigned Generator::uniqueString(std::string &str) {
@@ -139,6 +251,7 @@ unsigned Generator::uniqueString(std::string &str) {
     return it - m_strings.begin();
   } else {
     unsigned id = m_strings.size();
+    Phases::allocated(str.size() + 1);
     m_strings.push_back(str);
     return id;
   }
@@ -162,16 +275,29 @@ void Generator::visitCall(AST::Call *call) {
   }
 
   call->callee->visit(this);
+  markLocation(call->loc());
+
+  if (m_tailCalls.find(call) != m_tailCalls.end()) {
+    // the callee reuses the current frame, so release everything the
+    // function set up before jumping to it
+    if (m_function->needsScope) {
+      emitOpcode(Opcode::release_lex_scope);
+    }
+    emitOpcode(Opcode::tail_call);
+    writeOperand(call->arguments.size());
+    writeOperand(m_function->body->stackSlots > 0);
+    return;
+  }
 
   emitOpcode(Opcode::call);
-  write(call->arguments.size());
+  writeOperand(call->arguments.size());
 }
 
 
 void Generator::visitIdentifier(AST::Identifier *ident) {
   if (ident->isFunctionParameter) {
     emitOpcode(Opcode::push_arg);
-    write(ident->index);
+    writeOperand(ident->index);
     return;
   }
 
@@ -179,38 +305,38 @@ void Generator::visitIdentifier(AST::Identifier *ident) {
     auto it = m_slots.find(ident->name);
     if (it != m_slots.end()) {
       emitOpcode(Opcode::stack_load);
-      write(it->second);
+      writeOperand(it->second);
       return;
     }
   }
 
   emitOpcode(Opcode::lookup);
   auto name = namespaced(ident->ns, ident->name);
-  write(uniqueString(name));
+  writeOperand(uniqueString(name));
 
   // temporarily disable lookup cache - logic is weak
-  write(0);
+  writeOperand(0);
   //if (capturesScope) {
-    //write(0);
+    //writeOperand(0);
   //} else {
-    //write(lookupID++);
+    //writeOperand(lookupID++);
   //}
 }
 
 void Generator::visitString(AST::String *str) {
   emitOpcode(Opcode::load_string);
-  write(uniqueString(str->value));
+  writeOperand(uniqueString(str->value));
 }
 
 void Generator::visitList(AST::List *lst) {
   emitOpcode(Opcode::alloc_list);
-  write(lst->items.size() + 1);
+  writeOperand(lst->items.size() + 1);
 
   unsigned index = 1;
   for (const auto &item : lst->items) {
     item->visit(this);
     emitOpcode(Opcode::obj_store_at);
-    write(index++);
+    writeOperand(index++);
   }
 }
 
@@ -227,25 +353,33 @@ void Generator::visitIf(AST::If *iff) {
 
 void Generator::visitProgram(AST::Program *program) {
   for (const auto &import : program->imports) {
-    import->visit(this);
+    // modules are shared between importers, only emit each of them once
+    if (m_modules.insert(import.get()).second) {
+      import->visit(this);
+    }
   }
 
+  // every program allocates its own stack slots
+  m_program = program;
+  m_slots.clear();
+  stackSlot = 0;
   visitBlock(program);
 }
 
 void Generator::visitBlock(AST::Block *block) {
   if (block->stackSlots > 0) {
     emitOpcode(Opcode::stack_alloc);
-    write(block->stackSlots * WORD_SIZE);
+    writeOperand(block->stackSlots * WORD_SIZE);
   }
 
   for (const auto &node : block->nodes) {
+    markLocation(node->loc());
     node->visit(this);
   }
 
   if (block->stackSlots > 0) {
     emitOpcode(Opcode::stack_free);
-    write(block->stackSlots * WORD_SIZE);
+    writeOperand(block->stackSlots * WORD_SIZE);
   }
 }
 
@@ -256,11 +390,12 @@ void Generator::visitBinaryOperation(AST::BinaryOperation *binop) {
   auto opstr = std::string(reinterpret_cast<char *>(&binop->op));
 
   emitOpcode(Opcode::lookup);
-  write(uniqueString(opstr));
-  write(lookupID++);
+  writeOperand(uniqueString(opstr));
+  writeOperand(lookupID++);
 
+  markLocation(binop->loc());
   emitOpcode(Opcode::call);
-  write(2);
+  writeOperand(2);
 }
 
 void Generator::visitUnaryOperation(AST::UnaryOperation *unop) {
@@ -269,81 +404,84 @@ void Generator::visitUnaryOperation(AST::UnaryOperation *unop) {
   auto opstr = "unary_" + std::string(reinterpret_cast<char *>(&unop->op));
 
   emitOpcode(Opcode::lookup);
-  write(uniqueString(opstr));
-  write(lookupID++);
+  writeOperand(uniqueString(opstr));
+  writeOperand(lookupID++);
 
+  markLocation(unop->loc());
   emitOpcode(Opcode::call);
-  write(1);
+  writeOperand(1);
 }
 
 void Generator::visitMatch(AST::Match *match) {
+  // evaluate the value being matched only once
+  auto valueSlot = stackSlot++;
+  match->value->visit(this);
+  emitOpcode(Opcode::stack_store);
+  writeOperand(valueSlot);
+  emitOpcode(Opcode::stack_load);
+  writeOperand(valueSlot);
+
+  // dispatch on the object's tag through a jump table with one entry per tag,
+  // entries left as 0 have no matching case and fail at runtime
+  unsigned count = 0;
+  for (const auto &kase : match->cases) {
+    count = std::max(count, kase->pattern->tag + 1);
+  }
+
+  unsigned switchPosition = m_output->tellp();
+  emitOpcode(Opcode::switch_tag);
+  writeOperand(count);
+  for (unsigned i = 0; i < count; i++) {
+    writeOperand(0); // placeholder
+  }
+
   const auto size = match->cases.size();
-  long long pos[size - 1];
+  std::vector<bool> covered(count, false);
+  std::vector<unsigned> exits;
   for (unsigned i = 0; i < size; i++) {
     const auto &kase = match->cases[i];
 
-    match->value->visit(this);
-
-    emitOpcode(Opcode::obj_load);
-    write(-1);
+    // the first case for a tag wins, later ones are unreachable
+    auto tag = kase->pattern->tag;
+    if (!covered[tag]) {
+      covered[tag] = true;
+      unsigned position = m_output->tellp();
+      m_output->seekp(switchPosition + OPCODE_SIZE + OPERAND_SIZE * (1 + tag));
+      writeOperand(position - switchPosition);
+      m_output->seekp(position);
+    }
 
-    emitOpcode(Opcode::push);
-    write(kase->pattern->tag);
-
-    std::string fnName = std::string("==");
-    emitOpcode(Opcode::lookup);
-    write(uniqueString(fnName));
-    write(lookupID++);
-    emitOpcode(Opcode::call);
-    write(2);
-
-    emitOpcode(Opcode::jz);
-    auto offset = m_output->tellp();
-    write(0);
     for (unsigned j = 0; j < kase->pattern->values.size(); j++) {
       auto slot = stackSlot++;
       m_slots[kase->pattern->values[j]->name] = slot;
-      match->value->visit(this);
+      emitOpcode(Opcode::stack_load);
+      writeOperand(valueSlot);
       emitOpcode(Opcode::obj_load);
-      write(j);
+      writeOperand(j);
       emitOpcode(Opcode::stack_store);
-      write(slot);
+      writeOperand(slot);
     }
     kase->body->visit(this);
-    auto end = m_output->tellp();
-    m_output->seekp(offset);
-
-    unsigned extra = WORD_SIZE;
-    auto jmp = i < size - 1;
-    if (jmp) {
-      extra += 2 * WORD_SIZE;
-    }
-
-    write((unsigned)(end - offset) + extra);
-    m_output->seekp(end);
 
-    if (jmp) {
+    if (i < size - 1) {
+      exits.push_back(m_output->tellp());
       emitOpcode(Opcode::jmp);
-      pos[i] = m_output->tellp();
-      write(0);
+      writeOperand(0);
     }
   }
 
-  auto p = m_output->tellp();
-  for (unsigned i = 0; i < size - 1; i++) {
-    m_output->seekp(pos[i] );
-    unsigned off = (long)p - pos[i];
-    write(off + WORD_SIZE);
+  unsigned end = m_output->tellp();
+  for (auto exit : exits) {
+    patchJmp(exit, end);
   }
-  m_output->seekp(p);
 }
 
 static void handleCapture(AST::IdentifierPtr ident, unsigned stackSlot, Generator *gen) {
   if (ident->isCaptured) {
     gen->emitOpcode(Opcode::stack_load);
-    gen->write(stackSlot);
+    gen->writeOperand(stackSlot);
     gen->emitOpcode(Opcode::put_to_scope);
-    gen->write(gen->uniqueString(ident->name));
+    gen->writeOperand(gen->uniqueString(ident->name));
   }
 }
 
@@ -353,25 +491,25 @@ void Generator::visitAssignment(AST::Assignment *assignment) {
     assignment->value->visit(this);
     m_slots[assignment->left.ident->name] = slot;
     emitOpcode(Opcode::stack_store);
-    write(slot);
+    writeOperand(slot);
 
     handleCapture(assignment->left.ident, slot, this);
   } else if (assignment->kind == AST::Assignment::Pattern) {
     assignment->value->visit(this);
 
     emitOpcode(Opcode::obj_tag_test);
-    write(assignment->left.pattern->tag);
+    writeOperand(assignment->left.pattern->tag);
 
     for (unsigned i = 0; i < assignment->left.pattern->values.size(); i++) {
       assignment->value->visit(this);
       emitOpcode(Opcode::obj_load);
-      write(i);
+      writeOperand(i);
 
       auto slot = stackSlot++;
       auto ident = assignment->left.pattern->values[i];
       m_slots[ident->name] = slot;
       emitOpcode(Opcode::stack_store);
-      write(slot);
+      writeOperand(slot);
 
       handleCapture(ident, slot, this);
     }
@@ -382,13 +520,13 @@ void Generator::visitAssignment(AST::Assignment *assignment) {
 
 void Generator::visitConstructor(AST::Constructor *ctor) {
   emitOpcode(Opcode::alloc_obj);
-  write(ctor->size + 1); // args + tag
-  write(ctor->tag); // tag
+  writeOperand(ctor->size + 1); // args + tag
+  writeOperand(ctor->tag); // tag
 
   for (unsigned i = 0; i < ctor->arguments.size(); i++) {
     ctor->arguments[i]->visit(this);
     emitOpcode(Opcode::obj_store_at);
-    write(i + 1); // skip tag
+    writeOperand(i + 1); // skip tag
   }
 }
 
@@ -401,14 +539,15 @@ void Generator::visitFunction(AST::Function *fn) {
   }
 
   emitOpcode(Opcode::create_closure);
-  write(m_functions.size());
-  write(fn->body->env->capturesScope);
+  writeOperand(m_functions.size());
+  writeOperand(fn->body->env->capturesScope);
   if (fn->name != "_") {
     emitOpcode(Opcode::bind);
     auto name = namespaced(fn->ns, fn->name);
-    write(uniqueString(name));
+    writeOperand(uniqueString(name));
   }
   m_functions.push_back(fn);
+  m_functionPrograms.push_back(m_program);
 }
 
 }
@@ -1,6 +1,7 @@
 #include <fstream>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "ast/nodes.h"
 #include "ast/visitor.h"
@@ -12,21 +13,25 @@ namespace Verve {
 
 class Generator : public AST::Visitor {
 public:
-  static void generate(AST::NodePtr, bool shouldLink, std::stringstream *bytecode);
+  static void generate(AST::NodePtr, std::stringstream *bytecode);
 
   void emitOpcode(Opcode::Type);
   void emitJmp(Opcode::Type, AST::BlockPtr &);
   void emitJmp(Opcode::Type, AST::BlockPtr &, bool);
+  void patchJmp(unsigned jmpPosition, unsigned target);
   void write(int64_t);
   void write(const std::string &);
+  void writeOperand(int32_t);
   unsigned uniqueString(std::string &);
 
 private:
-  Generator(bool shouldLink, std::stringstream *output) :
-    m_shouldLink(shouldLink),
+  Generator(std::stringstream *output) :
     m_output(output) {}
 
-  void generateFunctionSource(AST::Function *fn);
+  void generateFunctionSource(AST::Function *fn, unsigned index);
+  std::string optimize(const std::string &code, int32_t chunk);
+  void markLocation(const Loc &loc);
+  void collectTailCalls(AST::NodeInterface *node);
 
   /** Visitors **/
   virtual void visitNumber(AST::Number *);
@@ -44,11 +49,30 @@ private:
   virtual void visitConstructor(AST::Constructor *);
   virtual void visitFunction(AST::Function *);
 
-  bool m_shouldLink;
   std::stringstream *m_output;
   std::vector<std::string> m_strings;
   std::vector<AST::Function *> m_functions;
+  std::vector<AST::Program *> m_functionPrograms;
+  std::unordered_set<AST::Program *> m_modules;
   std::unordered_map<std::string, unsigned> m_slots;
+  std::unordered_set<AST::Call *> m_tailCalls;
+  AST::Function *m_function = nullptr;
+
+  // line table of the code being generated, and of every finished chunk
+  // of code: a function's index or -1 for the text
+  struct LineEntry {
+    unsigned offset;
+    unsigned file;
+    unsigned line;
+  };
+  struct LineTable {
+    int32_t chunk;
+    std::vector<LineEntry> entries;
+  };
+  AST::Program *m_program = nullptr;
+  std::unordered_map<AST::Program *, unsigned> m_files;
+  std::vector<LineEntry> m_lines;
+  std::vector<LineTable> m_lineTables;
 
   unsigned lookupID = 1;
   unsigned stackSlot = 0;
@@ -1,9 +1,16 @@
 #include "utils/macros.h"
 
+#include <cstdint>
+#include <cstring>
+
 #pragma once
 
 #define WORD_SIZE 8
 
+// Instructions are a 1-byte opcode followed by its 32-bit operand slots
+#define OPCODE_SIZE 1
+#define OPERAND_SIZE 4
+
 #define OPCODE_ADDRESS(__op, _) (uintptr_t)op_##__op,
 
 #define EXTERN_OPCODE(opcode, _) \
@@ -12,7 +19,7 @@
 #define OPCODES \
       ret, 0, \
       bind, 1, \
-      push, 1, \
+      push, 2, /* 64-bit immediate */ \
       call, 1, \
       jz, 1, \
       jmp, 1, \
@@ -32,7 +39,11 @@
       stack_alloc, 1, \
       stack_store, 1, \
       stack_load, 1, \
-      stack_free, 1
+      stack_free, 1, \
+      switch_tag, 1, /* followed by a jump table with one offset per tag */ \
+      tail_call, 2, /* argc, whether to free the function's stack slots */ \
+      jit_enter, 1, /* runtime only: replaces a function's first instruction */ \
+      jit_resume, 2 /* runtime only: 64-bit address of native code */
 
 EVAL(MAP_2(EXTERN_OPCODE, OPCODES))
 
@@ -46,17 +57,33 @@ class Opcode {
 
   EVAL(ENUM(Type, MAP_2(FIRST_WITH_COMMA, OPCODES)));
 
-  static uintptr_t address(Opcode::Type t) {
-    return (uintptr_t []) {
-      EVAL(MAP_2(OPCODE_ADDRESS, OPCODES))
-    }[(int)t];
-  }
-
+  // number of operand slots
   static unsigned size(Opcode::Type t) {
     return (unsigned []) {
       EVAL(MAP_2(SECOND_WITH_COMMA, OPCODES))
     }[(int)t];
   }
+
+  static unsigned count() {
+    return sizeof((unsigned []) {
+      EVAL(MAP_2(SECOND_WITH_COMMA, OPCODES))
+    }) / sizeof(unsigned);
+  }
+
+  static unsigned instructionSize(Opcode::Type t) {
+    return OPCODE_SIZE + size(t) * OPERAND_SIZE;
+  }
+
+  static unsigned instructionSize(const uint8_t *instruction) {
+    auto opcode = static_cast<Opcode::Type>(*instruction);
+    auto size = instructionSize(opcode);
+    if (opcode == Opcode::switch_tag) {
+      int32_t count;
+      memcpy(&count, instruction + OPCODE_SIZE, OPERAND_SIZE);
+      size += count * OPERAND_SIZE;
+    }
+    return size;
+  }
 };
 
 }
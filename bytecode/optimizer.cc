@@ -0,0 +1,191 @@
+#include "optimizer.h"
+
+#include <cassert>
+#include <cstring>
+#include <unordered_map>
+
+namespace Verve {
+
+std::string Optimizer::optimize(const std::string &code, std::vector<unsigned> *offsets) {
+  Optimizer optimizer(code);
+  optimizer.decode();
+  optimizer.threadJumps();
+  optimizer.eliminateDeadCode();
+  optimizer.dropRedundantJumps();
+  auto optimized = optimizer.encode();
+
+  if (offsets) {
+    for (auto &offset : *offsets) {
+      auto it = optimizer.m_indexes.find(offset);
+      assert(it != optimizer.m_indexes.end());
+      offset = optimizer.m_offsets[optimizer.nextLive(it->second)];
+    }
+  }
+
+  return optimized;
+}
+
+Optimizer::Optimizer(const std::string &code) :
+  m_code(code) {}
+
+std::vector<unsigned> Optimizer::jumpOperands(const Instruction &instruction) {
+  switch (instruction.opcode) {
+    case Opcode::jmp:
+    case Opcode::jz:
+      return { 0 };
+    case Opcode::switch_tag: {
+      // table entries with offset 0 have no case and don't jump anywhere
+      std::vector<unsigned> operands;
+      for (unsigned i = 1; i < instruction.operands.size(); i++) {
+        if (instruction.operands[i] != 0) {
+          operands.push_back(i);
+        }
+      }
+      return operands;
+    }
+    default:
+      return {};
+  }
+}
+
+bool Optimizer::isTerminator(Opcode::Type opcode) {
+  return opcode == Opcode::jmp || opcode == Opcode::ret || opcode == Opcode::exit ||
+    opcode == Opcode::switch_tag || opcode == Opcode::tail_call;
+}
+
+void Optimizer::decode() {
+  auto &indexes = m_indexes;
+  unsigned offset = 0;
+  while (offset < m_code.size()) {
+    Instruction instruction;
+    instruction.opcode = static_cast<Opcode::Type>((uint8_t)m_code[offset]);
+    instruction.offset = offset;
+    instruction.live = true;
+
+    auto bytes = reinterpret_cast<const uint8_t *>(m_code.data()) + offset;
+    auto size = Opcode::instructionSize(bytes);
+    auto operands = m_code.data() + offset + OPCODE_SIZE;
+    for (unsigned i = 0; i < (size - OPCODE_SIZE) / OPERAND_SIZE; i++) {
+      int32_t operand;
+      memcpy(&operand, operands + i * OPERAND_SIZE, OPERAND_SIZE);
+      instruction.operands.push_back(operand);
+    }
+
+    indexes[offset] = m_instructions.size();
+    m_instructions.push_back(instruction);
+    offset += size;
+  }
+  // jumping to the end of the code is the same as jumping to index `size`
+  indexes[offset] = m_instructions.size();
+
+  for (auto &instruction : m_instructions) {
+    for (auto operand : jumpOperands(instruction)) {
+      auto it = indexes.find(instruction.offset + instruction.operands[operand]);
+      assert(it != indexes.end());
+      instruction.targets.push_back({ operand, it->second });
+    }
+  }
+}
+
+void Optimizer::threadJumps() {
+  const auto size = m_instructions.size();
+  for (auto &instruction : m_instructions) {
+    for (auto &t : instruction.targets) {
+      // bound the number of hops, so loops of jumps can't hang the compiler
+      for (unsigned hops = 0; t.index < size && hops < size; hops++) {
+        auto &target = m_instructions[t.index];
+        if (target.opcode != Opcode::jmp) {
+          break;
+        }
+        t.index = target.targets[0].index;
+      }
+    }
+
+    if (instruction.opcode == Opcode::jmp && instruction.targets[0].index < size) {
+      auto &target = m_instructions[instruction.targets[0].index];
+      if (target.opcode == Opcode::ret || target.opcode == Opcode::exit) {
+        instruction.opcode = target.opcode;
+        instruction.operands = target.operands;
+        instruction.targets.clear();
+      }
+    }
+  }
+}
+
+void Optimizer::eliminateDeadCode() {
+  const auto size = m_instructions.size();
+  std::vector<bool> reachable(size, false);
+  std::vector<unsigned> worklist { 0 };
+
+  while (!worklist.empty()) {
+    auto index = worklist.back();
+    worklist.pop_back();
+
+    if (index >= size || reachable[index]) {
+      continue;
+    }
+    reachable[index] = true;
+
+    auto &instruction = m_instructions[index];
+    for (auto &t : instruction.targets) {
+      worklist.push_back(t.index);
+    }
+    if (!isTerminator(instruction.opcode)) {
+      worklist.push_back(index + 1);
+    }
+  }
+
+  for (unsigned i = 0; i < size; i++) {
+    m_instructions[i].live = reachable[i];
+  }
+}
+
+void Optimizer::dropRedundantJumps() {
+  for (unsigned i = 0; i < m_instructions.size(); i++) {
+    auto &instruction = m_instructions[i];
+    if (instruction.live && instruction.opcode == Opcode::jmp && nextLive(i + 1) == nextLive(instruction.targets[0].index)) {
+      instruction.live = false;
+    }
+  }
+}
+
+unsigned Optimizer::nextLive(unsigned index) {
+  while (index < m_instructions.size() && !m_instructions[index].live) {
+    index++;
+  }
+  return index;
+}
+
+std::string Optimizer::encode() {
+  auto &offsets = m_offsets;
+  offsets.resize(m_instructions.size() + 1);
+  unsigned offset = 0;
+  for (unsigned i = 0; i < m_instructions.size(); i++) {
+    offsets[i] = offset;
+    if (m_instructions[i].live) {
+      offset += OPCODE_SIZE + m_instructions[i].operands.size() * OPERAND_SIZE;
+    }
+  }
+  offsets[m_instructions.size()] = offset;
+
+  std::string code;
+  code.reserve(offset);
+  for (unsigned i = 0; i < m_instructions.size(); i++) {
+    auto &instruction = m_instructions[i];
+    if (!instruction.live) {
+      continue;
+    }
+
+    for (auto &t : instruction.targets) {
+      instruction.operands[t.operand] = offsets[nextLive(t.index)] - offsets[i];
+    }
+
+    code.push_back(static_cast<char>(instruction.opcode));
+    for (auto operand : instruction.operands) {
+      code.append(reinterpret_cast<char *>(&operand), OPERAND_SIZE);
+    }
+  }
+  return code;
+}
+
+}
@@ -0,0 +1,57 @@
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "opcodes.h"
+
+#pragma once
+
+namespace Verve {
+
+// Control flow clean up over a self-contained piece of generated code (a
+// function body or the program's text): jumps (including the entries of a
+// `switch_tag` jump table) to unconditional jumps are
+// threaded to their final target, jumps to `ret`/`exit` are replaced by the
+// terminator itself, jumps to the next instruction are dropped and
+// unreachable instructions are removed.
+class Optimizer {
+public:
+  // `offsets` are instruction offsets into `code`, updated to the offset
+  // of the same instruction (or the next one left) in the optimized code
+  static std::string optimize(const std::string &code, std::vector<unsigned> *offsets = nullptr);
+
+private:
+  // a jump offset stored in `operands[operand]`, resolved to an instruction index
+  struct Target {
+    unsigned operand;
+    unsigned index;
+  };
+
+  struct Instruction {
+    Opcode::Type opcode;
+    std::vector<int32_t> operands;
+    unsigned offset;
+    std::vector<Target> targets;
+    bool live;
+  };
+
+  Optimizer(const std::string &code);
+
+  void decode();
+  void threadJumps();
+  void eliminateDeadCode();
+  void dropRedundantJumps();
+  std::string encode();
+
+  unsigned nextLive(unsigned index);
+
+  static std::vector<unsigned> jumpOperands(const Instruction &);
+  static bool isTerminator(Opcode::Type);
+
+  const std::string &m_code;
+  std::vector<Instruction> m_instructions;
+  std::unordered_map<unsigned, unsigned> m_indexes;
+  std::vector<unsigned> m_offsets;
+};
+
+}
@@ -10,5 +10,6 @@ struct Section {
     Strings,
     Functions,
     Text,
+    Lines,
   );
 };
@@ -1,3 +1,5 @@
+#include "utils/phases.h"
+
 #include <memory>
 #include <unordered_map>
 #include <string>
@@ -15,6 +17,7 @@ namespace Verve {
 
   struct Environment : public std::enable_shared_from_this<Environment> {
     EnvPtr create() {
+      Phases::allocated(sizeof(Environment));
       auto env = std::make_shared<Environment>();
       env->m_parent = shared_from_this();
       return env;
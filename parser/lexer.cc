@@ -2,6 +2,8 @@
 
 #include "token.h"
 
+#include "utils/phases.h"
+
 #include <cassert>
 #include <cmath>
 #include <cstdarg>
@@ -54,6 +56,7 @@ namespace Verve {
   }
 
   void Lexer::nextToken() {
+    Phases::Timer timer(Phases::Lexing);
     char c;
     m_prevToken = std::move(m_token);
 
@@ -281,6 +284,17 @@ start:
     return pos;
   }
 
+  // offset of the first character of every line
+  std::vector<unsigned> Lexer::lineStarts() const {
+    std::vector<unsigned> starts { 0 };
+    for (unsigned i = 0; m_input[i]; i++) {
+      if (m_input[i] == '\n') {
+        starts.push_back(i + 1);
+      }
+    }
+    return starts;
+  }
+
   void Lexer::printSource() {
     printSource(m_token.loc);
   }
@@ -1,5 +1,6 @@
 #include <fstream>
 #include <memory>
+#include <vector>
 
 #include "./token.h"
 
@@ -42,6 +43,9 @@ namespace Verve {
 
       static std::string tokenType(Token &token);
 
+      const std::string &filename() const { return m_filename; }
+      std::vector<unsigned> lineStarts() const;
+
     private:
       char nextChar();
 
@@ -38,14 +38,20 @@ void Naming::visitIdentifier(Identifier *ident) {
       while (s != nodesEnv) {
         if (s->escapes) {
           shouldCapture = true;
-          break;
+          s->capturesScope = true;
         }
         s = s->parent();
       }
 
       if (shouldCapture) {
         ident->isCaptured = true;
-        nodesEnv->isRequired = true;
+        // captured variables are put to the scope of the enclosing function
+        for (auto e = nodesEnv; e; e = e->parent()) {
+          e->isRequired = true;
+          if (e->escapes) {
+            break;
+          }
+        }
         m_env->capturesScope = true;
       }
     }
@@ -136,6 +142,7 @@ void Naming::visitFunction(Function *fn) {
     param->visit(this);
   }
   fn->body->visit(this);
+  fn->needsScope = m_env->isRequired;
 }
 
 }
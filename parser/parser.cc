@@ -6,7 +6,10 @@
 #include "type_checker.h"
 
 #include "utils/file.h"
+#include "utils/phases.h"
 
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 
 std::string ROOT_DIR = "";
@@ -14,6 +17,7 @@ std::string ROOT_DIR = "";
 namespace Verve {
 
   static EnvPtr createEnv() {
+    Phases::allocated(sizeof(Environment));
     auto env = std::make_shared<Environment>();
 
     env->create("char").type = new BasicType("char");
@@ -27,6 +31,15 @@ namespace Verve {
     list->generics.push_back("t");
     env->create("list").type = list;
 
+    // a runtime object, see runtime/channels.h
+    auto channel = new EnumType();
+    channel->name = "channel";
+    channel->generics.push_back("t");
+    env->create("channel").type = channel;
+
+    // see runtime/io.h
+    env->create("file").type = new BasicType("file");
+
     auto string = new DataTypeInstance();
     string->dataType = list;
     string->types.push_back(env->get("char").type);
@@ -35,20 +48,25 @@ namespace Verve {
     return env;
   }
 
-  Parser::Parser(Lexer &lexer, std::string dirname, std::string ns) :
-    m_lexer(lexer), m_dirname(dirname), m_ns(ns)
+  Parser::Parser(Lexer &lexer, std::string dirname, std::string ns, CompilationPtr compilation) :
+    m_lexer(lexer), m_dirname(dirname), m_ns(ns), m_compilation(compilation)
   {
     m_env = createEnv();
+    if (!m_compilation) {
+      m_compilation = std::make_shared<Compilation>();
+    }
   }
 
-  static auto isPrelude = false;
   AST::ProgramPtr Parser::parse() {
+    Phases::Timer parsing(Phases::Parsing);
     auto program = AST::createProgram(Loc{0, 0});
+    program->filename = m_lexer.filename();
+    program->lineStarts = m_lexer.lineStarts();
 
-    if (!isPrelude) {
-      isPrelude = true;
+    if (!m_compilation->parsingPrelude) {
+      m_compilation->parsingPrelude = true;
       program->imports.push_back(import("runtime/prelude", {}, "", ROOT_DIR));
-      isPrelude = false;
+      m_compilation->parsingPrelude = false;
     }
 
     m_blockStack.push_back(program);
@@ -65,10 +83,17 @@ namespace Verve {
       }
     }
     m_blockStack.pop_back();
+    parsing.stop();
 
-    AST::Naming naming(m_env);
-    program->visit(&naming);
-    TypeChecker::check(program, m_env, m_lexer);
+    {
+      Phases::Timer timer(Phases::Naming);
+      AST::Naming naming(m_env);
+      program->visit(&naming);
+    }
+    {
+      Phases::Timer timer(Phases::TypeChecking);
+      TypeChecker::check(program, m_env, m_lexer);
+    }
     m_ast = program;
     return program;
   }
@@ -97,19 +122,38 @@ namespace Verve {
   }
 
   AST::ProgramPtr Parser::import(std::string path, std::vector<std::string>  imports, std::string ns, std::string dirname) {
-    auto parser = parseFile(path, dirname, ns);
+    Phases::Timer timer(Phases::Imports);
+    auto &module = loadModule(path, ns, dirname);
 
-   if (imports.size() == 0) {
-      for (auto it : parser.m_env->entries()) {
+    if (imports.size() == 0) {
+      for (auto it : module.exports->entries()) {
         m_env->create(namespaced(ns, it.first)) = it.second;
       }
     } else {
       for (auto import : imports) {
-        m_env->create(namespaced(ns, import)) = parser.m_env->get(import);
+        m_env->create(namespaced(ns, import)) = module.exports->get(import);
       }
     }
 
-    return parser.m_ast;
+    return module.ast;
+  }
+
+  Parser::Compilation::Module &Parser::loadModule(std::string path, std::string ns, std::string dirname) {
+    auto filename = dirname + "/" + path + ".vrv";
+    char resolved[PATH_MAX];
+    if (realpath(filename.c_str(), resolved)) {
+      filename = resolved;
+    }
+
+    auto &modules = m_compilation->modules;
+    auto key = namespaced(ns, filename);
+    auto it = modules.find(key);
+    if (it != modules.end()) {
+      return it->second;
+    }
+
+    auto parser = parseFile(path, dirname, ns, m_compilation);
+    return modules[key] = Compilation::Module { parser.m_env, parser.m_ast };
   }
 
   AST::NodePtr Parser::parseDecl() {
@@ -393,6 +437,8 @@ namespace Verve {
   AST::MatchPtr Parser::parseMatch() {
     auto match = AST::createMatch(token().loc);
     match->value = parseExpr();
+    // the generator keeps the value being matched in a stack slot
+    m_blockStack.back()->stackSlots++;
 
     this->match('{');
     while (!skip('}')) {
@@ -491,7 +537,52 @@ namespace Verve {
     } else {
       callee = parseIdentifier();
     }
-    return parseCall(callee);
+
+    if (!nextIsTypeArguments()) {
+      return parseCall(callee);
+    }
+    std::vector<AST::AbstractTypePtr> typeArguments;
+    match('<');
+    do {
+      typeArguments.push_back(parseType());
+    } while (skip(','));
+    match('>');
+
+    auto loc = token().loc;
+    auto call = AST::asCall(parseCall(callee));
+    if (!call) {
+      m_lexer.error(loc, "Expected a call after the type arguments");
+    }
+    call->typeArguments = std::move(typeArguments);
+    return call;
+  }
+
+  // `f<int>(x)` rather than `f < int`: only types and commas up to the
+  // matching `>`, and a `(` right after it
+  bool Parser::nextIsTypeArguments() {
+    if (!next('<')) {
+      return false;
+    }
+
+    auto loc = token().loc;
+    unsigned depth = 0;
+    bool isTypeArguments = false;
+    while (true) {
+      if (skip('<')) {
+        depth++;
+      } else if (skip('>')) {
+        if (--depth == 0) {
+          isTypeArguments = next('(');
+          break;
+        }
+      } else if (next(Token::LCID)) {
+        m_lexer.nextToken();
+      } else if (!skip(',')) {
+        break;
+      }
+    }
+    m_lexer.rewind(loc);
+    return isTypeArguments;
   }
 
   AST::ConstructorPtr Parser::parseConstructor(std::string ucid) {
@@ -1,4 +1,5 @@
 #include <memory>
+#include <unordered_map>
 
 #include "ast/nodes.h"
 
@@ -16,7 +17,23 @@ namespace Verve {
   class Parser {
   public:
 
-    Parser(Lexer &lexer, std::string dirname, std::string ns = "");
+    // What the parsers of one program's files share. A module is parsed
+    // and type checked once per (file, namespace) pair: its environment is
+    // the export table copied into every importer, and its AST is shared,
+    // so the generator only emits it once.
+    struct Compilation {
+      struct Module {
+        EnvPtr exports;
+        AST::ProgramPtr ast;
+      };
+      std::unordered_map<std::string, Module> modules;
+      // the prelude doesn't import itself
+      bool parsingPrelude = false;
+    };
+    typedef std::shared_ptr<Compilation> CompilationPtr;
+
+    // a new compilation starts unless one is given, see parseFile
+    Parser(Lexer &lexer, std::string dirname, std::string ns = "", CompilationPtr compilation = nullptr);
     AST::ProgramPtr parse();
 
   private:
@@ -26,6 +43,8 @@ namespace Verve {
 
     AST::ProgramPtr import(std::string path, std::vector<std::string>  imports, std::string ns, std::string dirname);
 
+    Compilation::Module &loadModule(std::string path, std::string ns, std::string dirname);
+
     AST::EnumTypePtr parseTypeDecl();
     AST::TypeConstructorPtr parseTypeConstructor();
 
@@ -56,6 +75,7 @@ namespace Verve {
     AST::ConstructorPtr parseConstructor(std::string ucid);
     AST::NodePtr parseIdentifierFunctionOrCall();
     AST::NodePtr parseCall(AST::NodePtr callee);
+    bool nextIsTypeArguments();
 
     AST::NodePtr parseExpr(int precedence = 0);
     AST::NodePtr parseFactor();
@@ -92,6 +112,7 @@ namespace Verve {
     std::string m_dirname;
     AST::ProgramPtr m_ast;
     std::string m_ns;
+    CompilationPtr m_compilation;
   };
 
   __used static std::string namespaced(std::string ns, std::string name) {
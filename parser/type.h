@@ -16,6 +16,12 @@ namespace Verve {
   struct TypeImplementation;
 
   struct Type {
+    // counted for --time-phases, types are only allocated with `new`
+    static void *operator new(size_t size) {
+      Phases::allocated(size);
+      return ::operator new(size);
+    }
+
     virtual bool accepts(Type *, EnvPtr) = 0;
     virtual std::string toString() = 0;
     virtual ~Type() {}
@@ -8,6 +8,8 @@
 #include "type_error.h"
 #include "type_helpers.h"
 
+#include "utils/phases.h"
+
 namespace Verve {
 
 void TypeChecker::check(AST::ProgramPtr program, EnvPtr env, Lexer &lexer) {
@@ -350,7 +352,8 @@ Type *FunctionType::typeof(EnvPtr env) {
 }
 
 Type *Prototype::typeof(EnvPtr env) {
-  auto t = dynamic_cast<TypeFunction *>(FunctionType::typeof(env));
+  // an extern has no body the generics should be visible to
+  auto t = dynamic_cast<TypeFunction *>(FunctionType::typeof(isExternal ? env->create() : env));
   name += s_implementationName;
   t->name = name;
   env->get(name).type = t;
@@ -359,6 +362,12 @@ Type *Prototype::typeof(EnvPtr env) {
 
 Type *Call::typeof(EnvPtr env) {
   env = env->create();
+  // before the callee's generics shadow the caller's
+  std::vector<Type *> types;
+  for (auto &typeArgument : typeArguments) {
+    types.push_back(typeArgument->typeof(env));
+  }
+
   auto calleeType = callee->typeof(env);
   auto fnType = dynamic_cast<TypeFunction *>(calleeType);
   if (!fnType) {
@@ -369,7 +378,7 @@ Type *Call::typeof(EnvPtr env) {
     env->create(fnType->interface->genericTypeName).type = fnType->interface;
   }
 
-  auto t = typeCheckArguments(arguments, fnType, env, loc());
+  auto t = typeCheckArguments(arguments, fnType, env, loc(), types);
 
   if (fnType->interface) {
     auto ident = asIdentifier(this->callee);
@@ -406,9 +415,11 @@ Type *Call::typeof(EnvPtr env) {
 
     if (!original->instances[name]) {
       // clone AST and re-run the naming phase
+      Phases::Timer instantiation(Phases::Instantiation);
       auto fn = asFunction(original->clone());
       AST::Naming naming(env->create());
       fn->visit(&naming);
+      instantiation.stop();
 
       // cache and append types used to instantiate to the name
       original->instances[name] = fn;
@@ -1,5 +1,7 @@
 #include "type_helpers.h"
 
+#include <algorithm>
+
 namespace Verve {
 
 std::string uniqueName(const std::string &name, EnvPtr env) {
@@ -70,14 +72,43 @@ Type *enumRetType(const TypeFunction *fnType, EnvPtr env) {
   return simplify(fnType->returnType, env);
 }
 
-TypeFunction *typeCheckArguments(const std::vector<AST::NodePtr> &arguments, const TypeFunction *fnType, EnvPtr env, const Loc &loc) {
+static bool mentions(Type *type, const std::string &generic) {
+  if (auto gt = dynamic_cast<GenericType *>(type)) {
+    return gt->typeName == generic;
+  } else if (auto dti = dynamic_cast<DataTypeInstance *>(type)) {
+    return std::any_of(dti->types.begin(), dti->types.end(), [&](Type *t) { return mentions(t, generic); });
+  } else if (auto fn = dynamic_cast<TypeFunction *>(type)) {
+    return mentions(fn->returnType, generic) ||
+      std::any_of(fn->types.begin(), fn->types.end(), [&](Type *t) { return mentions(t, generic); });
+  }
+  return false;
+}
+
+TypeFunction *typeCheckArguments(const std::vector<AST::NodePtr> &arguments, const TypeFunction *fnType, EnvPtr env, const Loc &loc, const std::vector<Type *> &typeArguments) {
   if (arguments.size() != fnType->types.size()) {
     throw TypeError(loc, "Wrong number of arguments for function call");
   }
+  if (typeArguments.size() && typeArguments.size() != fnType->generics.size()) {
+    throw TypeError(loc, "Wrong number of type arguments for function `%s`", fnType->name.c_str());
+  }
 
   auto t = new TypeFunction();
 
   loadGenerics(fnType->generics, env);
+  for (unsigned i = 0; i < typeArguments.size(); i++) {
+    env->get(fnType->generics[i]).type = typeArguments[i];
+  }
+
+  // the arguments can't tell what it returns (e.g. `make_channel(1)`)
+  if (typeArguments.empty()) {
+    for (const auto &generic : fnType->generics) {
+      if (mentions(fnType->returnType, generic) &&
+          std::none_of(fnType->types.begin(), fnType->types.end(), [&](Type *t) { return mentions(t, generic); })) {
+        throw TypeError(loc, "Can't infer the type argument `%s` of `%s`, pass it explicitly, as in `%s<int>(...)`",
+            Environment::reverseGenericMapping[generic].c_str(), fnType->name.c_str(), fnType->name.c_str());
+      }
+    }
+  }
 
   for (unsigned i = 0; i < fnType->types.size(); i++) {
     auto arg = arguments[i];
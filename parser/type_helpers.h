@@ -12,6 +12,7 @@ void loadGenerics(const std::vector<std::string> &generics, EnvPtr env);
 Type *simplify(Type *type, EnvPtr env);
 bool typeEq(Type *expected, Type *actual, EnvPtr env);
 Type *enumRetType(const TypeFunction *fnType, EnvPtr env);
-TypeFunction *typeCheckArguments(const std::vector<AST::NodePtr> &arguments, const TypeFunction *fnType, EnvPtr env, const Loc &loc);
+// `typeArguments`, if any, are the ones the call gave explicitly
+TypeFunction *typeCheckArguments(const std::vector<AST::NodePtr> &arguments, const TypeFunction *fnType, EnvPtr env, const Loc &loc, const std::vector<Type *> &typeArguments = {});
 bool usesInterface(Type *t, EnvPtr env);
 }
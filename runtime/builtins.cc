@@ -1,7 +1,11 @@
 #include "value.h"
 #include "vm.h"
+#include "workers.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
 
 extern "C" void *builtin_sub();
 extern "C" void *builtin_add();
@@ -14,7 +18,7 @@ namespace Verve {
 #define REGISTER(NAME, FN) \
     do { \
       Builtin FN##_ = (Builtin)FN;  \
-      vm.m_scope->set(#NAME, Value(FN##_)); \
+      vm.m_scope->set(vm.m_strings.intern(#NAME), Value(FN##_)); \
     } while(0)
 
     REGISTER(print_string, print_string);
@@ -45,10 +49,29 @@ namespace Verve {
     REGISTER(unary_!, _not);
     REGISTER(unary_-, minus);
 
+    REGISTER(parallel_map, parallel_map);
+    REGISTER(spawn, fiber_spawn);
+    REGISTER(yield, fiber_yield);
+    REGISTER(make_channel, make_channel);
+    REGISTER(make_shared_channel, make_shared_channel);
+    REGISTER(send, channel_send);
+    REGISTER(recv, channel_recv);
+    REGISTER(try_recv, channel_try_recv);
+    REGISTER(read_file, read_file);
+    REGISTER(write_file, write_file);
+    REGISTER(read_lines, read_lines);
+    REGISTER(open, open_file);
+    REGISTER(close, close_file);
+    REGISTER(read_line, read_line);
+    REGISTER(each_line, each_line);
+    REGISTER(stdin, stdin_file);
+    REGISTER(write_line, write_line);
+
     REGISTER(at, at);
     REGISTER(substr, substr);
     REGISTER(count, count);
     REGISTER(__heap-size__, heapSize);
+    REGISTER(__gc_stats__, gcStats);
   }
 
 
@@ -89,7 +112,7 @@ namespace Verve {
   VERVE_FUNCTION(print_string) {
     assert(argc == 1);
 
-    printf("%s", argv[0].asString().str());
+    printf("%s", argv[0].asString());
     putchar('\n');
 
     return 0;
@@ -110,12 +133,11 @@ namespace Verve {
 
     auto lst = argv[0].asList();
     auto size = lst->length > 0 ? lst->length - 1 : 0;
-    auto ret = (uint64_t *)calloc(size + 1, 8);
+    auto ret = (uint64_t *)vm->allocate((size + 1) * 8);
     ret[0] = size;
     for (unsigned i = 1; i < lst->length; i++) {
       ret[i] = lst->at(i).encode();
     }
-    vm->trackAllocation(ret, (size + 1) * 8);
     return (List *)ret;
   }
 
@@ -130,9 +152,8 @@ namespace Verve {
 
     auto number = argv[0].asInt();
     auto size = snprintf(NULL, 0, "%d", number);
-    auto buffer = (char *)malloc(size + 1);
+    auto buffer = (char *)vm->allocate(size + 1);
     snprintf(buffer, size + 1, "%d", number);
-    vm->trackAllocation(buffer, size + 1);
 
     return Value(buffer);
   }
@@ -143,9 +164,8 @@ namespace Verve {
     auto v = argv[0].encode();
     auto number = *(double *)&v;
     auto size = snprintf(NULL, 0, "%lg", number);
-    auto buffer = (char *)malloc(size + 1);
+    auto buffer = (char *)vm->allocate(size + 1);
     snprintf(buffer, size + 1, "%lg", number);
-    vm->trackAllocation(buffer, size + 1);
 
     return Value(buffer);
   }
@@ -153,12 +173,11 @@ namespace Verve {
   VERVE_FUNCTION(concat_string) {
     assert(argc == 2);
 
-    auto s1 = argv[0].asString().str();
-    auto s2 = argv[1].asString().str();
+    auto s1 = argv[0].asString();
+    auto s2 = argv[1].asString();
     auto size = strlen(s1) + strlen(s2);
-    auto buffer = (char *)malloc(size + 1);
+    auto buffer = (char *)vm->allocate(size + 1);
     snprintf(buffer, size + 1, "%s%s", s1, s2);
-    vm->trackAllocation(buffer, size + 1);
 
     return Value(buffer);
   }
@@ -181,17 +200,15 @@ namespace Verve {
 
     Value arg = argv[0];
     if (arg.isString()) {
-      const char *str = arg.asString().str();
+      const char *str = arg.asString();
       const char *substring;
       if (argc == 2) {
         substring = str + argv[1].asInt();
       } else {
         size_t start = argv[0].asInt();
         size_t length = argv[1].asInt() - start;
-        char *substr = (char *)malloc(length + 1);
+        char *substr = (char *)vm->allocate(length + 1);
         memcpy(substr, str, length);
-        substr[length] = 0;
-        vm->trackAllocation(substr, length);
         substring = substr;
       }
 
@@ -222,4 +239,391 @@ namespace Verve {
     return Value((int)vm->heapSize);
   }
 
+  VERVE_FUNCTION(gcStats) {
+    assert(argc == 0);
+
+    auto summary = vm->gcStats.summary(vm->heapSize, vm->heapLimit);
+    auto buffer = (char *)vm->allocate(summary.size() + 1);
+    memcpy(buffer, summary.c_str(), summary.size() + 1);
+
+    return Value(buffer);
+  }
+
+  VERVE_FUNCTION(parallel_map) {
+    assert(argc == 2);
+
+    return parallelMap(*vm, argv[0], argv[1]);
+  }
+
+  VERVE_FUNCTION(fiber_spawn) {
+    assert(argc == 1);
+
+    vm->m_scheduler.spawn(argv[0]);
+    return 0;
+  }
+
+  VERVE_FUNCTION(fiber_yield) {
+    assert(argc == 0);
+
+    vm->m_scheduler.yield();
+    return 0;
+  }
+
+  static Channel *channelArgument(const char *name, Value handle, VM *vm) {
+    auto channel = Channel::fromValue(handle);
+    if (!channel->isUsableFrom(*vm)) {
+      fprintf(stderr, "%s: the channel belongs to another VM, use `make_shared_channel` to communicate between them\n", name);
+      throw;
+    }
+    return channel;
+  }
+
+  // waits for the other fibers and, on a shared channel, for other threads
+  // until `operation` succeeds
+  template<typename F>
+  static void waitFor(const char *name, Channel *channel, VM *vm, F operation) {
+    for (;;) {
+      bool done;
+      try {
+        done = operation();
+      } catch (std::runtime_error &error) {
+        fprintf(stderr, "%s: %s\n", name, error.what());
+        throw;
+      }
+
+      if (done) {
+        vm->m_scheduler.progress();
+        return;
+      }
+
+      if (channel->isShared()) {
+        if (!vm->m_scheduler.yield()) {
+          std::this_thread::yield();
+        }
+      } else if (!vm->m_scheduler.block()) {
+        fprintf(stderr, "Deadlock: every fiber is waiting on a channel\n");
+        throw;
+      }
+    }
+  }
+
+  static Value createChannel(const char *name, Value capacity, VM *vm, bool shared) {
+    if (capacity.asInt() <= 0) {
+      fprintf(stderr, "%s: the capacity must be positive, got %d\n", name, capacity.asInt());
+      throw;
+    }
+
+    Channel *channel;
+    if (shared) {
+      channel = new SharedChannel(capacity.asInt());
+    } else {
+      channel = new LocalChannel(vm, capacity.asInt());
+    }
+    return channelValue(*vm, channel);
+  }
+
+  VERVE_FUNCTION(make_channel) {
+    assert(argc == 1);
+
+    return createChannel("make_channel", argv[0], vm, false);
+  }
+
+  VERVE_FUNCTION(make_shared_channel) {
+    assert(argc == 1);
+
+    return createChannel("make_shared_channel", argv[0], vm, true);
+  }
+
+  VERVE_FUNCTION(channel_send) {
+    assert(argc == 2);
+
+    auto channel = channelArgument("send", argv[0], vm);
+    waitFor("send", channel, vm, [&] { return channel->send(*vm, argv[1]); });
+    return 0;
+  }
+
+  VERVE_FUNCTION(channel_recv) {
+    assert(argc == 1);
+
+    auto channel = channelArgument("recv", argv[0], vm);
+    Value value;
+    waitFor("recv", channel, vm, [&] { return channel->receive(*vm, value); });
+    return value;
+  }
+
+  // an empty list when there's nothing to receive, the value otherwise
+  VERVE_FUNCTION(channel_try_recv) {
+    assert(argc == 1);
+
+    auto channel = channelArgument("try_recv", argv[0], vm);
+    volatile uint64_t root;
+    Value value;
+    if (!channel->receive(*vm, value)) {
+      auto empty = (uint64_t *)vm->allocate(8);
+      return Value((List *)empty);
+    }
+    vm->m_scheduler.progress();
+
+    root = value.encode();
+    auto result = (uint64_t *)vm->allocate(2 * 8);
+    result[0] = 1;
+    result[1] = root;
+    return Value((List *)result);
+  }
+
+
+  // I/O runs on the VM's I/O threads (see await), which only see copies of
+  // the arguments: strings are allocated once back on the VM's thread
+
+  static Value allocateString(VM *vm, const std::string &str) {
+    auto buffer = (char *)vm->allocate(str.size() + 1);
+    memcpy(buffer, str.c_str(), str.size() + 1);
+    return Value(buffer);
+  }
+
+  static Value allocateStrings(VM *vm, const std::vector<std::string> &strings) {
+    auto list = (uint64_t *)vm->allocate((strings.size() + 1) * 8);
+    list[0] = strings.size();
+
+    volatile uint64_t root = Value((List *)list).encode();
+    for (unsigned i = 0; i < strings.size(); i++) {
+      list[i + 1] = allocateString(vm, strings[i]).encode();
+    }
+    return Value::decode(root);
+  }
+
+  static void checkIOError(const char *name, const std::string &error) {
+    if (!error.empty()) {
+      fprintf(stderr, "%s: %s\n", name, error.c_str());
+      throw;
+    }
+  }
+
+  static std::string ioError(const char *action, const std::string &path) {
+    return std::string("cannot ") + action + " `" + path + "`: " + strerror(errno);
+  }
+
+  // the next line of `stream`, without its newline. False at the end.
+  static bool readLine(FILE *stream, std::string &line) {
+    line.clear();
+    int c;
+    while ((c = getc(stream)) != EOF && c != '\n') {
+      line.push_back(c);
+    }
+    return c != EOF || !line.empty();
+  }
+
+  static File *fileArgument(const char *name, Value handle) {
+    auto file = reinterpret_cast<File *>(handle.asObject()->at(0).encode());
+    if (!file->stream) {
+      fprintf(stderr, "%s: `%s` is closed\n", name, file->path.c_str());
+      throw;
+    }
+    return file;
+  }
+
+  VERVE_FUNCTION(read_file) {
+    assert(argc == 1);
+
+    std::string path = argv[0].asString();
+    std::string contents, error;
+    await(*vm, [&] {
+      auto stream = fopen(path.c_str(), "rb");
+      if (!stream) {
+        error = ioError("open", path);
+        return;
+      }
+      char buffer[1 << 16];
+      size_t size;
+      while ((size = fread(buffer, 1, sizeof(buffer), stream)) > 0) {
+        contents.append(buffer, size);
+      }
+      if (ferror(stream)) {
+        error = ioError("read", path);
+      }
+      fclose(stream);
+    });
+    checkIOError("read_file", error);
+    return allocateString(vm, contents);
+  }
+
+  VERVE_FUNCTION(write_file) {
+    assert(argc == 2);
+
+    std::string path = argv[0].asString();
+    std::string contents = argv[1].asString();
+    std::string error;
+    await(*vm, [&] {
+      auto stream = fopen(path.c_str(), "wb");
+      if (!stream) {
+        error = ioError("open", path);
+        return;
+      }
+      if (fwrite(contents.data(), 1, contents.size(), stream) != contents.size()) {
+        error = ioError("write", path);
+      }
+      if (fclose(stream) != 0 && error.empty()) {
+        error = ioError("write", path);
+      }
+    });
+    checkIOError("write_file", error);
+    return 0;
+  }
+
+  VERVE_FUNCTION(read_lines) {
+    assert(argc == 1);
+
+    std::string path = argv[0].asString();
+    std::vector<std::string> lines;
+    std::string error;
+    await(*vm, [&] {
+      auto stream = fopen(path.c_str(), "r");
+      if (!stream) {
+        error = ioError("open", path);
+        return;
+      }
+      std::string line;
+      while (readLine(stream, line)) {
+        lines.push_back(line);
+      }
+      if (ferror(stream)) {
+        error = ioError("read", path);
+      }
+      fclose(stream);
+    });
+    checkIOError("read_lines", error);
+    return allocateStrings(vm, lines);
+  }
+
+  VERVE_FUNCTION(open_file) {
+    assert(argc == 2);
+
+    std::unique_ptr<File> file(new File());
+    file->path = argv[0].asString();
+    std::string mode = argv[1].asString();
+    if (mode != "r" && mode != "w" && mode != "a") {
+      fprintf(stderr, "open: invalid mode `%s`, expected `r`, `w` or `a`\n", mode.c_str());
+      throw;
+    }
+
+    std::string error;
+    await(*vm, [&] {
+      file->stream = fopen(file->path.c_str(), mode.c_str());
+      if (!file->stream) {
+        error = ioError("open", file->path);
+      }
+    });
+    checkIOError("open", error);
+    return fileValue(*vm, file.release());
+  }
+
+  VERVE_FUNCTION(close_file) {
+    assert(argc == 1);
+
+    auto file = fileArgument("close", argv[0]);
+    if (file->pending) {
+      fprintf(stderr, "close: another fiber is still using `%s`\n", file->path.c_str());
+      throw;
+    }
+    std::string error;
+    auto stream = file->stream;
+    file->stream = nullptr;
+    // the lines read so far stay valid, the buffer they're in is collected
+    // once they aren't used anymore
+    file->reader = LineReader();
+    await(*vm, [&] {
+      if (fclose(stream) != 0) {
+        error = ioError("close", file->path);
+      }
+    });
+    checkIOError("close", error);
+    return 0;
+  }
+
+  // the next line of `file` from its reader, refilling it as needed. Null at
+  // the end of the file.
+  static const char *nextLine(const char *name, File *file, VM *vm) {
+    const char *line;
+    while (!(line = file->reader.next()) && !file->reader.atEnd()) {
+      if (file->reading) {
+        fprintf(stderr, "%s: another fiber is already reading `%s`\n", name, file->path.c_str());
+        throw;
+      }
+
+      std::string error;
+      file->reading = true;
+      file->pending++;
+      await(*vm, [&] {
+        if (!file->reader.refill(fileno(file->stream))) {
+          error = ioError("read", file->path);
+        }
+      });
+      file->pending--;
+      file->reading = false;
+      checkIOError(name, error);
+      file->reader.adopt(*vm);
+    }
+    return line;
+  }
+
+  // an empty list at the end of the file, the line without its newline
+  // otherwise. The line isn't copied, see LineReader.
+  VERVE_FUNCTION(read_line) {
+    assert(argc == 1);
+
+    auto file = fileArgument("read_line", argv[0]);
+    auto line = nextLine("read_line", file, vm);
+
+    // the line is in the reader's current buffer, which stays reachable
+    auto list = (uint64_t *)vm->allocate(line ? 2 * 8 : 8);
+    if (line) {
+      list[0] = 1;
+      list[1] = Value(line).encode();
+    }
+    return Value((List *)list);
+  }
+
+  // calls `argv[1]` with every line left in the file, without building a
+  // list of them
+  VERVE_FUNCTION(each_line) {
+    assert(argc == 2);
+
+    // `argv[1]` may close the file
+    while (auto line = nextLine("each_line", fileArgument("each_line", argv[0]), vm)) {
+      vm->call(argv[1], { Value(line) });
+    }
+    return 0;
+  }
+
+  VERVE_FUNCTION(stdin_file) {
+    assert(argc == 0);
+
+    // the same file every time, its reader may have read ahead
+    if (vm->m_stdin.isUndefined()) {
+      auto file = new File();
+      file->stream = stdin;
+      file->path = "<stdin>";
+      vm->m_stdin = fileValue(*vm, file);
+    }
+    return vm->m_stdin;
+  }
+
+  // appends a newline, string literals have no escapes for it
+  VERVE_FUNCTION(write_line) {
+    assert(argc == 2);
+
+    auto file = fileArgument("write_line", argv[0]);
+    auto contents = std::string(argv[1].asString()) + "\n";
+    std::string error;
+    file->pending++;
+    await(*vm, [&] {
+      if (fwrite(contents.data(), 1, contents.size(), file->stream) != contents.size()) {
+        error = ioError("write", file->path);
+      }
+    });
+    file->pending--;
+    checkIOError("write_line", error);
+    return 0;
+  }
+
 }
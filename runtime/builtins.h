@@ -40,6 +40,24 @@ namespace Verve {
   VERVE_FUNCTION(substr);
   VERVE_FUNCTION(count);
   VERVE_FUNCTION(heapSize);
+  VERVE_FUNCTION(gcStats);
+  VERVE_FUNCTION(parallel_map);
+  VERVE_FUNCTION(fiber_spawn);
+  VERVE_FUNCTION(fiber_yield);
+  VERVE_FUNCTION(make_channel);
+  VERVE_FUNCTION(make_shared_channel);
+  VERVE_FUNCTION(channel_send);
+  VERVE_FUNCTION(channel_recv);
+  VERVE_FUNCTION(channel_try_recv);
+  VERVE_FUNCTION(read_file);
+  VERVE_FUNCTION(write_file);
+  VERVE_FUNCTION(read_lines);
+  VERVE_FUNCTION(open_file);
+  VERVE_FUNCTION(close_file);
+  VERVE_FUNCTION(read_line);
+  VERVE_FUNCTION(each_line);
+  VERVE_FUNCTION(stdin_file);
+  VERVE_FUNCTION(write_line);
 
   void registerBuiltins(VM &);
 
@@ -0,0 +1,146 @@
+#include "channels.h"
+
+#include "vm.h"
+
+namespace Verve {
+
+bool LocalChannel::send(VM &, Value value) {
+  if (m_values.size() == m_capacity) {
+    return false;
+  }
+  m_values.push_back(value);
+  return true;
+}
+
+bool LocalChannel::receive(VM &, Value &value) {
+  if (m_values.empty()) {
+    return false;
+  }
+  value = m_values.front();
+  m_values.pop_front();
+  // it may have been in the channel when marking started, and the handle
+  // may not have been traced yet
+  if (m_vm->m_interpreter.marking) {
+    m_vm->m_gc.markValue(value);
+  }
+  return true;
+}
+
+// copies of the handle in other VMs don't keep the values alive, they're
+// not in those VMs' heaps
+void LocalChannel::trace(const GC &gc, std::vector<uint64_t> &stack) {
+  if (&gc != &m_vm->m_gc) {
+    return;
+  }
+  for (auto value : m_values) {
+    if (value.isHeapAllocated()) {
+      stack.push_back(value.encode());
+    }
+  }
+}
+
+SharedChannel::SharedChannel(size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+
+  m_cells.reset(new Cell[size]);
+  for (size_t i = 0; i < size; i++) {
+    m_cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  m_mask = size - 1;
+  m_sendPosition.store(0, std::memory_order_relaxed);
+  m_receivePosition.store(0, std::memory_order_relaxed);
+}
+
+SharedChannel::~SharedChannel() {
+  // the messages nobody received
+  for (size_t i = 0; i <= m_mask; i++) {
+    freeCopy(m_cells[i].allocations);
+  }
+}
+
+// A cell's sequence is the position it can be sent to next, one past that
+// once it's full and the position of the next round (one lap of the ring
+// later) once it's been received. A sender or receiver first claims a
+// position by moving it forward, then publishes the cell by bumping its
+// sequence.
+bool SharedChannel::send(VM &, Value value) {
+  auto position = m_sendPosition.load(std::memory_order_relaxed);
+  Heap allocations;
+  bool copied = false;
+
+  for (;;) {
+    auto &cell = m_cells[position & m_mask];
+    auto sequence = cell.sequence.load(std::memory_order_acquire);
+    auto difference = (intptr_t)sequence - (intptr_t)position;
+
+    if (difference < 0) {
+      // still holding the message from the previous lap
+      freeCopy(allocations);
+      return false;
+    }
+
+    if (difference > 0) {
+      position = m_sendPosition.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    // only copied once there's room, the copy may be large
+    if (!copied) {
+      value = copyValue(value, allocations);
+      copied = true;
+      continue;
+    }
+
+    if (m_sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+      cell.value = value.encode();
+      cell.allocations = std::move(allocations);
+      cell.sequence.store(position + 1, std::memory_order_release);
+      return true;
+    }
+  }
+}
+
+bool SharedChannel::receive(VM &vm, Value &value) {
+  auto position = m_receivePosition.load(std::memory_order_relaxed);
+
+  for (;;) {
+    auto &cell = m_cells[position & m_mask];
+    auto sequence = cell.sequence.load(std::memory_order_acquire);
+    auto difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+    if (difference < 0) {
+      return false;
+    }
+
+    if (difference > 0) {
+      position = m_receivePosition.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    if (m_receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+      volatile uint64_t root = cell.value;
+      auto allocations = std::move(cell.allocations);
+      cell.allocations.clear();
+      cell.sequence.store(position + m_mask + 1, std::memory_order_release);
+
+      // adopting may collect, the message is only reachable from the root
+      vm.adopt(allocations);
+      value = Value::decode(root);
+      return true;
+    }
+  }
+}
+
+Value channelValue(VM &vm, Channel *channel) {
+  auto handle = (uint64_t *)vm.allocate(2 * 8);
+  handle[0] = (1ull << 32) | Channel::HANDLE_TAG;
+  handle[1] = reinterpret_cast<uintptr_t>(channel);
+  channel->retain();
+  vm.m_channels.push_back({ handle, channel });
+  return Value((Object *)handle);
+}
+
+}
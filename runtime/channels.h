@@ -0,0 +1,134 @@
+#include "gc.h"
+#include "value.h"
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // A bounded queue of values. Neither operation blocks: the builtins wait
+  // for room or for a value by yielding to other fibers (see Scheduler) and,
+  // for shared channels, to other threads.
+  class Channel {
+    public:
+      // the tag of the objects that refer to channels, see channelValue
+      static const unsigned HANDLE_TAG = 0xffffffff;
+
+      Channel() : m_handles(0) {}
+      virtual ~Channel() {}
+
+      // false when it's full
+      virtual bool send(VM &vm, Value value) = 0;
+      // false when it's empty
+      virtual bool receive(VM &vm, Value &value) = 0;
+
+      // whether other threads may use it, it's only safe to wait for them
+      virtual bool isShared() const = 0;
+      // whether `vm` may use it
+      virtual bool isUsableFrom(const VM &vm) const = 0;
+      // pushes the values it holds in the heap `gc` collects, if any, onto
+      // `stack`: they're reachable as long as one of its handles is
+      virtual void trace(const GC &gc, std::vector<uint64_t> &stack) = 0;
+
+      // Every handle holds a reference, in any VM or in a copy on its way to
+      // one (see copyValue). The channel is deleted with the last one.
+      void retain() {
+        m_handles.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release() {
+        if (m_handles.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      static bool isHandle(const Object *object) {
+        return object->size == 1 && object->tag == HANDLE_TAG;
+      }
+
+      // the channel a `channel<t>` value refers to, its only field
+      static Channel *fromValue(Value value) {
+        return reinterpret_cast<Channel *>(value.asObject()->at(0).encode());
+      }
+
+      // the channel a block copied by copyValue refers to, if it's a handle:
+      // no string or list of that size starts like one
+      static Channel *fromCopy(const std::pair<size_t, void *> &block) {
+        auto object = static_cast<Object *>(block.second);
+        if (block.first != 2 * 8 || !isHandle(object)) {
+          return nullptr;
+        }
+        return fromValue(Value(object));
+      }
+
+    private:
+      std::atomic<size_t> m_handles;
+  };
+
+  // Between the fibers of one VM: the values stay in its heap.
+  class LocalChannel : public Channel {
+    public:
+      LocalChannel(VM *vm, size_t capacity) :
+        m_vm(vm),
+        m_capacity(capacity) {}
+
+      bool send(VM &vm, Value value) override;
+      bool receive(VM &vm, Value &value) override;
+      bool isShared() const override { return false; }
+      bool isUsableFrom(const VM &vm) const override { return &vm == m_vm; }
+      void trace(const GC &gc, std::vector<uint64_t> &stack) override;
+
+    private:
+      VM *m_vm;
+      size_t m_capacity;
+      std::deque<Value> m_values;
+  };
+
+  // Between VMs on any thread, a lock-free multi-producer multi-consumer
+  // ring buffer (Vyukov's bounded queue). Sending copies the value out of
+  // the sender's heap, the receiver adopts the copy into its own.
+  class SharedChannel : public Channel {
+    public:
+      // the capacity is rounded up to a power of two
+      SharedChannel(size_t capacity);
+      ~SharedChannel();
+
+      bool send(VM &vm, Value value) override;
+      bool receive(VM &vm, Value &value) override;
+      bool isShared() const override { return true; }
+      bool isUsableFrom(const VM &) const override { return true; }
+      void trace(const GC &, std::vector<uint64_t> &) override {}
+
+    private:
+      struct Cell {
+        // the position the cell is next written at, or read at plus one
+        std::atomic<size_t> sequence;
+        uint64_t value;
+        Heap allocations;
+      };
+
+      std::unique_ptr<Cell[]> m_cells;
+      size_t m_mask;
+
+      // on separate cache lines, producers and consumers don't contend (the
+      // padding stands in for alignas, which C++11's `new` doesn't honour)
+      char m_padding[64];
+      std::atomic<size_t> m_sendPosition;
+      char m_sendPadding[64 - sizeof(std::atomic<size_t>)];
+      std::atomic<size_t> m_receivePosition;
+      char m_receivePadding[64 - sizeof(std::atomic<size_t>)];
+  };
+
+  // A `channel<t>` value for a new `channel`: an object whose only field is
+  // the channel's address, which the collector and copyValue take for an
+  // int. The collector traces the channel's values through it, and the
+  // channel goes once it's been swept, along with its copies in other VMs.
+  Value channelValue(VM &vm, Channel *channel);
+}
@@ -0,0 +1,195 @@
+#include "fibers.h"
+
+#include "vm.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+
+extern "C" void switchFiber(uintptr_t *from, uintptr_t to);
+extern "C" void fiberStart();
+
+extern "C" _Noreturn void runFiber(Verve::Scheduler *scheduler, Verve::Fiber *fiber);
+void runFiber(Verve::Scheduler *scheduler, Verve::Fiber *fiber) {
+  scheduler->run(fiber);
+}
+
+namespace Verve {
+
+namespace {
+  // finished fibers' stacks are kept for new ones, up to this many
+  const size_t MAX_FREE_STACKS = 64;
+}
+
+Scheduler::Scheduler(VM *vm) :
+  m_vm(vm),
+  m_current(&m_main) {}
+
+// the program may have failed with fibers still waiting: the ones that
+// were ready and the ones parked on I/O are freed alike
+Scheduler::~Scheduler() {
+  for (auto fiber : m_ready) {
+    if (fiber != &m_main) {
+      delete fiber;
+    }
+  }
+  for (auto fiber : m_parked) {
+    if (fiber != &m_main) {
+      delete fiber;
+    }
+  }
+  delete m_finished;
+}
+
+const Stack &Scheduler::mainStack() const {
+  return *m_vm->m_stack;
+}
+
+const Stack &Scheduler::stack() const {
+  return m_current->stack ? *m_current->stack : mainStack();
+}
+
+void Scheduler::spawn(Value closure) {
+  auto fiber = new Fiber();
+  fiber->closure = closure;
+  fiber->scope = m_vm->m_globalScope;
+  if (m_stacks.size()) {
+    fiber->stack = std::move(m_stacks.back());
+    m_stacks.pop_back();
+  } else {
+    fiber->stack.reset(new Stack(FIBER_STACK_SIZE, false));
+  }
+
+  // what switchFiber pops: r15, r14, r13, r12, rbx, rbp and the return
+  // address, with the stack aligned as if fiberStart had been called
+  auto top = reinterpret_cast<uintptr_t *>(fiber->stack->top());
+  auto frame = top - 8;
+  frame[0] = 0;
+  frame[1] = 0;
+  frame[2] = reinterpret_cast<uintptr_t>(fiber);
+  frame[3] = reinterpret_cast<uintptr_t>(this);
+  frame[4] = 0;
+  frame[5] = 0;
+  frame[6] = reinterpret_cast<uintptr_t>(fiberStart);
+  frame[7] = 0;
+  fiber->sp = reinterpret_cast<uintptr_t>(frame);
+
+  m_ready.push_back(fiber);
+}
+
+bool Scheduler::yield() {
+  // fibers that only yield still let the I/O they wait on finish
+  if (m_vm->m_events.pending()) {
+    m_vm->m_events.poll(false);
+  }
+  if (m_ready.empty()) {
+    return false;
+  }
+
+  auto next = m_ready.front();
+  m_ready.pop_front();
+  m_ready.push_back(m_current);
+  switchTo(next);
+  return true;
+}
+
+void Scheduler::finish() {
+  assert(m_current == &m_main);
+  while (!m_ready.empty() || !m_parked.empty()) {
+    if (m_ready.empty()) {
+      m_vm->m_events.poll(true);
+    } else {
+      yield();
+    }
+  }
+}
+
+bool Scheduler::block() {
+  auto fiber = m_current;
+  if (!fiber->blocked) {
+    fiber->blocked = true;
+    m_blocked++;
+  } else if (fiber->blockedAt == m_progress && m_blocked == m_ready.size() + 1 && m_parked.empty()) {
+    return false;
+  }
+
+  fiber->blockedAt = m_progress;
+  if (m_ready.empty() && !m_parked.empty()) {
+    m_vm->m_events.poll(true);
+  }
+  return yield();
+}
+
+void Scheduler::progress() {
+  m_progress++;
+  if (m_current->blocked) {
+    m_current->blocked = false;
+    m_blocked--;
+  }
+}
+
+void Scheduler::run(Fiber *fiber) {
+  reap();
+  m_vm->call(fiber->closure, {});
+
+  // the program's fiber is always waiting for the others to finish, if
+  // only parked
+  m_finished = fiber;
+  switchTo(next());
+  abort();
+}
+
+void Scheduler::park() {
+  m_parked.push_back(m_current);
+  auto fiber = next();
+  // resumed while waiting for the others
+  if (fiber != m_current) {
+    switchTo(fiber);
+  }
+}
+
+void Scheduler::resume(Fiber *fiber) {
+  auto it = std::find(m_parked.begin(), m_parked.end(), fiber);
+  assert(it != m_parked.end());
+  m_parked.erase(it);
+  m_ready.push_back(fiber);
+}
+
+Fiber *Scheduler::next() {
+  while (m_ready.empty()) {
+    assert(m_vm->m_events.pending() && "every fiber is parked, with nothing to wake them up");
+    m_vm->m_events.poll(true);
+  }
+  auto fiber = m_ready.front();
+  m_ready.pop_front();
+  return fiber;
+}
+
+void Scheduler::switchTo(Fiber *fiber) {
+  auto current = m_current;
+  current->scope = m_vm->m_scope;
+
+  m_current = fiber;
+  m_vm->m_scope = fiber->scope;
+  m_vm->m_interpreter.stackLimit = stack().limit();
+  if (m_vm->m_sampler) {
+    // the program finishes off its fibers outside of the VM's stack
+    m_vm->m_sampler->setStackTop(stack().contains(fiber->sp) ? stack().top() : 0);
+  }
+
+  switchFiber(&current->sp, fiber->sp);
+  reap();
+}
+
+void Scheduler::reap() {
+  if (!m_finished) {
+    return;
+  }
+  if (m_stacks.size() < MAX_FREE_STACKS) {
+    m_stacks.push_back(std::move(m_finished->stack));
+  }
+  delete m_finished;
+  m_finished = nullptr;
+}
+
+}
@@ -0,0 +1,109 @@
+#include "stack.h"
+#include "value.h"
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+  struct Scope;
+
+  struct Fiber {
+    Value closure;
+    // none for the program itself, which runs on the VM's stack
+    std::unique_ptr<Stack> stack;
+    // where the registers were saved when it was suspended
+    uintptr_t sp = 0;
+    Scope *scope = nullptr;
+    // waiting in block(), and the progress made by then
+    bool blocked = false;
+    uint64_t blockedAt = 0;
+  };
+
+  // Runs a VM's fibers round-robin on the VM's thread, the program itself
+  // being one of them. `spawn` queues a fiber, which first runs the next time
+  // something yields, and `yield` suspends the running fiber for the next one
+  // in the queue. Fibers waiting on I/O are parked aside until the event loop
+  // resumes them. A fiber is suspended along with its interpreter state: the
+  // callee saved registers interpreter.S keeps it in, its stack and the VM's
+  // current scope. The fibers left when the program's text ends run until
+  // they're all done.
+  class Scheduler {
+    public:
+      static const size_t FIBER_STACK_SIZE = Stack::MINIMUM_STACK_SIZE;
+
+      Scheduler(VM *vm);
+      ~Scheduler();
+
+      void spawn(Value closure);
+      // false if there was no other fiber to run
+      bool yield();
+      // only returns once every other fiber is done
+      void finish();
+
+      // For fibers waiting on each other (see channels): `block` yields
+      // until the running fiber may retry, and `progress` records that it
+      // could, which may unblock the others. `block` returns false when
+      // retrying is pointless: every fiber is blocked and none made
+      // progress since this one last blocked.
+      bool block();
+      void progress();
+
+      // For fibers waiting on the event loop: `park` suspends the running
+      // fiber until `resume` is called with it, meanwhile the others run or,
+      // when none can, the VM waits for the event loop.
+      void park();
+      void resume(Fiber *fiber);
+      Fiber *running() { return m_current; }
+
+      // the stack the running fiber is on
+      const Stack &stack() const;
+
+      // calls `visit(fiber, begin, end)` for every other fiber that still has
+      // to run, with the part of its stack in use
+      template<typename F>
+      void visitSuspended(F visit) const {
+        auto visitFiber = [&](Fiber *fiber) {
+          auto &stack = fiber->stack ? *fiber->stack : mainStack();
+          if (stack.contains(fiber->sp)) {
+            visit(*fiber, fiber->sp, stack.top());
+          } else {
+            visit(*fiber, 0, 0);
+          }
+        };
+        for (auto fiber : m_ready) {
+          visitFiber(fiber);
+        }
+        for (auto fiber : m_parked) {
+          visitFiber(fiber);
+        }
+      }
+
+      const Fiber &current() const { return *m_current; }
+
+      // called on a new fiber's stack, see fibers.S
+      _Noreturn void run(Fiber *fiber);
+
+    private:
+      const Stack &mainStack() const;
+      void switchTo(Fiber *fiber);
+      // takes the next fiber to run, waiting for a parked one if need be
+      Fiber *next();
+      void reap();
+
+      VM *m_vm;
+      Fiber m_main;
+      Fiber *m_current;
+      std::deque<Fiber *> m_ready;
+      std::vector<Fiber *> m_parked;
+      unsigned m_blocked = 0;
+      uint64_t m_progress = 0;
+
+      // the fiber that just finished, its stack is released once it's off it
+      Fiber *m_finished = nullptr;
+      std::vector<std::unique_ptr<Stack>> m_stacks;
+  };
+}
@@ -4,7 +4,7 @@
 
 namespace Verve {
 
-  String Function::name(VM *vm) {
+  String Function::name(VM *vm) const {
     return vm->m_stringTable[id];
   }
 
@@ -9,16 +9,18 @@ namespace Verve {
   class VM;
 
   struct Function {
-    Function(unsigned i, unsigned args, unsigned o, std::vector<String> &&a) :
+    Function(unsigned i, unsigned args, unsigned o, unsigned s, std::vector<String> &&a) :
       id(i),
       offset(o),
+      size(s),
       nargs(args),
       args(a) {}
 
-    String name(VM *);
+    String name(VM *) const;
 
     unsigned id;
     unsigned offset;
+    unsigned size;
     unsigned nargs;
     std::vector<String> args;
   };
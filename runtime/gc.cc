@@ -1,8 +1,536 @@
 #include "gc.h"
 
+#include "channels.h"
+#include "io.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
 namespace Verve {
 
-  std::set<uint64_t> GC::roots;
-  std::set<Scope *> GC::scopes;
+  bool parseSize(const char *value, size_t *size) {
+    char *end;
+    auto number = strtoull(value, &end, 10);
+    if (end == value) {
+      return false;
+    }
+    switch (tolower(*end)) {
+      case 'g': number <<= 10; // fallthrough
+      case 'm': number <<= 10; // fallthrough
+      case 'k': number <<= 10; end++; break;
+    }
+    *size = number;
+    return *end == '\0';
+  }
+
+  Value copyValue(Value value, Heap &allocations) {
+    if (value.isString()) {
+      auto size = strlen(value.asString()) + 1;
+      auto copy = (char *)malloc(size);
+      memcpy(copy, value.asString(), size);
+      allocations.push_back({ size, copy });
+      return Value(copy);
+    } else if (value.isList()) {
+      auto list = value.asList();
+      auto copy = (uint64_t *)calloc(list->length + 1, 8);
+      copy[0] = list->length;
+      for (unsigned i = 0; i < list->length; i++) {
+        copy[i + 1] = copyValue(list->at(i), allocations).encode();
+      }
+      allocations.push_back({ (list->length + 1) * 8, copy });
+      return Value((List *)copy);
+    } else if (value.isObject()) {
+      auto object = value.asObject();
+      if (File::isHandle(object)) {
+        throw std::runtime_error("Files can't leave the VM they were opened in");
+      }
+      auto copy = (uint64_t *)calloc(object->size + 1, 8);
+      memcpy(copy, object, 8);
+      for (unsigned i = 0; i < object->size; i++) {
+        copy[i + 1] = copyValue(object->at(i), allocations).encode();
+      }
+      allocations.push_back({ (object->size + 1) * 8, copy });
+      if (Channel::isHandle(object)) {
+        Channel::fromValue(value)->retain();
+      }
+      return Value((Object *)copy);
+    } else if (value.isClosure() && !(value.encode() & 1)) {
+      throw std::runtime_error("Closures that capture variables can't leave the VM they were created in");
+    }
+    return value;
+  }
+
+  void freeCopy(const Heap &allocations) {
+    for (const auto &allocation : allocations) {
+      if (auto channel = Channel::fromCopy(allocation)) {
+        channel->release();
+      }
+      free(allocation.second);
+    }
+  }
+
+  namespace {
+    bool parseNumber(const char *value, double *number) {
+      char *end;
+      *number = strtod(value, &end);
+      return end != value && *end == '\0' && *number >= 0;
+    }
+
+    bool parseCount(const char *value, unsigned *count, unsigned long maximum) {
+      char *end;
+      auto number = strtoul(value, &end, 10);
+      if (end == value || *end != '\0' || *value == '-' || number > maximum) {
+        return false;
+      }
+      *count = number;
+      return true;
+    }
+  }
+
+  HeapPolicy HeapPolicy::fromEnvironment() {
+    HeapPolicy policy;
+    const std::pair<const char *, const char *> variables[] = {
+      { "VERVE_HEAP_INITIAL", "--heap-initial" },
+      { "VERVE_HEAP_MAX", "--heap-max" },
+      { "VERVE_HEAP_GROWTH", "--heap-growth" },
+      { "VERVE_GC_TARGET", "--gc-target" },
+      { "VERVE_GC_THREADS", "--gc-threads" },
+      { "VERVE_GC_PAUSE", "--gc-pause" },
+    };
+    for (const auto &variable : variables) {
+      auto value = getenv(variable.first);
+      if (value && !policy.set(variable.second, value)) {
+        fprintf(stderr, "Ignoring invalid value `%s` for %s\n", value, variable.first);
+      }
+    }
+    return policy;
+  }
+
+  bool HeapPolicy::set(const char *option, const char *value) {
+    if (strcmp(option, "--heap-initial") == 0) {
+      return parseSize(value, &initial) && initial > 0;
+    } else if (strcmp(option, "--heap-max") == 0) {
+      return parseSize(value, &maximum);
+    } else if (strcmp(option, "--heap-growth") == 0) {
+      return parseNumber(value, &growth) && growth > 1;
+    } else if (strcmp(option, "--gc-target") == 0) {
+      return parseNumber(value, &gcTimePercent) && gcTimePercent < 100;
+    } else if (strcmp(option, "--gc-threads") == 0) {
+      return parseCount(value, &gcThreads, 1024);
+    } else if (strcmp(option, "--gc-pause") == 0) {
+      return parseCount(value, &pauseMicros, 10000000);
+    }
+    return false;
+  }
+
+  size_t HeapPolicy::limitAfterCollection(size_t before, size_t live, size_t limit, double gcTimeShare) const {
+    auto headroom = live * (growth - 1);
+
+    // when most of the heap survives, collecting after the same amount of
+    // allocation recovers little: leave room for proportionally more
+    auto survival = before ? std::min((double)live / before, 0.9) : 0;
+    headroom /= 1 - survival;
+
+    auto next = std::max(initial, live + (size_t)headroom);
+    if (gcTimePercent > 0 && gcTimeShare * 100 > gcTimePercent) {
+      next = std::max(next, 2 * limit);
+    }
+
+    if (maximum) {
+      next = std::min(next, maximum);
+    }
+    return next;
+  }
+
+  void GCStats::recordPause(uint64_t mark, uint64_t sweep) {
+    markNanos += mark;
+    sweepNanos += sweep;
+
+    auto pause = mark + sweep;
+    maxPauseNanos = std::max(maxPauseNanos, pause);
+
+    unsigned bucket = 0;
+    while (bucket < PAUSE_BUCKETS - 1 && pause >= (1000ull << bucket)) {
+      bucket++;
+    }
+    pauses[bucket]++;
+  }
+
+  void GCStats::recordLimit(size_t heapSize, size_t oldLimit, size_t newLimit) {
+    limitChanges.push_back({ collections, heapSize, oldLimit, newLimit });
+  }
+
+  std::string GCStats::summary(size_t heapSize, size_t heapLimit) const {
+    char buffer[512];
+    snprintf(buffer, sizeof(buffer),
+        "collections=%llu mark_ns=%llu sweep_ns=%llu max_pause_ns=%llu "
+        "objects_marked=%llu bytes_marked=%llu objects_freed=%llu bytes_freed=%llu "
+        "heap_size=%zu heap_limit=%zu",
+        (unsigned long long)collections,
+        (unsigned long long)markNanos,
+        (unsigned long long)sweepNanos,
+        (unsigned long long)maxPauseNanos,
+        (unsigned long long)objectsMarked,
+        (unsigned long long)bytesMarked,
+        (unsigned long long)objectsFreed,
+        (unsigned long long)bytesFreed,
+        heapSize,
+        heapLimit);
+    return buffer;
+  }
+
+  void GCStats::report(FILE *output, size_t heapSize, size_t heapLimit) const {
+    auto ms = [](uint64_t nanos) { return nanos / 1e6; };
+
+    fprintf(output, "GC stats:\n");
+    fprintf(output, "  %-18s %llu\n", "collections", (unsigned long long)collections);
+    fprintf(output, "  %-18s %.3f ms\n", "mark time", ms(markNanos));
+    fprintf(output, "  %-18s %.3f ms\n", "sweep time", ms(sweepNanos));
+    fprintf(output, "  %-18s %.3f ms\n", "max pause", ms(maxPauseNanos));
+    fprintf(output, "  %-18s %llu\n", "objects marked", (unsigned long long)objectsMarked);
+    fprintf(output, "  %-18s %llu\n", "bytes marked", (unsigned long long)bytesMarked);
+    fprintf(output, "  %-18s %llu\n", "objects freed", (unsigned long long)objectsFreed);
+    fprintf(output, "  %-18s %llu\n", "bytes freed", (unsigned long long)bytesFreed);
+    fprintf(output, "  %-18s %zu\n", "heap size", heapSize);
+    fprintf(output, "  %-18s %zu\n", "heap limit", heapLimit);
+
+    if (collections) {
+      fprintf(output, "Pauses:\n");
+      for (unsigned i = 0; i < PAUSE_BUCKETS; i++) {
+        if (!pauses[i]) {
+          continue;
+        }
+        if (i == PAUSE_BUCKETS - 1) {
+          fprintf(output, "  >= %8llu us %12llu\n", 1ull << (i - 1), (unsigned long long)pauses[i]);
+        } else {
+          fprintf(output, "  <  %8llu us %12llu\n", 1ull << i, (unsigned long long)pauses[i]);
+        }
+      }
+    }
+
+    if (limitChanges.size()) {
+      fprintf(output, "Heap limit changes:\n");
+      for (const auto &g : limitChanges) {
+        fprintf(output, "  after collection %llu: heap size %zu, limit %zu -> %zu\n",
+            (unsigned long long)g.collection, g.heapSize, g.oldLimit, g.newLimit);
+      }
+    }
+  }
+
+  const size_t GC::PARALLEL_THRESHOLD;
+  const unsigned GC::MAX_THREADS;
+
+  GC::GC() : m_idle(0), m_available(0) {
+    setThreads(0);
+  }
+
+  GC::~GC() {}
+
+  void GC::setThreads(unsigned threads) {
+    if (!threads) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    m_threads = std::min(threads, MAX_THREADS);
+    while (m_markers.size() < m_threads) {
+      m_markers.emplace_back(new Marker());
+    }
+  }
+
+  void GC::start(const Heap &heap, PageHeap *pages) {
+    m_epoch++;
+    m_phase = Phase::Marking;
+    m_heap = &heap;
+    m_pages = pages;
+    if (pages) {
+      pages->startMarking();
+    }
+    m_objects = heap.size() + (pages ? pages->cells() : 0);
+    m_sweepEnd = heap.size();
+    m_swept = 0;
+    m_live = 0;
+
+    // at most half full, so probes stay short
+    unsigned bits = 4;
+    while ((1ull << bits) < 2 * heap.size()) {
+      bits++;
+    }
+    m_index.assign(1ull << bits, { 0, 0 });
+    m_indexShift = 64 - bits;
+    auto mask = m_index.size() - 1;
+    for (size_t i = 0; i < heap.size(); i++) {
+      auto address = reinterpret_cast<uintptr_t>(heap[i].second);
+      auto slot = (address >> 4) * 0x9E3779B97F4A7C15ull >> m_indexShift;
+      while (m_index[slot].address) {
+        slot = (slot + 1) & mask;
+      }
+      m_index[slot] = { address, i };
+    }
+
+    auto words = heap.size() / 64 + 1;
+    if (words > m_markWords) {
+      m_marks.reset(new std::atomic<uint64_t>[words]);
+      m_markWords = words;
+    }
+    for (size_t i = 0; i < words; i++) {
+      m_marks[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ssize_t GC::find(uintptr_t address) const {
+    auto mask = m_index.size() - 1;
+    auto slot = (address >> 4) * 0x9E3779B97F4A7C15ull >> m_indexShift;
+    while (m_index[slot].address) {
+      if (m_index[slot].address == address) {
+        return m_index[slot].index;
+      }
+      slot = (slot + 1) & mask;
+    }
+    return -1;
+  }
+
+  // the heap isn't written to while it's marked, relaxed is enough
+  bool GC::setMark(size_t index) {
+    auto &word = m_marks[index / 64];
+    auto bit = 1ull << (index % 64);
+    if (word.load(std::memory_order_relaxed) & bit) {
+      return false;
+    }
+    return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+  }
+
+  bool GC::isMarked(size_t index) const {
+    return m_marks[index / 64].load(std::memory_order_relaxed) & (1ull << (index % 64));
+  }
+
+  void GC::markValue(Value value) {
+    if (value.isHeapAllocated()) {
+      m_markers[0]->stack.push_back(value.encode());
+    }
+  }
+
+  void GC::markScope(Scope *scope) {
+    traceScope(scope, m_markers[0]->stack);
+  }
+
+  void GC::trace(Value value, std::vector<uint64_t> &stack) {
+    auto address = reinterpret_cast<uintptr_t>(value.asPtr());
+    auto page = m_pages ? m_pages->find(address) : nullptr;
+    auto index = page ? page->cellAt(address) : find(address);
+    if (index < 0 && !page) {
+      if (value.isString()) {
+        for (auto &buffer : buffers) {
+          if (address > buffer.first && address < buffer.first + buffer.second) {
+            stack.push_back(Value(reinterpret_cast<const char *>(buffer.first)).encode());
+            break;
+          }
+        }
+      }
+      return;
+    }
+
+    if (index < 0 || !(page ? page->setMark(index) : setMark(index))) {
+      return;
+    }
+
+    auto push = [&stack](Value value) {
+      if (value.isHeapAllocated()) {
+        stack.push_back(value.encode());
+      }
+    };
+    // the words found on the stacks are only taken for values, a stale one
+    // may be tagged as a list or an object and point to a string
+    size_t words = (page ? page->cellSize : (*m_heap)[index].first) / 8;
+    if (value.isList() && value.asList()->length >= words) {
+      return;
+    }
+    if (value.isObject() && value.asObject()->size >= words) {
+      return;
+    }
+
+    if (value.isList()) {
+      for (unsigned i = 0; i < value.asList()->length; i++) {
+        push(value.asList()->at(i));
+      }
+    } else if (value.isObject()) {
+      if (Channel::isHandle(value.asObject())) {
+        Channel::fromValue(value)->trace(*this, stack);
+        return;
+      }
+      for (unsigned i = 0; i < value.asObject()->size; i++) {
+        push(value.asObject()->at(i));
+      }
+    } else if (value.isClosure() && value.asClosure()->scope) {
+      traceScope(value.asClosure()->scope, stack);
+    }
+  }
+
+  void GC::traceScope(Scope *scope, std::vector<uint64_t> &stack) {
+    while (scope && (!m_scopePool || scope->pool == m_scopePool) &&
+        scope->markedIn.exchange(m_epoch, std::memory_order_relaxed) != m_epoch) {
+      for (unsigned i = 0; i < scope->tableSize; i++) {
+        if (scope->table[i].key.str() != NULL && scope->table[i].value.isHeapAllocated()) {
+          stack.push_back(scope->table[i].value.encode());
+        }
+      }
+      scope = scope->parent;
+    }
+  }
+
+  bool GC::step(Deadline deadline) {
+    auto &stack = m_markers[0]->stack;
+    unsigned traced = 0;
+    while (!stack.empty()) {
+      auto value = Value::decode(stack.back());
+      stack.pop_back();
+      trace(value, stack);
+      if (++traced % 256 == 0 && std::chrono::steady_clock::now() > deadline) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void GC::finish() {
+    m_phase = Phase::Sweeping;
+    m_active = m_objects >= PARALLEL_THRESHOLD ? m_threads : 1;
+    if (m_active == 1) {
+      drain(0);
+      return;
+    }
+
+    // deal the roots out, the threads share the rest as they go
+    std::vector<uint64_t> roots;
+    roots.swap(m_markers[0]->stack);
+    for (size_t i = 0; i < roots.size(); i++) {
+      m_markers[i % m_active]->stack.push_back(roots[i]);
+    }
+
+    m_idle = 0;
+    m_available = 0;
+    std::vector<std::thread> helpers;
+    for (unsigned i = 1; i < m_active; i++) {
+      helpers.emplace_back([this, i] { drain(i); });
+    }
+    drain(0);
+    for (auto &helper : helpers) {
+      helper.join();
+    }
+  }
+
+  // Marks until every thread runs out of work: a thread only gives up once
+  // its own deque and every other one it tried were empty, and only threads
+  // that still have work fill the deques.
+  void GC::drain(unsigned index) {
+    auto &marker = *m_markers[index];
+    auto &stack = marker.stack;
+    while (true) {
+      while (!stack.empty()) {
+        auto value = Value::decode(stack.back());
+        stack.pop_back();
+        trace(value, stack);
+        if (m_active > 1 && stack.size() > 64 && m_idle.load(std::memory_order_relaxed)) {
+          share(marker);
+        }
+      }
+
+      if (m_active == 1) {
+        return;
+      }
+      if (steal(index)) {
+        continue;
+      }
+
+      m_idle++;
+      while (!m_available) {
+        if (m_idle == m_active) {
+          return;
+        }
+        std::this_thread::yield();
+      }
+      m_idle--;
+    }
+  }
+
+  // hands out the oldest half of the stack, the values closest to the roots
+  void GC::share(Marker &marker) {
+    std::lock_guard<std::mutex> lock(marker.lock);
+    if (!marker.shared.empty()) {
+      return;
+    }
+    auto half = marker.stack.size() / 2;
+    marker.shared.assign(marker.stack.begin(), marker.stack.begin() + half);
+    marker.stack.erase(marker.stack.begin(), marker.stack.begin() + half);
+    m_available += half;
+  }
+
+  bool GC::steal(unsigned index) {
+    for (unsigned i = 0; i < m_active; i++) {
+      auto &victim = *m_markers[(index + i) % m_active];
+      std::lock_guard<std::mutex> lock(victim.lock);
+      if (victim.shared.empty()) {
+        continue;
+      }
+      auto taken = std::max<size_t>(1, victim.shared.size() / 2);
+      auto &stack = m_markers[index]->stack;
+      stack.insert(stack.end(), victim.shared.end() - taken, victim.shared.end());
+      victim.shared.resize(victim.shared.size() - taken);
+      m_available -= taken;
+      return true;
+    }
+    return false;
+  }
+
+  void GC::dropUnmarkedBuffers() {
+    auto live = buffers.begin();
+    for (auto &buffer : buffers) {
+      // the ones added since marking started aren't indexed, they're kept
+      auto index = find(buffer.first);
+      if (index < 0 || isMarked(index)) {
+        *live++ = buffer;
+      }
+    }
+    buffers.erase(live, buffers.end());
+  }
+
+  bool GC::isLive(const void *pointer) const {
+    auto address = reinterpret_cast<uintptr_t>(pointer);
+    if (auto page = m_pages ? m_pages->find(address) : nullptr) {
+      auto cell = page->cellAt(address);
+      return cell < 0 || page->isMarked(cell);
+    }
+    auto index = find(address);
+    return index < 0 || isMarked(index);
+  }
+
+  bool GC::sweep(Heap &heap, size_t *heapSize, GCStats &stats, Deadline deadline) {
+    LOG_GC("Sweeping... initial heap size: %ld\n", *heapSize);
+    // compact the survivors in place, erasing each dead block would
+    // make sweeping quadratic in the size of the heap
+    auto timed = deadline != Deadline::max();
+    while (m_swept < m_sweepEnd) {
+      auto block = heap[m_swept];
+      if (isMarked(m_swept)) {
+        heap[m_live++] = block;
+        stats.objectsMarked++;
+        stats.bytesMarked += block.first;
+      } else {
+        free(block.second);
+        *heapSize -= block.first;
+        stats.objectsFreed++;
+        stats.bytesFreed += block.first;
+      }
+      if (++m_swept % 256 == 0 && timed && std::chrono::steady_clock::now() > deadline) {
+        return false;
+      }
+    }
+    heap.erase(heap.begin() + m_live, heap.begin() + m_sweepEnd);
+    m_phase = Phase::Idle;
+    LOG_GC("Done sweeping, heap size: %ld\n", *heapSize);
+    return true;
+  }
 
 }
@@ -1,8 +1,14 @@
 #include "value.h"
 #include "scope.h"
 #include "closure.h"
-
-#include <set>
+#include "pages.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #ifdef LOG_GC_ENABLED
@@ -17,99 +23,201 @@ namespace Verve {
 
   typedef std::vector<std::pair<size_t, void *>> Heap;
 
+  // Copies `value`, and everything it refers to, into blocks outside of any
+  // heap, recorded in `allocations` for the VM that takes the copy to adopt.
+  // Closures with a scope can't be copied.
+  Value copyValue(Value value, Heap &allocations);
+  // frees a copy no VM adopted, and the references it held to channels
+  void freeCopy(const Heap &allocations);
+
+  // parses a size in bytes, with an optional k, m or g suffix
+  bool parseSize(const char *value, size_t *size);
+
+  // Decides how much can be allocated before the next collection. After a
+  // collection the heap may grow to `growth` times what survived, and
+  // further when collections recover little (high survival rate). While
+  // collecting takes more than `gcTimePercent` of the running time the
+  // limit doubles after every collection. It never goes below
+  // `initial` or above `maximum` (when set). `gcThreads` is how many
+  // threads mark large heaps, 0 picks one per core.
+  //
+  // With `pauseMicros` set, collections run in steps of about that long
+  // while the program allocates, instead of all at once. The first step
+  // takes longer with deep stacks, it scans them. If the heap doubles
+  // before a collection is done, it's finished right away.
+  struct HeapPolicy {
+    size_t initial = 10240;
+    size_t maximum = 0;
+    double growth = 2;
+    double gcTimePercent = 0;
+    unsigned gcThreads = 0;
+    unsigned pauseMicros = 0;
+
+    // VERVE_HEAP_INITIAL, VERVE_HEAP_MAX, VERVE_HEAP_GROWTH, VERVE_GC_TARGET,
+    // VERVE_GC_THREADS, VERVE_GC_PAUSE
+    static HeapPolicy fromEnvironment();
+
+    // sets an option by its command line name (e.g. "--heap-max"), sizes
+    // accept k, m and g suffixes. Returns false if it isn't a valid option.
+    bool set(const char *option, const char *value);
+
+    size_t limitAfterCollection(size_t before, size_t live, size_t limit, double gcTimeShare) const;
+  };
+
+  // Always collected, they're cheap compared to a collection. Reported on
+  // exit with --gc-stats and at runtime by `__gc_stats__`.
+  struct GCStats {
+    // bucket i counts pauses under 2^i microseconds, the last one the rest
+    static const unsigned PAUSE_BUCKETS = 24;
+
+    struct LimitChange {
+      uint64_t collection;
+      size_t heapSize;
+      size_t oldLimit;
+      size_t newLimit;
+    };
+
+    // a collection is recorded as one pause, or one per step
+    void recordPause(uint64_t markNanos, uint64_t sweepNanos);
+    void recordLimit(size_t heapSize, size_t oldLimit, size_t newLimit);
+
+    std::string summary(size_t heapSize, size_t heapLimit) const;
+    void report(FILE *output, size_t heapSize, size_t heapLimit) const;
+
+    uint64_t collections = 0;
+    uint64_t markNanos = 0;
+    uint64_t sweepNanos = 0;
+    uint64_t maxPauseNanos = 0;
+    uint64_t pauses[PAUSE_BUCKETS] = {};
+
+    uint64_t objectsMarked = 0;
+    uint64_t bytesMarked = 0;
+    uint64_t objectsFreed = 0;
+    uint64_t bytesFreed = 0;
+
+    std::vector<LimitChange> limitChanges;
+  };
+
+  // Each VM has its own collector. Marks are kept in side tables: the pages
+  // of a PageHeap have their own, and the blocks of the heap, which `start`
+  // indexes by address, have a bit each in the collector's. Marking
+  // follows an explicit stack instead of recursing: roots are pushed as
+  // they're found, and `finish` traces everything reachable from them.
+  // Large heaps are traced by helper threads as well. Each thread has its
+  // own stack and moves part of it to a deque that idle threads steal from.
+  //
+  // A collection can also be spread over steps, with the program running
+  // in between (see HeapPolicy::pauseMicros). It keeps whatever was
+  // reachable when it started: the roots are only marked then, blocks
+  // allocated after that aren't indexed and cells are marked as they're
+  // allocated, so they survive it, and the program reports the values it
+  // overwrites in the heap and in scopes (`markValue`, the write barrier)
+  // so the tracing still reaches them. Sweeping the blocks is done in steps
+  // as well, the pages are swept as they're allocated from.
   class GC {
     public:
-      static void start() {
-        roots.clear();
-        scopes.clear();
-      }
+      // smaller heaps are always marked on the VM's thread alone
+      static const size_t PARALLEL_THRESHOLD = 1 << 16;
+      static const unsigned MAX_THREADS = 8;
 
-      static void markValue(Value value, Heap &heap) {
-        if (!value.isHeapAllocated()) {
-          return;
-        }
-
-        if (roots.find(value.encode()) != roots.end()) {
-          return;
-        }
-
-        roots.insert(value.encode());
-
-        auto ptr = value.asPtr();
-        auto it = heap.begin();
-
-        while (it != heap.end()) {
-          if (it->second == ptr) break;
-          else ++it;
-        }
-
-        if (it != heap.end()) {
-          it->second = mark(it->second);
-
-          if (value.isList()) {
-            for (unsigned i = 0; i < value.asList()->length; i++) {
-              markValue(value.asList()->at(i), heap);
-            }
-          } else if (value.isObject()) {
-            for (unsigned i = 0; i < value.asObject()->size; i++) {
-              markValue(value.asObject()->at(i), heap);
-            }
-          } else if (value.isClosure()) {
-            Scope *scope;
-            if ((scope = value.asClosure()->scope) != NULL) {
-              markScope(scope, heap);
-            }
-          }
-        }
-      }
+      typedef std::chrono::steady_clock::time_point Deadline;
 
-      static void markScope(Scope *scope, Heap &heap) {
-        if (scopes.find(scope) != scopes.end()) {
-          return;
-        }
+      enum class Phase { Idle, Marking, Sweeping };
 
-        scopes.insert(scope);
+      GC();
+      ~GC();
 
-        scope->visit([&heap](Value value) {
-            markValue(value, heap);
-        });
+      // how many threads may mark, 0 picks one per core
+      void setThreads(unsigned threads);
 
-        if (scope->parent) {
-          markScope(scope->parent, heap);
-        }
-      }
+      // Scopes from other pools are left alone: an isolate's globals lead
+      // to its parent's (see VM::inherit), which belong to the parent's heap
+      // and are marked by the parent's collector, maybe on another thread.
+      void setScopePool(const ScopePool *pool) { m_scopePool = pool; }
 
-      static void sweep(Heap &heap, size_t *heapSize) {
-        LOG_GC("Sweeping... initial heap size: %ld\n", *heapSize);
-        auto it = heap.begin();
-        while (it != heap.end()) {
-          if (GC::isMarked(it->second)) {
-            it->second = GC::unmark(it->second);
-            ++it;
-          } else {
-            free(it->second);
-            *heapSize -= it->first;
-            it = heap.erase(it);
-          }
-        }
-        LOG_GC("Done sweeping, heap size: %ld\n", *heapSize);
+      Phase phase() const { return m_phase; }
 
-      }
+      // blocks can only be added to `heap` until it's swept, `pages` only
+      // allocates until `finish`
+      void start(const Heap &heap, PageHeap *pages = nullptr);
 
-      static void *mark(void *ptr) {
-        return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) | 1);
-      }
+      // roots, traced once they've all been found
+      void markValue(Value value);
+      void markScope(Scope *scope);
+      // traces on the VM's thread until the deadline, true once there's
+      // nothing left to trace
+      bool step(Deadline deadline);
+      // marks everything reachable from the roots
+      void finish();
 
-      static bool isMarked(void *ptr) {
-        return reinterpret_cast<uintptr_t>(ptr) & 1;
+      // Strings may point anywhere into `buffer`, a block of the heap: the
+      // lines of a LineReader. Any of them keeps the whole block alive.
+      void addBuffer(void *buffer, size_t size) {
+        buffers.push_back({ reinterpret_cast<uintptr_t>(buffer), size });
       }
 
-      static void *unmark(void *ptr) {
-        return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(ptr) & (~1));
-      }
-    private:
+      // once marking is done, forgets the buffers about to be swept
+      void dropUnmarkedBuffers();
+      // once marking is done, whether the block or cell at `address` survives
+      // the collection: the ones allocated since it started do
+      bool isLive(const void *address) const;
+
+      // frees the blocks that weren't marked, keeping the others in order,
+      // until the deadline. True once the whole heap was swept.
+      bool sweep(Heap &heap, size_t *heapSize, GCStats &stats, Deadline deadline = Deadline::max());
 
-      static std::set<uint64_t> roots;
-      static std::set<Scope *> scopes;
+    private:
+      struct Marker {
+        std::vector<uint64_t> stack;
+        // the part of the stack other threads may steal
+        std::mutex lock;
+        std::vector<uint64_t> shared;
+      };
+
+      struct Slot {
+        uintptr_t address;
+        size_t index;
+      };
+
+      // the index of the block at `address` in the heap, or -1
+      ssize_t find(uintptr_t address) const;
+      // false if it was marked already
+      bool setMark(size_t index);
+      bool isMarked(size_t index) const;
+
+      void trace(Value value, std::vector<uint64_t> &stack);
+      void traceScope(Scope *scope, std::vector<uint64_t> &stack);
+      void drain(unsigned index);
+      void share(Marker &marker);
+      bool steal(unsigned index);
+
+      unsigned m_threads;
+      std::vector<std::unique_ptr<Marker>> m_markers;
+      // the markers of the current collection
+      unsigned m_active = 1;
+      std::atomic<unsigned> m_idle;
+      std::atomic<size_t> m_available;
+
+      Phase m_phase = Phase::Idle;
+      const Heap *m_heap = nullptr;
+      PageHeap *m_pages = nullptr;
+      const ScopePool *m_scopePool = nullptr;
+      // blocks and cells, whether they're marked in parallel
+      size_t m_objects = 0;
+
+      // open addressing, a power of two in size with empty slots at 0
+      std::vector<Slot> m_index;
+      unsigned m_indexShift = 0;
+      std::unique_ptr<std::atomic<uint64_t>[]> m_marks;
+      size_t m_markWords = 0;
+      // scopes are marked with the collection they were reached in
+      uint64_t m_epoch = 0;
+
+      // the blocks that were there when marking started
+      size_t m_sweepEnd = 0;
+      size_t m_swept = 0;
+      size_t m_live = 0;
+
+      std::vector<std::pair<uintptr_t, size_t>> buffers;
   };
 }
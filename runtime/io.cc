@@ -0,0 +1,193 @@
+#include "io.h"
+
+#include "vm.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace Verve {
+
+EventLoop::EventLoop() {
+  if (pipe(m_pipe) != 0) {
+    perror("Cannot create the event loop's pipe");
+    throw std::bad_alloc();
+  }
+  fcntl(m_pipe[0], F_SETFL, fcntl(m_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl(m_pipe[1], F_SETFL, fcntl(m_pipe[1], F_GETFL) | O_NONBLOCK);
+}
+
+EventLoop::~EventLoop() {
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+  close(m_pipe[0]);
+  close(m_pipe[1]);
+}
+
+void EventLoop::submit(std::function<void()> operation, std::function<void()> done) {
+  m_pending++;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_requests.push_back({ std::move(operation), std::move(done) });
+    if (m_idle < m_requests.size() && m_threads.size() < MAX_THREADS) {
+      m_threads.emplace_back([this] { run(); });
+    }
+  }
+  m_wake.notify_one();
+}
+
+void EventLoop::run() {
+  std::unique_lock<std::mutex> lock(m_lock);
+  for (;;) {
+    m_idle++;
+    m_wake.wait(lock, [this] { return m_stopping || !m_requests.empty(); });
+    m_idle--;
+    if (m_stopping) {
+      return;
+    }
+
+    auto request = std::move(m_requests.front());
+    m_requests.pop_front();
+    lock.unlock();
+    request.operation();
+    lock.lock();
+
+    m_completed.push_back(std::move(request.done));
+    // a full pipe already has the VM's attention
+    char byte = 0;
+    while (write(m_pipe[1], &byte, 1) < 0 && errno == EINTR);
+  }
+}
+
+void EventLoop::poll(bool wait) {
+  assert(m_pending > 0);
+
+  struct pollfd fd;
+  fd.fd = m_pipe[0];
+  fd.events = POLLIN;
+  while (::poll(&fd, 1, wait ? -1 : 0) < 0 && errno == EINTR);
+
+  char buffer[64];
+  while (read(m_pipe[0], buffer, sizeof(buffer)) > 0);
+
+  std::vector<std::function<void()>> completed;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    completed.swap(m_completed);
+  }
+  m_pending -= completed.size();
+  for (auto &done : completed) {
+    done();
+  }
+}
+
+void await(VM &vm, std::function<void()> operation) {
+  auto &scheduler = vm.m_scheduler;
+  auto fiber = scheduler.running();
+  bool done = false;
+
+  vm.m_events.submit(std::move(operation), [&] {
+    done = true;
+    scheduler.resume(fiber);
+  });
+  while (!done) {
+    scheduler.park();
+  }
+}
+
+const size_t LineReader::BUFFER_SIZE;
+
+const char *LineReader::next() {
+  if (!m_buffer) {
+    return nullptr;
+  }
+
+  auto start = m_buffer + m_position;
+  auto newline = (char *)memchr(start, '\n', m_end - m_position);
+  if (newline) {
+    *newline = '\0';
+    m_position = newline - m_buffer + 1;
+    return start;
+  }
+
+  // the last line may not end in a newline
+  if (m_eof && m_position < m_end) {
+    m_buffer[m_end] = '\0';
+    m_position = m_end;
+    return start;
+  }
+  return nullptr;
+}
+
+bool LineReader::refill(int fd) {
+  char *target;
+  size_t room;
+  if (m_end < m_size) {
+    m_fresh = nullptr;
+    target = m_buffer + m_end;
+    room = m_size - m_end;
+  } else {
+    // a line longer than a buffer gets a bigger one
+    auto partial = m_end - m_position;
+    m_freshSize = std::max(BUFFER_SIZE, 2 * partial);
+    m_fresh = (char *)malloc(m_freshSize + 1);
+    memcpy(m_fresh, m_buffer + m_position, partial);
+    target = m_fresh + partial;
+    room = m_freshSize - partial;
+  }
+
+  ssize_t count;
+  while ((count = read(fd, target, room)) < 0 && errno == EINTR);
+  if (count < 0) {
+    free(m_fresh);
+    m_fresh = nullptr;
+    return false;
+  }
+  m_read = count;
+  return true;
+}
+
+void LineReader::adopt(VM &vm) {
+  if (m_fresh) {
+    // the current buffer is still reachable from the reader if this collects
+    vm.trackAllocation(m_fresh, m_freshSize + 1);
+    vm.m_gc.addBuffer(m_fresh, m_freshSize + 1);
+    m_end -= m_position;
+    m_position = 0;
+    m_buffer = m_fresh;
+    m_size = m_freshSize;
+    m_fresh = nullptr;
+  }
+
+  m_eof = m_read == 0;
+  m_end += m_read;
+}
+
+File::~File() {
+  if (stream && stream != stdin) {
+    fclose(stream);
+  }
+}
+
+Value fileValue(VM &vm, File *file) {
+  std::unique_ptr<File> owned(file);
+  auto handle = (uint64_t *)vm.allocate(2 * 8);
+  handle[0] = (1ull << 32) | File::HANDLE_TAG;
+  handle[1] = reinterpret_cast<uintptr_t>(file);
+  vm.m_files.push_back({ handle, std::move(owned) });
+  return Value((Object *)handle);
+}
+
+}
@@ -0,0 +1,134 @@
+#include "value.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Runs a VM's blocking I/O on threads of its own, started as needed, and
+  // hands the completions back to the VM's thread. Regular files are always
+  // "ready" as far as poll or epoll are concerned, the threads are what lets
+  // the VM run other fibers while the disk catches up. A pipe wakes up the
+  // VM when it's waiting (see Scheduler::park).
+  class EventLoop {
+    public:
+      static const unsigned MAX_THREADS = 4;
+
+      EventLoop();
+      // abandons the operations that didn't start yet
+      ~EventLoop();
+
+      // `operation` runs on an I/O thread, then `done` on the VM's thread
+      // from the next `poll`. Neither may throw.
+      void submit(std::function<void()> operation, std::function<void()> done);
+
+      // whether there are operations `poll` didn't complete yet
+      bool pending() const { return m_pending > 0; }
+
+      // runs the `done` of the operations that completed, first waiting for
+      // one if `wait` is set
+      void poll(bool wait);
+
+    private:
+      void run();
+
+      struct Request {
+        std::function<void()> operation;
+        std::function<void()> done;
+      };
+
+      // only used on the VM's thread
+      size_t m_pending = 0;
+
+      // guards everything below
+      std::mutex m_lock;
+      std::condition_variable m_wake;
+      std::deque<Request> m_requests;
+      std::vector<std::function<void()>> m_completed;
+      std::vector<std::thread> m_threads;
+      unsigned m_idle = 0;
+      bool m_stopping = false;
+
+      // written by the I/O threads once they complete something
+      int m_pipe[2];
+  };
+
+  // Runs `operation` on the VM's I/O threads, the running fiber is parked
+  // until it's done
+  void await(VM &vm, std::function<void()> operation);
+
+  // Splits a file into lines without copying them: a line is a string in
+  // the reader's buffer, with its newline replaced by the terminator. The
+  // buffers are blocks of the VM's heap that strings may point into (see
+  // GC::addBuffer), so lines stay valid for as long as they're used, and the
+  // buffers nothing uses anymore are collected: a long input streams through
+  // a few of them. A buffer is filled up before the reader moves on to a new
+  // one, which starts with the line the previous one ended in the middle of.
+  class LineReader {
+    public:
+      static const size_t BUFFER_SIZE = 1 << 20;
+
+      // the next line, or null when the buffer needs refilling or it's the
+      // end of the file
+      const char *next();
+      bool atEnd() const { return m_eof && m_position == m_end; }
+
+      // On an I/O thread: reads more of `fd`, past the end of the buffer or
+      // into a new one. False on errors, with errno set.
+      bool refill(int fd);
+      // back on the VM's thread, makes what `refill` read available
+      void adopt(VM &vm);
+
+      const char *buffer() const { return m_buffer; }
+
+    private:
+      char *m_buffer = nullptr;
+      // the buffer's size, not counting room for one last terminator
+      size_t m_size = 0;
+      size_t m_position = 0;
+      size_t m_end = 0;
+      bool m_eof = false;
+
+      // what `refill` read, for `adopt`
+      char *m_fresh = nullptr;
+      size_t m_freshSize = 0;
+      size_t m_read = 0;
+  };
+
+  // A file `open` or `stdin` returned, closed when it's deleted if the
+  // program didn't (but stdin is never closed)
+  struct File {
+    // the tag of the objects that refer to files, see fileValue
+    static const unsigned HANDLE_TAG = 0xfffffffe;
+
+    ~File();
+
+    static bool isHandle(const Object *object) {
+      return object->size == 1 && object->tag == HANDLE_TAG;
+    }
+
+    FILE *stream = nullptr;
+    std::string path;
+    // for `read_line` and `each_line`, one fiber at a time
+    LineReader reader;
+    bool reading = false;
+    // reads and writes running on the I/O threads, it can't be closed or
+    // deleted until they're done
+    unsigned pending = 0;
+  };
+
+  // A `file` value for `file`, which `vm` takes: an object whose only field
+  // is its address (see channelValue). The file is deleted once the handle
+  // is swept. Files can't be copied to other VMs.
+  Value fileValue(VM &vm, File *file);
+}
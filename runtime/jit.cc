@@ -0,0 +1,341 @@
+#include "jit.h"
+
+#include "vm.h"
+
+#include "bytecode/opcodes.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <unordered_map>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Verve {
+
+namespace {
+  const size_t CHUNK_SIZE = 1 << 20;
+
+  // size of the sequence emitted by `Assembler::jumpToHandler`
+  const unsigned HANDLER_JUMP_SIZE = 22;
+
+  struct Assembler {
+    Assembler(const uintptr_t *handlers) :
+      handlers(handlers) {}
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+      code.insert(code.end(), bytes);
+    }
+
+    void emit32(int32_t value) {
+      auto bytes = reinterpret_cast<uint8_t *>(&value);
+      code.insert(code.end(), bytes, bytes + sizeof(value));
+    }
+
+    void emit64(uint64_t value) {
+      auto bytes = reinterpret_cast<uint8_t *>(&value);
+      code.insert(code.end(), bytes, bytes + sizeof(value));
+    }
+
+    void patch32(size_t position, int32_t value) {
+      memcpy(&code[position], &value, sizeof(value));
+    }
+
+    // mov $bytecode, %r12
+    // mov $handler, %rax
+    // jmp *%rax
+    void jumpToHandler(const uint8_t *bytecode, Opcode::Type opcode) {
+      emit({ 0x49, 0xbc });
+      emit64(reinterpret_cast<uint64_t>(bytecode));
+      emit({ 0x48, 0xb8 });
+      emit64(handlers[opcode]);
+      emit({ 0xff, 0xe0 });
+    }
+
+    size_t size() const {
+      return code.size();
+    }
+
+    const uintptr_t *handlers;
+    std::vector<uint8_t> code;
+  };
+
+  int32_t operand(const uint8_t *instruction, unsigned index) {
+    int32_t value;
+    memcpy(&value, instruction + OPCODE_SIZE + index * OPERAND_SIZE, OPERAND_SIZE);
+    return value;
+  }
+
+  // `ret`'s template jumps to the handler without pointing BYTECODE at the
+  // instruction, which the handlers --opstats wraps them with read
+  bool hasTemplate(Opcode::Type opcode, bool countsOpcodes) {
+    switch (opcode) {
+      case Opcode::push:
+      case Opcode::push_arg:
+      case Opcode::stack_load:
+      case Opcode::stack_store:
+      case Opcode::obj_load:
+      case Opcode::jmp:
+      case Opcode::jz:
+        return true;
+      case Opcode::ret:
+        return !countsOpcodes;
+      default:
+        return false;
+    }
+  }
+}
+
+JIT::JIT(VM *vm, uint8_t *bytecode) :
+  m_vm(vm),
+  m_bytecode(bytecode) {}
+
+JIT::~JIT() {
+  for (const auto &chunk : m_chunks) {
+    munmap(chunk.first, chunk.second);
+  }
+}
+
+void JIT::install() {
+  const auto &functions = m_vm->m_userFunctions;
+  m_entries.resize(functions.size(), 0);
+
+  auto enterSize = Opcode::instructionSize(Opcode::jit_enter);
+  for (unsigned i = 0; i < functions.size(); i++) {
+    auto &fn = functions[i];
+    auto code = m_bytecode + fn.offset;
+    m_code.emplace_back(reinterpret_cast<char *>(code), fn.size);
+
+    // too small to be patched, keep interpreting it
+    if (fn.size < enterSize) {
+      continue;
+    }
+
+    int32_t id = i;
+    code[0] = Opcode::jit_enter;
+    memcpy(code + OPCODE_SIZE, &id, OPERAND_SIZE);
+  }
+}
+
+uintptr_t JIT::compile(unsigned fnID) {
+  if (m_entries[fnID]) {
+    return m_entries[fnID];
+  }
+
+  const auto &code = m_code[fnID];
+  auto bytes = reinterpret_cast<const uint8_t *>(code.data());
+  auto resumeSize = Opcode::instructionSize(Opcode::jit_resume);
+  bool countsOpcodes = m_vm->m_opStats != nullptr;
+
+  // lay out the stubs first, so the native code can refer to them
+  size_t stubsSize = 0;
+  for (unsigned offset = 0; offset < code.size(); offset += Opcode::instructionSize(bytes + offset)) {
+    auto opcode = static_cast<Opcode::Type>(bytes[offset]);
+    if (!hasTemplate(opcode, countsOpcodes)) {
+      stubsSize += Opcode::instructionSize(bytes + offset) + resumeSize;
+    }
+  }
+  auto stubs = new uint8_t[stubsSize];
+  m_stubs.emplace_back(stubs);
+
+  Assembler a(m_vm->m_interpreter.dispatchTable);
+  std::unordered_map<unsigned, size_t> labels;
+  // rel32 to be patched with the native offset of a bytecode offset
+  std::vector<std::pair<size_t, unsigned>> jumps;
+  // jit_resume operands to be patched with a native offset
+  std::vector<std::pair<uint8_t *, size_t>> resumes;
+
+  auto stub = stubs;
+  auto emitStub = [&](const uint8_t *instruction, unsigned size) {
+    auto opcode = static_cast<Opcode::Type>(instruction[0]);
+    memcpy(stub, instruction, size);
+    stub[size] = Opcode::jit_resume;
+    resumes.push_back({ stub + size + OPCODE_SIZE, a.size() + HANDLER_JUMP_SIZE });
+    a.jumpToHandler(stub, opcode);
+    stub += size + resumeSize;
+  };
+
+  for (unsigned offset = 0; offset < code.size();) {
+    auto instruction = bytes + offset;
+    auto opcode = static_cast<Opcode::Type>(instruction[0]);
+    auto size = Opcode::instructionSize(instruction);
+    labels[offset] = a.size();
+
+    switch (opcode) {
+      case Opcode::push: {
+        uint64_t value;
+        memcpy(&value, instruction + OPCODE_SIZE, sizeof(value));
+        a.emit({ 0x48, 0xb8 }); // mov $value, %rax
+        a.emit64(value);
+        a.emit({ 0x50 }); // push %rax
+        break;
+      }
+      case Opcode::push_arg:
+        a.emit({ 0xff, 0xb5 }); // push 0x20+8*i(%rbp)
+        a.emit32(0x20 + WORD_SIZE * operand(instruction, 0));
+        break;
+      case Opcode::stack_load:
+        a.emit({ 0x41, 0xff, 0xb5 }); // push 8*slot(%r13)
+        a.emit32(WORD_SIZE * operand(instruction, 0));
+        break;
+      case Opcode::stack_store:
+        a.emit({ 0x41, 0x8f, 0x85 }); // pop 8*slot(%r13)
+        a.emit32(WORD_SIZE * operand(instruction, 0));
+        break;
+      case Opcode::obj_load:
+        a.emit({ 0x5f }); // pop %rdi
+        a.emit({ 0x48, 0xc1, 0xe7, 0x08 }); // shl $8, %rdi
+        a.emit({ 0x48, 0xc1, 0xef, 0x08 }); // shr $8, %rdi
+        a.emit({ 0xff, 0xb7 }); // push 8+8*offset(%rdi)
+        a.emit32(WORD_SIZE + WORD_SIZE * operand(instruction, 0));
+        break;
+      case Opcode::jmp:
+        a.emit({ 0xe9 }); // jmp rel32
+        jumps.push_back({ a.size(), offset + operand(instruction, 0) });
+        a.emit32(0);
+        break;
+      case Opcode::jz:
+        a.emit({ 0x58 }); // pop %rax
+        a.emit({ 0x48, 0x85, 0xc0 }); // test %rax, %rax
+        a.emit({ 0x0f, 0x84 }); // jz rel32
+        jumps.push_back({ a.size(), offset + operand(instruction, 0) });
+        a.emit32(0);
+        break;
+      case Opcode::ret:
+        if (countsOpcodes) {
+          emitStub(instruction, size);
+          break;
+        }
+        a.emit({ 0x48, 0xb8 }); // mov $op_ret, %rax
+        a.emit64(a.handlers[Opcode::ret]);
+        a.emit({ 0xff, 0xe0 }); // jmp *%rax
+        break;
+      case Opcode::lookup: {
+        auto cacheSlot = operand(instruction, 1);
+        if (cacheSlot) {
+          a.emit({ 0x48, 0x8b, 0x83 }); // mov 8*slot(%rbx), %rax
+          a.emit32(WORD_SIZE * cacheSlot);
+          a.emit({ 0x48, 0x85, 0xc0 }); // test %rax, %rax
+          a.emit({ 0x74, 0x03 }); // jz over the fast path
+          a.emit({ 0x50 }); // push %rax
+          a.emit({ 0xeb, HANDLER_JUMP_SIZE }); // jmp over the slow path
+        }
+        emitStub(instruction, size);
+        break;
+      }
+      case Opcode::call: {
+        // builtins are called inline, closures go through op_call
+        auto argc = operand(instruction, 0);
+        a.emit({ 0x59 }); // pop %rcx
+        a.emit({ 0xbf }); // mov $argc, %edi
+        a.emit32(argc);
+        a.emit({ 0x48, 0x89, 0xe6 }); // mov %rsp, %rsi
+        a.emit({ 0x4c, 0x89, 0xf2 }); // mov %VM, %rdx
+        a.emit({ 0x48, 0xc1, 0xc1, 0x08 }); // rol $8, %rcx
+        a.emit({ 0xf6, 0xc1, Value::ClosureTag }); // test $ClosureTag, %cl
+        a.emit({ 0x75, 0x1c }); // jnz to the closure path
+        a.emit({ 0x48, 0xc1, 0xe9, 0x08 }); // shr $8, %rcx
+        a.emit({ 0x53 }); // push %rbx
+        a.emit({ 0x48, 0x89, 0xe3 }); // mov %rsp, %rbx
+        a.emit({ 0x48, 0x83, 0xe4, 0xf0 }); // and $-0x10, %rsp
+        a.emit({ 0xff, 0xd1 }); // call *%rcx
+        a.emit({ 0x48, 0x89, 0xdc }); // mov %rbx, %rsp
+        a.emit({ 0x5b }); // pop %rbx
+        a.emit({ 0x48, 0x81, 0xc4 }); // add $8*argc, %rsp
+        a.emit32(WORD_SIZE * argc);
+        a.emit({ 0x50 }); // push %rax
+        a.emit({ 0xeb, 0x05 + HANDLER_JUMP_SIZE }); // jmp over the closure path
+        a.emit({ 0x48, 0xc1, 0xc9, 0x08 }); // ror $8, %rcx
+        a.emit({ 0x51 }); // push %rcx
+        emitStub(instruction, size);
+        break;
+      }
+      case Opcode::switch_tag: {
+        a.emit({ 0x5f }); // pop %rdi
+        a.emit({ 0x48, 0x89, 0xfe }); // mov %rdi, %rsi
+        a.emit({ 0x48, 0xc1, 0xe7, 0x08 }); // shl $8, %rdi
+        a.emit({ 0x48, 0xc1, 0xef, 0x08 }); // shr $8, %rdi
+        a.emit({ 0x8b, 0x3f }); // mov (%rdi), %edi
+        auto count = operand(instruction, 0);
+        for (int32_t tag = 0; tag < count; tag++) {
+          auto target = operand(instruction, 1 + tag);
+          if (!target) {
+            continue;
+          }
+          a.emit({ 0x81, 0xff }); // cmp $tag, %edi
+          a.emit32(tag);
+          a.emit({ 0x0f, 0x84 }); // je rel32
+          jumps.push_back({ a.size(), offset + target });
+          a.emit32(0);
+        }
+        // no case matches: let the handler report it
+        a.emit({ 0x56 }); // push %rsi
+        emitStub(instruction, size);
+        break;
+      }
+      default:
+        emitStub(instruction, size);
+    }
+
+    offset += size;
+  }
+  labels[code.size()] = a.size();
+
+  for (const auto &jump : jumps) {
+    auto it = labels.find(jump.second);
+    assert(it != labels.end());
+    a.patch32(jump.first, it->second - (jump.first + sizeof(int32_t)));
+  }
+
+  // W^X: the chunk is only writable while the code is copied in. The
+  // functions compiled before it in the same pages are this VM's, they
+  // don't run while it compiles.
+  auto native = allocateCode(a.size());
+  protect(native, a.size(), PROT_READ | PROT_WRITE);
+  memcpy(native, a.code.data(), a.size());
+  protect(native, a.size(), PROT_READ | PROT_EXEC);
+
+  for (const auto &resume : resumes) {
+    auto address = reinterpret_cast<uint64_t>(native + resume.second);
+    memcpy(resume.first, &address, sizeof(address));
+  }
+
+  m_entries[fnID] = reinterpret_cast<uintptr_t>(native);
+  return m_entries[fnID];
+}
+
+uint8_t *JIT::allocateCode(size_t size) {
+  if (size > m_available) {
+    auto chunkSize = std::max(size, CHUNK_SIZE);
+    auto chunk = mmap(nullptr, chunkSize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (chunk == MAP_FAILED) {
+      fprintf(stderr, "JIT: Failed to allocate executable memory\n");
+      throw std::bad_alloc();
+    }
+    m_chunks.push_back({ static_cast<uint8_t *>(chunk), chunkSize });
+    m_free = static_cast<uint8_t *>(chunk);
+    m_available = chunkSize;
+  }
+
+  auto code = m_free;
+  m_free += size;
+  m_available -= size;
+  return code;
+}
+
+// of the whole pages `code` is in
+void JIT::protect(uint8_t *code, size_t size, int protection) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  auto begin = reinterpret_cast<uintptr_t>(code) & ~(page - 1);
+  auto end = reinterpret_cast<uintptr_t>(code) + size;
+  if (mprotect(reinterpret_cast<void *>(begin), end - begin, protection) != 0) {
+    fprintf(stderr, "JIT: Failed to change the protection of native code: %s\n", strerror(errno));
+    throw std::bad_alloc();
+  }
+}
+
+}
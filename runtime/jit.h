@@ -0,0 +1,45 @@
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Baseline template JIT. Every function's first instruction is replaced by
+  // `jit_enter`, which translates the function to x86-64 on its first call.
+  // Simple instructions are compiled to inline templates, the rest jump to
+  // the interpreter's handler with BYTECODE pointing at a copy of the
+  // instruction followed by `jit_resume`, which jumps back to native code.
+  class JIT {
+    public:
+      JIT(VM *vm, uint8_t *bytecode);
+      ~JIT();
+
+      void install();
+      uintptr_t compile(unsigned fnID);
+
+      uintptr_t *entries() { return m_entries.data(); }
+
+    private:
+      // chunks are mapped read-only and executable, see `protect`
+      uint8_t *allocateCode(size_t size);
+      void protect(uint8_t *code, size_t size, int protection);
+
+      VM *m_vm;
+      uint8_t *m_bytecode;
+
+      // native entry of every function, 0 until it's compiled
+      std::vector<uintptr_t> m_entries;
+      // functions' code before `jit_enter` was patched in
+      std::vector<std::string> m_code;
+      std::vector<std::unique_ptr<uint8_t[]>> m_stubs;
+
+      std::vector<std::pair<uint8_t *, size_t>> m_chunks;
+      uint8_t *m_free = nullptr;
+      size_t m_available = 0;
+  };
+}
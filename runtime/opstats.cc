@@ -0,0 +1,80 @@
+#include "opstats.h"
+
+#include "vm.h"
+
+#include "bytecode/opcodes.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+extern "C" void op_count();
+extern "C" void op_lookup_count();
+
+namespace Verve {
+
+static_assert(offsetof(OpStats::Counters, ops) == 0x800, "interpreter.S relies on the layout of OpStats::Counters");
+static_assert(offsetof(OpStats::Counters, pairs) == 0x1000, "interpreter.S relies on the layout of OpStats::Counters");
+static_assert(offsetof(OpStats::Counters, lookupHits) == 0x81000, "interpreter.S relies on the layout of OpStats::Counters");
+static_assert(offsetof(OpStats::Counters, previous) == 0x81010, "interpreter.S relies on the layout of OpStats::Counters");
+
+// must run after any other handler was swapped in, so it can wrap them
+void OpStats::install() {
+  memset(&m_counters, 0, sizeof(m_counters));
+  // the first instruction has no predecessor
+  m_counters.previous = 0xff;
+
+  auto handlers = m_vm->m_interpreter.dispatchTable;
+  for (unsigned i = 0; i < Opcode::count(); i++) {
+    m_counters.handlers[i] = handlers[i];
+    handlers[i] = (uintptr_t)op_count;
+  }
+  handlers[Opcode::lookup] = (uintptr_t)op_lookup_count;
+
+  // read by the counting handlers
+  m_vm->m_interpreter.opStats = &m_counters;
+}
+
+// tab separated: `op <name> <count>`, `pair <first> <second> <count>` and
+// `lookup <hit|miss> <count>`, each kind sorted by count
+void OpStats::report() {
+  auto handlers = m_vm->m_interpreter.dispatchTable;
+  for (unsigned i = 0; i < Opcode::count(); i++) {
+    handlers[i] = m_counters.handlers[i];
+  }
+  m_vm->m_interpreter.opStats = nullptr;
+
+  auto name = [](unsigned opcode) {
+    return Opcode::typeName(static_cast<Opcode::Type>(opcode));
+  };
+  auto byCount = [](const std::pair<unsigned, uint64_t> &a, const std::pair<unsigned, uint64_t> &b) {
+    return a.second > b.second;
+  };
+
+  std::vector<std::pair<unsigned, uint64_t>> ops;
+  std::vector<std::pair<unsigned, uint64_t>> pairs;
+  for (unsigned i = 0; i < Opcode::count(); i++) {
+    if (m_counters.ops[i]) {
+      ops.push_back({ i, m_counters.ops[i] });
+    }
+    for (unsigned j = 0; j < Opcode::count(); j++) {
+      if (m_counters.pairs[i][j]) {
+        pairs.push_back({ i << 8 | j, m_counters.pairs[i][j] });
+      }
+    }
+  }
+  std::stable_sort(ops.begin(), ops.end(), byCount);
+  std::stable_sort(pairs.begin(), pairs.end(), byCount);
+
+  for (const auto &op : ops) {
+    fprintf(m_output, "op\t%s\t%llu\n", name(op.first), (unsigned long long)op.second);
+  }
+  for (const auto &pair : pairs) {
+    fprintf(m_output, "pair\t%s\t%s\t%llu\n", name(pair.first >> 8), name(pair.first & 0xff), (unsigned long long)pair.second);
+  }
+  fprintf(m_output, "lookup\thit\t%llu\n", (unsigned long long)m_counters.lookupHits);
+  fprintf(m_output, "lookup\tmiss\t%llu\n", (unsigned long long)m_counters.lookupMisses);
+}
+
+}
@@ -0,0 +1,39 @@
+#include <cstdint>
+#include <cstdio>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Counts how many times each opcode and each pair of consecutive opcodes
+  // runs, and how often `lookup` finds its symbol in the lookup cache.
+  // Every dispatch table entry is swapped for a handler that counts the
+  // instruction and then jumps to the original one, so it costs nothing
+  // when disabled. With the JIT only the instructions native code hands back
+  // to the interpreter are counted.
+  class OpStats {
+    public:
+      OpStats(VM *vm, FILE *output) :
+        m_vm(vm),
+        m_output(output) {}
+
+      void install();
+      void report();
+
+      // layout known by the counting handlers in interpreter.S
+      struct Counters {
+        uintptr_t handlers[256];
+        uint64_t ops[256];
+        uint64_t pairs[256][256];
+        uint64_t lookupHits;
+        uint64_t lookupMisses;
+        uint64_t previous;
+      };
+
+    private:
+      VM *m_vm;
+      FILE *m_output;
+      Counters m_counters;
+  };
+}
@@ -0,0 +1,209 @@
+#include "pages.h"
+
+#include "gc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace Verve {
+
+  const size_t PageHeap::PAGE_SIZE;
+  const size_t PageHeap::MIN_CELL_SIZE;
+  const size_t PageHeap::MAX_CELL_SIZE;
+
+  PageHeap::PageHeap() {}
+
+  PageHeap::~PageHeap() {
+    for (auto page : m_pages) {
+      free(reinterpret_cast<void *>(page->base));
+      delete page;
+    }
+  }
+
+  // 16 byte steps up to 128, then four classes per power of two: the cells
+  // waste at most a fifth of what they hold
+  unsigned PageHeap::sizeClass(size_t size) {
+    if (size <= 128) {
+      return size ? (size - 1) / 16 : 0;
+    }
+    unsigned power = 63 - __builtin_clzll(size - 1);
+    auto step = 1ull << (power - 2);
+    auto index = (size - (1ull << power) + step - 1) / step - 1;
+    return 8 + (power - 7) * 4 + index;
+  }
+
+  size_t PageHeap::cellSize(size_t size) {
+    return size > MAX_CELL_SIZE ? 0 : classSize(sizeClass(size));
+  }
+
+  size_t PageHeap::classSize(unsigned sizeClass) {
+    if (sizeClass < 8) {
+      return (sizeClass + 1) * 16;
+    }
+    auto power = 7 + (sizeClass - 8) / 4;
+    return (1ull << power) + ((sizeClass - 8) % 4 + 1) * (1ull << (power - 2));
+  }
+
+  void *PageHeap::allocate(size_t size, GCStats &stats) {
+    auto &sizeClass = m_classes[PageHeap::sizeClass(size)];
+    auto page = sizeClass.current;
+    auto index = page ? page->findFree() : -1;
+    if (index < 0) {
+      page = refill(sizeClass, stats);
+      index = page->findFree();
+    }
+
+    page->inUse[index / 64] |= 1ull << (index % 64);
+    // it wasn't there when marking started, it survives the collection
+    if (m_marking) {
+      page->setMark(index);
+    }
+    page->allocated++;
+    m_cells++;
+
+    auto cell = reinterpret_cast<void *>(page->base + index * page->cellSize);
+    memset(cell, 0, page->cellSize);
+    return cell;
+  }
+
+  // moves on to the next page with a free cell, sweeping the ones it goes
+  // through, or to a new page once they're all full
+  PageHeap::Page *PageHeap::refill(SizeClass &sizeClass, GCStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+    Page *page = nullptr;
+    while (sizeClass.next < sizeClass.pages.size()) {
+      auto candidate = sizeClass.pages[sizeClass.next++];
+      if (!candidate->swept) {
+        sweep(candidate);
+      }
+      if (candidate->allocated < candidate->cells) {
+        page = candidate;
+        break;
+      }
+    }
+    stats.sweepNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (!page) {
+      page = createPage(&sizeClass - m_classes);
+      sizeClass.pages.push_back(page);
+      sizeClass.next = sizeClass.pages.size();
+    }
+    sizeClass.current = page;
+    return page;
+  }
+
+  // only the cells that were marked stay in use
+  void PageHeap::sweep(Page *page) {
+    unsigned live = 0;
+    for (unsigned i = 0; i < page->words; i++) {
+      page->inUse[i] &= page->marks[i].load(std::memory_order_relaxed);
+      live += __builtin_popcountll(page->inUse[i]);
+    }
+    m_cells -= page->allocated - live;
+    page->allocated = live;
+    page->nextWord = 0;
+    page->swept = true;
+    m_unswept--;
+  }
+
+  PageHeap::Page *PageHeap::find(uintptr_t address) const {
+    auto it = std::upper_bound(m_pages.begin(), m_pages.end(), address, [](uintptr_t address, const Page *page) {
+      return address < page->base;
+    });
+    if (it == m_pages.begin() || address - (*(it - 1))->base >= PAGE_SIZE) {
+      return nullptr;
+    }
+    return *(it - 1);
+  }
+
+  void PageHeap::startMarking() {
+    for (auto &sizeClass : m_classes) {
+      auto &pages = sizeClass.pages;
+      for (size_t i = sizeClass.next; i < pages.size();) {
+        if (!pages[i]->swept) {
+          sweep(pages[i]);
+        }
+        if (pages[i]->allocated) {
+          i++;
+          continue;
+        }
+        // nothing allocated from it since the last collection, and nothing
+        // in it survived
+        releasePage(pages[i]);
+        pages.erase(pages.begin() + i);
+      }
+    }
+
+    for (auto page : m_pages) {
+      for (unsigned i = 0; i < page->words; i++) {
+        page->marks[i].store(0, std::memory_order_relaxed);
+      }
+    }
+    m_marking = true;
+  }
+
+  size_t PageHeap::finishMarking(GCStats &stats) {
+    size_t freed = 0;
+    for (auto page : m_pages) {
+      unsigned marked = 0;
+      for (unsigned i = 0; i < page->words; i++) {
+        marked += __builtin_popcountll(page->marks[i].load(std::memory_order_relaxed) & page->inUse[i]);
+      }
+      auto garbage = page->allocated - marked;
+      stats.objectsMarked += marked;
+      stats.bytesMarked += marked * page->cellSize;
+      stats.objectsFreed += garbage;
+      stats.bytesFreed += garbage * page->cellSize;
+      freed += garbage * page->cellSize;
+      page->swept = false;
+    }
+
+    for (auto &sizeClass : m_classes) {
+      sizeClass.next = 0;
+      sizeClass.current = nullptr;
+    }
+    m_unswept = m_pages.size();
+    m_marking = false;
+    return freed;
+  }
+
+  PageHeap::Page *PageHeap::createPage(unsigned sizeClass) {
+    void *memory;
+    if (posix_memalign(&memory, PAGE_SIZE, PAGE_SIZE)) {
+      throw std::bad_alloc();
+    }
+
+    auto page = new Page();
+    page->base = reinterpret_cast<uintptr_t>(memory);
+    page->cellSize = classSize(sizeClass);
+    page->cells = PAGE_SIZE / page->cellSize;
+    page->words = (page->cells + 63) / 64;
+    page->sizeClass = sizeClass;
+    page->allocated = 0;
+    page->swept = true;
+    page->nextWord = 0;
+    memset(page->inUse, 0, sizeof(page->inUse));
+    for (auto &word : page->marks) {
+      word.store(0, std::memory_order_relaxed);
+    }
+
+    auto it = std::upper_bound(m_pages.begin(), m_pages.end(), page, [](const Page *a, const Page *b) {
+      return a->base < b->base;
+    });
+    m_pages.insert(it, page);
+    return page;
+  }
+
+  void PageHeap::releasePage(Page *page) {
+    auto it = std::lower_bound(m_pages.begin(), m_pages.end(), page, [](const Page *a, const Page *b) {
+      return a->base < b->base;
+    });
+    m_pages.erase(it);
+    free(reinterpret_cast<void *>(page->base));
+    delete page;
+  }
+
+}
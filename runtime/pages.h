@@ -0,0 +1,135 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+#pragma once
+
+namespace Verve {
+
+  struct GCStats;
+
+  // Where the VM allocates its lists, objects, closures and strings: pages
+  // of `PAGE_SIZE` bytes, each split into cells of one size class. Requests
+  // larger than `MAX_CELL_SIZE` are left to malloc (see VM::allocate).
+  //
+  // Pages aren't swept when a collection ends. The collector counts what
+  // survived from the pages' mark bits, and each page is swept the next
+  // time its size class needs a free cell: the cells in use are the ones
+  // that were marked, a few instructions per 64 cells, and allocating picks
+  // the first cell that isn't. Sweeping costs as much as the program
+  // allocates, whatever the size of the heap. The pages
+  // allocation never reached are swept when the next collection starts,
+  // and returned to malloc if they're empty.
+  class PageHeap {
+    public:
+      static const size_t PAGE_SIZE = 64 << 10;
+      static const size_t MIN_CELL_SIZE = 16;
+      static const size_t MAX_CELL_SIZE = 2048;
+      static const unsigned SIZE_CLASSES = 24;
+
+      struct Page {
+        static const unsigned WORDS = PAGE_SIZE / MIN_CELL_SIZE / 64;
+
+        uintptr_t base;
+        unsigned cellSize;
+        unsigned cells;
+        // of the bitmaps the cells use
+        unsigned words;
+        unsigned sizeClass;
+        // in use, garbage included until the page is swept
+        unsigned allocated;
+        bool swept;
+        // the cells before it are in use
+        unsigned nextWord;
+        uint64_t inUse[WORDS];
+        std::atomic<uint64_t> marks[WORDS];
+
+        // the cell that starts at `address`, -1 if there's none in use
+        ssize_t cellAt(uintptr_t address) const {
+          auto offset = address - base;
+          auto cell = offset / cellSize;
+          if (offset % cellSize || cell >= cells || !(inUse[cell / 64] & (1ull << (cell % 64)))) {
+            return -1;
+          }
+          return cell;
+        }
+
+        // the first cell that isn't in use, -1 if they all are
+        ssize_t findFree() {
+          for (; nextWord < words; nextWord++) {
+            if (auto free = ~inUse[nextWord]) {
+              size_t cell = nextWord * 64 + __builtin_ctzll(free);
+              return cell < cells ? cell : -1;
+            }
+          }
+          return -1;
+        }
+
+        bool isMarked(size_t cell) const {
+          return marks[cell / 64].load(std::memory_order_relaxed) & (1ull << (cell % 64));
+        }
+
+        // false if it was marked already
+        bool setMark(size_t cell) {
+          auto &word = marks[cell / 64];
+          auto bit = 1ull << (cell % 64);
+          if (word.load(std::memory_order_relaxed) & bit) {
+            return false;
+          }
+          return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+        }
+      };
+
+      PageHeap();
+      ~PageHeap();
+
+      // the size of the cell `size` bytes are allocated in, 0 when it's too
+      // large for a page
+      static size_t cellSize(size_t size);
+
+      // a zeroed cell, sweeping the size class' pages until one has room.
+      // The time spent sweeping is added to `stats`.
+      void *allocate(size_t size, GCStats &stats);
+
+      // the page `address` is in, if any
+      Page *find(uintptr_t address) const;
+
+      // Sweeps the pages left from the last collection and clears the marks.
+      // Cells allocated until `finishMarking` are marked as they're handed out.
+      void startMarking();
+      // counts the cells that survived into `stats`, and returns the bytes of
+      // the ones that didn't: they're freed as the pages are swept
+      size_t finishMarking(GCStats &stats);
+
+      // cells in use, garbage included until it's swept
+      size_t cells() const { return m_cells; }
+      size_t pages() const { return m_pages.size(); }
+      size_t unsweptPages() const { return m_unswept; }
+
+    private:
+      struct SizeClass {
+        std::vector<Page *> pages;
+        // the pages before it were tried since the last collection
+        size_t next = 0;
+        Page *current = nullptr;
+      };
+
+      static unsigned sizeClass(size_t size);
+      static size_t classSize(unsigned sizeClass);
+
+      Page *refill(SizeClass &sizeClass, GCStats &stats);
+      void sweep(Page *page);
+      Page *createPage(unsigned sizeClass);
+      void releasePage(Page *page);
+
+      SizeClass m_classes[SIZE_CLASSES];
+      // sorted by address, for `find`
+      std::vector<Page *> m_pages;
+      size_t m_cells = 0;
+      size_t m_unswept = 0;
+      bool m_marking = false;
+  };
+}
@@ -0,0 +1,108 @@
+#include "profiler.h"
+
+#include "closure.h"
+#include "vm.h"
+
+#include "bytecode/opcodes.h"
+
+#include <algorithm>
+#include <x86intrin.h>
+
+extern "C" void op_call_profile();
+extern "C" void op_tail_call_profile();
+extern "C" void op_ret_profile();
+
+namespace Verve {
+
+void Profiler::install() {
+  auto handlers = m_vm->m_interpreter.dispatchTable;
+  handlers[Opcode::call] = (uintptr_t)op_call_profile;
+  handlers[Opcode::tail_call] = (uintptr_t)op_tail_call_profile;
+  handlers[Opcode::ret] = (uintptr_t)op_ret_profile;
+}
+
+// builtins return without going through `ret`, only closures are tracked
+void Profiler::call(Value callee) {
+  if (callee.isClosure()) {
+    enter(callee);
+  }
+}
+
+// the current function returns as the callee is entered
+void Profiler::tailCall(Value callee) {
+  ret();
+  call(callee);
+}
+
+void Profiler::ret() {
+  if (m_stack.empty()) {
+    return;
+  }
+
+  auto activation = m_stack.back();
+  m_stack.pop_back();
+
+  auto elapsed = __rdtsc() - activation.start;
+  auto &entry = m_entries[activation.fnID];
+  entry.selfCycles += elapsed - activation.childCycles;
+
+  // recursive calls are already accounted for by the outermost activation
+  if (--entry.active == 0) {
+    entry.totalCycles += elapsed;
+  }
+
+  if (!m_stack.empty()) {
+    m_stack.back().childCycles += elapsed;
+  }
+}
+
+void Profiler::enter(Value closure) {
+  auto fnID = functionFor(closure);
+  auto &entry = m_entries[fnID];
+  entry.calls++;
+  entry.active++;
+  m_stack.push_back({ fnID, __rdtsc(), 0 });
+}
+
+unsigned Profiler::functionFor(Value closure) {
+  const auto &functions = m_vm->m_userFunctions;
+  if (m_entries.empty()) {
+    m_entries.resize(functions.size());
+    for (unsigned i = 0; i < functions.size(); i++) {
+      m_offsets[functions[i].offset] = i;
+    }
+  }
+
+  // fast closures only encode the function's offset
+  if (closure.encode() & 1) {
+    return m_offsets[(uint32_t)closure.encode() >> 1];
+  }
+  return closure.asClosure()->fn - &functions[0];
+}
+
+void Profiler::report() {
+  std::vector<unsigned> order;
+  uint64_t cycles = 0;
+  for (unsigned i = 0; i < m_entries.size(); i++) {
+    if (m_entries[i].calls) {
+      order.push_back(i);
+      cycles += m_entries[i].selfCycles;
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return m_entries[a].selfCycles > m_entries[b].selfCycles;
+  });
+
+  fprintf(m_output, "%12s %16s %8s %16s  %s\n", "calls", "self cycles", "self %", "total cycles", "function");
+  for (auto i : order) {
+    const auto &entry = m_entries[i];
+    fprintf(m_output, "%12llu %16llu %7.2f%% %16llu  %s\n",
+        (unsigned long long)entry.calls,
+        (unsigned long long)entry.selfCycles,
+        cycles ? 100.0 * entry.selfCycles / cycles : 0,
+        (unsigned long long)entry.totalCycles,
+        m_vm->m_userFunctions[i].name(m_vm).str());
+  }
+}
+
+}
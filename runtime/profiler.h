@@ -0,0 +1,53 @@
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "value.h"
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Counts calls and cycles (rdtsc) per user function. The VM swaps the
+  // `call`, `tail_call` and `ret` handlers for variants that report to the
+  // profiler before doing the actual work, so it costs nothing when disabled.
+  class Profiler {
+    public:
+      Profiler(VM *vm, FILE *output) :
+        m_vm(vm),
+        m_output(output) {}
+
+      void install();
+
+      void call(Value callee);
+      void tailCall(Value callee);
+      void ret();
+
+      void report();
+
+    private:
+      struct Entry {
+        uint64_t calls = 0;
+        uint64_t selfCycles = 0;
+        uint64_t totalCycles = 0;
+        unsigned active = 0;
+      };
+
+      struct Activation {
+        unsigned fnID;
+        uint64_t start;
+        uint64_t childCycles;
+      };
+
+      void enter(Value closure);
+      unsigned functionFor(Value closure);
+
+      VM *m_vm;
+      FILE *m_output;
+      std::vector<Entry> m_entries;
+      std::vector<Activation> m_stack;
+      std::unordered_map<unsigned, unsigned> m_offsets;
+  };
+}
@@ -0,0 +1,156 @@
+#include "sampler.h"
+
+#include "vm.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <sys/time.h>
+#include <ucontext.h>
+
+namespace Verve {
+
+namespace {
+  const size_t BUFFER_SIZE = 1 << 20;
+  const unsigned MAX_DEPTH = 128;
+
+  Sampler *activeSampler = nullptr;
+}
+
+Sampler::Sampler(VM *vm, FILE *output, unsigned interval) :
+  m_vm(vm),
+  m_output(output),
+  m_interval(interval),
+  m_buffer(BUFFER_SIZE) {}
+
+Sampler::~Sampler() {
+  if (activeSampler == this) {
+    stop();
+  }
+}
+
+void Sampler::start(void *stackTop) {
+  m_stackTop = reinterpret_cast<uintptr_t>(stackTop);
+  activeSampler = this;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &m_previous);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = m_interval / 1000000;
+  timer.it_interval.tv_usec = m_interval % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+}
+
+void Sampler::stop() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sigaction(SIGPROF, &m_previous, nullptr);
+  activeSampler = nullptr;
+}
+
+void Sampler::handler(int, siginfo_t *, void *context) {
+  auto sampler = activeSampler;
+  if (!sampler) {
+    return;
+  }
+
+  auto uc = static_cast<ucontext_t *>(context);
+#if __APPLE__
+  auto state = &uc->uc_mcontext->__ss;
+  sampler->sample(state->__r12, state->__rbp, state->__rsp);
+#else
+  auto regs = uc->uc_mcontext.gregs;
+  sampler->sample(regs[REG_R12], regs[REG_RBP], regs[REG_RSP]);
+#endif
+}
+
+void Sampler::sample(uintptr_t bytecode, uintptr_t rbp, uintptr_t rsp) {
+  if (m_used + MAX_DEPTH + 1 > m_buffer.size()) {
+    m_dropped++;
+    return;
+  }
+
+  auto start = reinterpret_cast<uintptr_t>(m_vm->bytecode());
+  auto end = start + m_vm->length;
+  auto isBytecode = [=](uintptr_t address) {
+    return address >= start && address < end;
+  };
+
+  auto sample = &m_buffer[m_used];
+  unsigned depth = 0;
+
+  // BYTECODE is only meaningful while the interpreter is running, but it's
+  // callee saved so builtins called from it keep it around as well
+  if (isBytecode(bytecode)) {
+    sample[++depth] = bytecode - start;
+  }
+
+  // every VM frame stores the caller's BYTECODE at 0x18(%rbp)
+  auto frame = rbp;
+  while (depth < MAX_DEPTH && frame >= rsp && frame + 0x20 <= m_stackTop && !(frame & 7)) {
+    auto slots = reinterpret_cast<uintptr_t *>(frame);
+    if (isBytecode(slots[3])) {
+      sample[++depth] = slots[3] - start;
+    }
+    if (slots[0] <= frame) {
+      break;
+    }
+    frame = slots[0];
+  }
+
+  if (!depth) {
+    return;
+  }
+  sample[0] = depth;
+  m_used += depth + 1;
+}
+
+void Sampler::report() {
+  auto frameName = [&](uintptr_t pc) {
+    auto fn = m_vm->functionFor(pc);
+    std::string name = fn ? fn->name(m_vm).str() : "main";
+
+    auto line = m_vm->lineFor(pc);
+    if (line && m_vm->functionFor(line->pc) == fn) {
+      name += " (";
+      name += m_vm->m_stringTable[line->file].str();
+      name += ":" + std::to_string(line->line) + ")";
+    }
+    return name;
+  };
+
+  std::map<std::string, uint64_t> stacks;
+  for (size_t i = 0; i < m_used;) {
+    auto depth = m_buffer[i];
+    // the innermost frame comes first, the folded format starts at the root
+    std::string stack = frameName(m_buffer[i + depth]);
+    for (auto j = depth - 1; j > 0; j--) {
+      stack += ";" + frameName(m_buffer[i + j]);
+    }
+    stacks[stack]++;
+    i += depth + 1;
+  }
+
+  std::vector<std::pair<std::string, uint64_t>> sorted(stacks.begin(), stacks.end());
+  std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, uint64_t> &a, const std::pair<std::string, uint64_t> &b) {
+    return a.second > b.second;
+  });
+
+  for (const auto &stack : sorted) {
+    fprintf(m_output, "%s %llu\n", stack.first.c_str(), (unsigned long long)stack.second);
+  }
+  if (m_dropped) {
+    fprintf(m_output, "# %llu samples dropped, the buffer is full\n", (unsigned long long)m_dropped);
+  }
+}
+
+}
@@ -0,0 +1,52 @@
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+  class VM;
+
+  // Statistical profiler: SIGPROF interrupts the program every `interval`
+  // microseconds of CPU time and the handler records the bytecode position
+  // of the interrupted instruction along with the return position of every
+  // VM frame it finds by walking the rbp chain. The positions are mapped
+  // back to functions and source lines only when the report is written, in
+  // the folded stacks format ("main (a.vrv:1);f (a.vrv:3) 42").
+  //
+  // Compiled code doesn't keep BYTECODE up to date, so with --jit the time
+  // spent in compiled functions is attributed to their interpreted callers.
+  class Sampler {
+    public:
+      Sampler(VM *vm, FILE *output, unsigned interval = 1000);
+      ~Sampler();
+
+      // `stackTop` is above every frame the program will run in
+      void start(void *stackTop);
+      void stop();
+
+      // when the program switches stacks, 0 while it isn't on one
+      void setStackTop(uintptr_t stackTop) { m_stackTop = stackTop; }
+
+      void report();
+
+    private:
+      static void handler(int, siginfo_t *, void *);
+      void sample(uintptr_t bytecode, uintptr_t rbp, uintptr_t rsp);
+
+      VM *m_vm;
+      FILE *m_output;
+      unsigned m_interval;
+      uintptr_t m_stackTop = 0;
+
+      // samples are stored as their depth followed by the positions of
+      // each frame, innermost first. It's preallocated so the signal
+      // handler never allocates.
+      std::vector<uintptr_t> m_buffer;
+      size_t m_used = 0;
+      uint64_t m_dropped = 0;
+
+      struct sigaction m_previous;
+  };
+}
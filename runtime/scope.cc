@@ -1,5 +1,13 @@
 #include "scope.h"
 
-Verve::Scope **Verve::Scope::s_scopePool = NULL;
-unsigned Verve::Scope::s_scopePoolIndex = 0;
-unsigned Verve::Scope::s_scopePoolSize = 0;
+namespace Verve {
+
+  ScopePool::~ScopePool() {
+    for (unsigned i = 0; i < m_index; i++) {
+      free(m_scopes[i]->table);
+      delete m_scopes[i];
+    }
+    free(m_scopes);
+  }
+
+}
@@ -1,6 +1,7 @@
 #include "verve_string.h"
 #include "value.h"
 
+#include <atomic>
 #include <cassert>
 #include <cstdlib>
 #include <functional>
@@ -10,20 +11,42 @@
 #define DEFAULT_SIZE 8
 
 namespace Verve {
+  class GC;
   class ScopeTest;
+  struct Scope;
+
+  // Scopes are recycled rather than freed, each VM keeps its own pool
+  class ScopePool {
+    public:
+      ScopePool() {}
+      ScopePool(const ScopePool &) = delete;
+      ScopePool &operator=(const ScopePool &) = delete;
+      ~ScopePool();
+
+      inline Scope *get();
+      inline void put(Scope *scope);
+
+    private:
+      Scope **m_scopes = NULL;
+      unsigned m_index = 0;
+      unsigned m_size = 0;
+  };
 
   struct Scope {
 
+    friend class GC;
     friend class ScopeTest;
 
-    Scope(unsigned size = 0) {
+    Scope(ScopePool *pool, unsigned size = 0) {
       assert(size % 2 == 0);
+      this->pool = pool;
       refCount = 1;
       length = 0;
       tableSize = 0;
       table = NULL;
       parent = NULL;
       previous = NULL;
+      markedIn = 0;
 
       if (size) {
         resize(size);
@@ -45,6 +68,8 @@ namespace Verve {
       table = (Entry *)calloc(tableSize, sizeof(Entry));
 
       if (oldTable) {
+        // counted again as they're inserted
+        length = 0;
         for (unsigned i = 0; i < oldSize; i++) {
           set(oldTable[i].key, oldTable[i].value);
         }
@@ -63,35 +88,19 @@ namespace Verve {
         if (parent) { parent->dec(); parent = NULL; }
         if (previous) { previous->dec(); previous = NULL; }
 
-        if (s_scopePoolIndex == s_scopePoolSize) {
-          s_scopePoolSize = s_scopePoolSize ? s_scopePoolSize << 1 : DEFAULT_SIZE << 1;
-          s_scopePool = (Scope **)realloc(s_scopePool, s_scopePoolSize * sizeof(Scope *));
-        }
-        s_scopePool[s_scopePoolIndex++] = this;
+        pool->put(this);
       }
     }
 
-    static inline Scope *getScope() {
-      if (s_scopePoolIndex <= 0) {
-        return new Scope();
-      }
-
-      auto s = s_scopePool[--s_scopePoolIndex];
-      s->refCount = 1;
-      s->length = 0;
-      memset(s->table, 0, s->tableSize * sizeof(Entry));
-      return s;
-    }
-
     Scope *create(Scope *p) {
-      auto s = getScope();
+      auto s = pool->get();
       s->parent = p->inc();
       s->previous = this->inc();
       return s;
     }
 
     Scope *create() {
-      auto s = getScope();
+      auto s = pool->get();
       s->parent = this->inc();
       return s;
     }
@@ -106,7 +115,7 @@ namespace Verve {
       if (tableSize) {
         unsigned index = reinterpret_cast<uintptr_t>(key.str()) & tableHash;
         auto begin = index;
-        while (table[index].key != NULL) {
+        while (table[index].key.str() != NULL) {
           if (table[index].key == key) {
             return table[index].value;
           }
@@ -125,7 +134,7 @@ namespace Verve {
       unsigned index = reinterpret_cast<uintptr_t>(key.str()) & tableHash;
       auto begin = index;
       do {
-        if (table[index].key == NULL || table[index].key == key) {
+        if (table[index].key.str() == NULL || table[index].key == key) {
           if (table[index].key != key) length++;
 
           table[index].key = key;
@@ -138,7 +147,7 @@ namespace Verve {
 
     void visit(std::function<void(Value)> visitor) {
       for (unsigned i = 0; i < tableSize; i++) {
-        if (table[i].key != 0) {
+        if (table[i].key.str() != NULL) {
           visitor(table[i].value);
         }
       }
@@ -155,13 +164,34 @@ namespace Verve {
     Scope *previous;
     unsigned tableHash;
   private:
+    friend class ScopePool;
+
+    ScopePool *pool;
     unsigned refCount;
     unsigned length;
     unsigned tableSize;
-
-    static Scope **s_scopePool;
-    static unsigned s_scopePoolIndex;
-    static unsigned s_scopePoolSize;
+    // the last collection that reached it, see GC
+    std::atomic<uint64_t> markedIn;
   };
 
+  inline Scope *ScopePool::get() {
+    if (m_index == 0) {
+      return new Scope(this);
+    }
+
+    auto s = m_scopes[--m_index];
+    s->refCount = 1;
+    s->length = 0;
+    memset(s->table, 0, s->tableSize * sizeof(Scope::Entry));
+    return s;
+  }
+
+  inline void ScopePool::put(Scope *scope) {
+    if (m_index == m_size) {
+      m_size = m_size ? m_size << 1 : DEFAULT_SIZE << 1;
+      m_scopes = (Scope **)realloc(m_scopes, m_size * sizeof(Scope *));
+    }
+    m_scopes[m_index++] = scope;
+  }
+
 }
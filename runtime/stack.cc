@@ -0,0 +1,178 @@
+#include "stack.h"
+
+#include "gc.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Verve {
+
+// SIGSEGV is handled by the thread that faulted, on a signal stack of its
+// own: the fault handler can't run on the stack that overflowed. It's set
+// up with the thread's first stack that reports faults and stays until the
+// thread exits. The stacks keep the list alive: isolates' are destroyed
+// once their worker has exited, by the thread that owns the pool.
+struct Stack::Thread {
+  std::mutex lock;
+  std::vector<Stack *> stacks;
+  // the thread's and its stacks'
+  unsigned references = 1;
+  std::vector<char> signalStack;
+  stack_t previousSignalStack;
+
+  bool installSignalStack() {
+    if (!signalStack.empty()) {
+      return true;
+    }
+    std::vector<char> memory(SIGSTKSZ > 0x10000 ? SIGSTKSZ : 0x10000);
+    stack_t signalStack;
+    signalStack.ss_sp = memory.data();
+    signalStack.ss_size = memory.size();
+    signalStack.ss_flags = 0;
+    if (sigaltstack(&signalStack, &previousSignalStack) != 0) {
+      return false;
+    }
+    this->signalStack = std::move(memory);
+    return true;
+  }
+
+  void release() {
+    bool last;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      last = --references == 0;
+    }
+    if (last) {
+      delete this;
+    }
+  }
+};
+
+namespace {
+  struct CurrentThread {
+    Stack::Thread *thread = nullptr;
+
+    ~CurrentThread() {
+      if (!thread) {
+        return;
+      }
+      if (!thread->signalStack.empty()) {
+        sigaltstack(&thread->previousSignalStack, nullptr);
+      }
+      thread->release();
+    }
+
+    Stack::Thread &get() {
+      if (!thread) {
+        thread = new Stack::Thread();
+      }
+      return *thread;
+    }
+  };
+
+  thread_local CurrentThread currentThread;
+
+  // the handler is shared by every VM, it's installed once
+  std::once_flag installHandler;
+  struct sigaction previousHandler;
+}
+
+size_t Stack::sizeFromEnvironment() {
+  auto value = getenv("VERVE_STACK_SIZE");
+  size_t size;
+  if (!value) {
+    return DEFAULT_STACK_SIZE;
+  }
+  if (!parseSize(value, &size) || size < MINIMUM_STACK_SIZE) {
+    fprintf(stderr, "Ignoring invalid value `%s` for VERVE_STACK_SIZE\n", value);
+    return DEFAULT_STACK_SIZE;
+  }
+  return size;
+}
+
+Stack::Stack(size_t size, bool reportsFaults) :
+  m_reportsFaults(reportsFaults)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size = (size + page - 1) & ~(page - 1);
+
+  // pages are only committed once the program reaches them
+  m_mappingSize = size + page;
+  auto mapping = mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Cannot allocate a stack of %zu bytes\n", size);
+    throw std::bad_alloc();
+  }
+  if (mprotect(mapping, page, PROT_NONE) != 0) {
+    fprintf(stderr, "Cannot protect the guard page of a stack: %s\n", strerror(errno));
+    munmap(mapping, m_mappingSize);
+    throw std::bad_alloc();
+  }
+
+  m_mapping = reinterpret_cast<uintptr_t>(mapping);
+  m_base = m_mapping + page;
+  m_top = m_base + size;
+
+  snprintf(m_message, sizeof(m_message), "Stack overflow: the %zu byte stack is exhausted, see --stack-size\n", size);
+  if (!reportsFaults) {
+    return;
+  }
+
+  auto &thread = currentThread.get();
+  if (!thread.installSignalStack()) {
+    fprintf(stderr, "Stack overflows won't be reported, the signal stack can't be installed: %s\n", strerror(errno));
+    m_reportsFaults = false;
+    return;
+  }
+
+  std::call_once(installHandler, [] {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = faultHandler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previousHandler);
+  });
+
+  std::lock_guard<std::mutex> guard(thread.lock);
+  thread.stacks.push_back(this);
+  thread.references++;
+  m_thread = &thread;
+}
+
+Stack::~Stack() {
+  if (m_thread) {
+    {
+      std::lock_guard<std::mutex> guard(m_thread->lock);
+      auto &stacks = m_thread->stacks;
+      stacks.erase(std::find(stacks.begin(), stacks.end(), this));
+    }
+    m_thread->release();
+  }
+  munmap(reinterpret_cast<void *>(m_mapping), m_mappingSize);
+}
+
+// the faulting instruction runs again once the handler returns, now with the
+// previous handler in place
+void Stack::faultHandler(int, siginfo_t *info, void *) {
+  auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+  if (auto thread = currentThread.thread) {
+    for (auto stack : thread->stacks) {
+      if (address >= stack->m_mapping && address < stack->m_base) {
+        write(STDERR_FILENO, stack->m_message, strlen(stack->m_message));
+        break;
+      }
+    }
+  }
+  sigaction(SIGSEGV, &previousHandler, nullptr);
+}
+
+}
@@ -0,0 +1,57 @@
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+
+  // The stack Verve code runs on: operands, frames and `stack_alloc` slots
+  // live in it, as do the frames of the builtins and of the collector that
+  // run on behalf of the program. It's mmap'd with a guard page below it.
+  // Calls fail with a "Stack overflow" error once less than `RESERVE` bytes
+  // are left, the reserve is what builtins get to run in. Native code that
+  // goes past it faults on the guard page, which is reported as well before
+  // the process dies. Fibers' stacks don't report it, the handler only
+  // knows the stacks programs started on: every VM's on the thread that
+  // faulted, created and destroyed in any order, and on any thread.
+  class Stack {
+    public:
+      // the stacks that report faults on one thread
+      struct Thread;
+
+      static const size_t DEFAULT_STACK_SIZE = 64 << 20;
+      static const size_t MINIMUM_STACK_SIZE = 1 << 20;
+      static const size_t RESERVE = 256 << 10;
+
+      // VERVE_STACK_SIZE, if set and valid, or the default
+      static size_t sizeFromEnvironment();
+
+      // the size is rounded up to whole pages
+      Stack(size_t size, bool reportsFaults = true);
+      ~Stack();
+
+      uintptr_t top() const { return m_top; }
+      uintptr_t limit() const { return m_base + RESERVE; }
+      bool contains(uintptr_t address) const { return address >= m_base && address <= m_top; }
+      size_t size() const { return m_top - m_base; }
+
+      // the error reported when it runs out, ends in a newline
+      const char *overflowMessage() const { return m_message; }
+
+    private:
+      static void faultHandler(int, siginfo_t *, void *);
+
+      uintptr_t m_mapping;
+      size_t m_mappingSize;
+      uintptr_t m_base;
+      uintptr_t m_top;
+      bool m_reportsFaults;
+      // the stacks of the thread it was created on, the one that runs it
+      Thread *m_thread = nullptr;
+
+      // formatted up front, the fault handler can only write it
+      char m_message[128];
+  };
+}
@@ -80,13 +80,14 @@ namespace Verve {
     POINTER_TYPE(Closure, Closure)
     POINTER_TYPE(Object, Object)
 
-    ALWAYS_INLINE Value(String str) {
-      value.ptr = reinterpret_cast<uintptr_t>(str.str());
+    // strings created at runtime aren't interned
+    ALWAYS_INLINE Value(const char *str) {
+      value.ptr = reinterpret_cast<uintptr_t>(str);
       value.data.tag = Value::StringTag;
     }
 
-    ALWAYS_INLINE String asString() {
-      return String(reinterpret_cast<char *>(unmask(value.ptr)));
+    ALWAYS_INLINE const char *asString() {
+      return reinterpret_cast<const char *>(unmask(value.ptr));
     }
 
 #undef POINTER_TYPE
@@ -1,8 +0,0 @@
-#include "verve_string.h"
-
-namespace Verve {
-
-unsigned String::s_size;
-String::Entry *String::s_strings;
-
-}
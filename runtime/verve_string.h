@@ -8,65 +8,138 @@
 
 namespace Verve {
 
+// An interned string: two Strings with the same contents from the same
+// StringTable share the pointer, so comparing them is comparing pointers.
 class String {
   public:
-  ALWAYS_INLINE String(const char *str) {
-    if (str) {
-      m_str = dedupe(str);
-    } else {
-      m_str = NULL;
-    }
-  }
+  // `str` must come from a StringTable (or be NULL)
+  ALWAYS_INLINE explicit String(const char *str = NULL) :
+    m_str(str) {}
 
   ALWAYS_INLINE const char *str() const {
     return m_str;
   }
-  
+
   ALWAYS_INLINE operator const char *() {
     return m_str;
   }
 
-  ALWAYS_INLINE bool operator==(String &other) {
+  ALWAYS_INLINE bool operator==(const String &other) const {
     return m_str == other.m_str;
   }
 
+  ALWAYS_INLINE bool operator!=(const String &other) const {
+    return m_str != other.m_str;
+  }
+
   private:
-    static inline unsigned hash(const char *str) {
-      unsigned long hash = 5381;
-      int c;
-      while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
-      }
-      return hash;
+  const char *m_str;
+};
+
+// Every VM interns the names it uses in its own table. The table doesn't own
+// the strings, they must outlive it.
+class StringTable {
+  public:
+  StringTable() {}
+  StringTable(const StringTable &) = delete;
+  StringTable &operator=(const StringTable &) = delete;
+
+  ~StringTable() {
+    free(m_strings);
+  }
+
+  String intern(const char *str) {
+    if (!str) {
+      return String();
+    }
+
+    if (!m_strings) {
+      m_size = s_initialSize;
+      m_strings = (Entry *)calloc(m_size, sizeof(Entry));
     }
 
-  static const char *dedupe(const char *str) {
-    if (!s_strings) {
-      s_size = s_initialSize;
-      s_strings = (Entry *)calloc(s_size, sizeof(Entry));
+    // keep the load under 3/4, so probing stays short and always ends
+    if ((m_count + 1) * 4 > m_size * 3) {
+      grow();
     }
 
-    unsigned hash = String::hash(str);
-    unsigned index = hash % s_size;
-    unsigned begin = index;
+    unsigned hash = StringTable::hash(str);
+    unsigned index = hash % m_size;
 
     Entry *e;
-    while ((e = &s_strings[index])->str != NULL) {
+    while ((e = &m_strings[index])->str != NULL) {
       if (e->hash == hash && strcmp(e->str, str) == 0) {
-        return e->str;
-      } 
-      if ((index = (index + 1) % s_size) == begin) break;
+        return String(e->str);
+      }
+      index = (index + 1) % m_size;
     }
 
-    if (e->str == NULL) {
-      e->hash = hash;
-      e->str = str;
-    } else {
-      fputs("No space for strings left :(", stderr);
-      throw;
+    e->hash = hash;
+    e->str = str;
+    m_count++;
+
+    return String(str);
+  }
+
+  // replaces the contents with `other`'s, so both intern the same names to
+  // the same pointers
+  void copy(const StringTable &other) {
+    free(m_strings);
+    m_size = other.m_size;
+    m_count = other.m_count;
+    m_strings = nullptr;
+    if (other.m_strings) {
+      m_strings = (Entry *)malloc(m_size * sizeof(Entry));
+      memcpy(m_strings, other.m_strings, m_size * sizeof(Entry));
     }
+  }
+
+  // the interned copy of `str`, or a NULL String if it was never interned
+  String find(const char *str) const {
+    if (!m_strings) {
+      return String();
+    }
+
+    unsigned hash = StringTable::hash(str);
+    unsigned index = hash % m_size;
+
+    const Entry *e;
+    while ((e = &m_strings[index])->str != NULL) {
+      if (e->hash == hash && strcmp(e->str, str) == 0) {
+        return String(e->str);
+      }
+      index = (index + 1) % m_size;
+    }
+    return String();
+  }
 
-    return str;
+  private:
+  static inline unsigned hash(const char *str) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *str++)) {
+      hash = ((hash << 5) + hash) + c;
+    }
+    return hash;
+  }
+
+  void grow() {
+    auto strings = m_strings;
+    auto size = m_size;
+
+    m_size *= 2;
+    m_strings = (Entry *)calloc(m_size, sizeof(Entry));
+    for (unsigned i = 0; i < size; i++) {
+      if (!strings[i].str) {
+        continue;
+      }
+      unsigned index = strings[i].hash % m_size;
+      while (m_strings[index].str != NULL) {
+        index = (index + 1) % m_size;
+      }
+      m_strings[index] = strings[i];
+    }
+    free(strings);
   }
 
   struct Entry {
@@ -74,9 +147,9 @@ class String {
     const char *str;
   };
   static const unsigned s_initialSize = 128;
-  static unsigned s_size;
-  static Entry *s_strings;
 
-  const char *m_str;
+  unsigned m_size = 0;
+  unsigned m_count = 0;
+  Entry *m_strings = nullptr;
 };
 }
@@ -1,22 +1,50 @@
 #include "vm.h"
 
+#include "workers.h"
 #include "bytecode/opcodes.h"
 #include "bytecode/sections.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
 
 namespace Verve {
 
-extern "C" void execute(
+static const uintptr_t handlers[] = {
+  EVAL(MAP_2(OPCODE_ADDRESS, OPCODES))
+};
+
+static_assert(offsetof(VM::Interpreter, strings) == 0x0, "interpreter.S relies on the layout of VM::Interpreter");
+static_assert(offsetof(VM::Interpreter, jitEntries) == 0x8, "interpreter.S relies on the layout of VM::Interpreter");
+static_assert(offsetof(VM::Interpreter, stackLimit) == 0x10, "interpreter.S relies on the layout of VM::Interpreter");
+static_assert(offsetof(VM::Interpreter, opStats) == 0x18, "interpreter.S relies on the layout of VM::Interpreter");
+static_assert(offsetof(VM::Interpreter, marking) == 0x20, "interpreter.S relies on the layout of VM::Interpreter");
+static_assert(offsetof(VM::Interpreter, dispatchTable) == 0x28, "interpreter.S relies on the layout of VM::Interpreter");
+
+extern "C" uint64_t execute(
     const uint8_t *bytecode,
-    String *stringTable,
     VM *vm,
     const uint8_t *bcbase,
-    void *lookupTable);
+    void *lookupTable,
+    uintptr_t stackTop);
 
 extern "C" void setScope(VM *vm, const char *name, Value value);
 void setScope(VM *vm, const char *name, Value value) {
-  vm->m_scope->set(name, value);
+  // the value it replaces may have been reachable when marking started
+  if (vm->m_interpreter.marking) {
+    vm->m_gc.markValue(vm->m_scope->get(String(name)));
+  }
+  vm->m_scope->set(String(name), value);
+}
+
+// from `obj_store_at` while a collection is marking, with the value that's
+// overwritten, see GC
+extern "C" void writeBarrier(VM *vm, uint64_t value);
+void writeBarrier(VM *vm, uint64_t value) {
+  vm->m_gc.markValue(Value::decode(value));
 }
 
 extern "C" void pushScope(VM *vm);
@@ -32,9 +60,8 @@ void restoreScope(VM *vm) {
 extern "C" uint64_t createClosure(VM *vm, unsigned fnID, bool capturesScope);
 uint64_t createClosure(VM *vm, unsigned fnID, bool capturesScope) {
   if (capturesScope) {
-    auto closure = new Closure();
+    auto closure = new (vm->allocate(sizeof(Closure))) Closure();
     closure->scope = vm->m_scope->inc();
-    vm->trackAllocation(closure, sizeof(Closure));
     closure->fn = &vm->m_userFunctions[fnID];
     return Value(closure).encode();
   } else {
@@ -63,28 +90,115 @@ void symbolNotFound(char *symbolName) {
   throw;
 }
 
+extern "C" void stackOverflow(VM *);
+void stackOverflow(VM *vm) {
+  fputs(vm->m_scheduler.stack().overflowMessage(), stderr);
+  throw;
+}
+
 extern "C" void tagTestFailed(unsigned, unsigned);
 void tagTestFailed(unsigned actual, unsigned expected) {
   fprintf(stderr, "Invalid pattern match: Object has tag `%u` but expected tag `%u`\n", actual, expected);
   throw;
 }
 
+extern "C" void matchFailed(unsigned);
+void matchFailed(unsigned tag) {
+  fprintf(stderr, "Invalid pattern match: No case matches object with tag `%u`\n", tag);
+  throw;
+}
+
+extern "C" uintptr_t jitCompile(VM *vm, unsigned fnID);
+uintptr_t jitCompile(VM *vm, unsigned fnID) {
+  return vm->m_jit->compile(fnID);
+}
+
+extern "C" void profileCall(VM *vm, uint64_t callee);
+void profileCall(VM *vm, uint64_t callee) {
+  vm->m_profiler->call(Value::decode(callee));
+}
+
+extern "C" void profileTailCall(VM *vm, uint64_t callee);
+void profileTailCall(VM *vm, uint64_t callee) {
+  vm->m_profiler->tailCall(Value::decode(callee));
+}
+
+extern "C" void profileRet(VM *vm);
+void profileRet(VM *vm) {
+  vm->m_profiler->ret();
+}
+
 extern "C" uintptr_t allocate(VM *vm, unsigned size);
 uintptr_t allocate(VM *vm, unsigned size) {
-  auto address = calloc(size, 8);
-  vm->trackAllocation(address, size);
-  return reinterpret_cast<uintptr_t>(address);
+  return reinterpret_cast<uintptr_t>(vm->allocate(size * 8));
 }
 
-  void VM::execute() {
+  VM::VM(uint8_t *bytecode, size_t len) :
+    pc(0),
+    length(len),
+    heapSize(0),
+    heapLimit(HeapPolicy().initial),
+    m_scheduler(this),
+    m_bytecode(bytecode)
+  {
+    // interpreter.S finds the interpreter's state right after m_scope
+    assert(reinterpret_cast<uintptr_t>(&m_interpreter) - reinterpret_cast<uintptr_t>(this) == sizeof(Scope *));
+    memset(&m_interpreter, 0, sizeof(m_interpreter));
+    memcpy(m_interpreter.dispatchTable, handlers, sizeof(handlers));
+
+    m_scope = m_globalScope = new Scope(&m_scopePool, 32);
+    m_gc.setScopePool(&m_scopePool);
+    registerBuiltins(*this);
+  }
+
+  VM::~VM() {
+    for (const auto &handle : m_channels) {
+      handle.second->release();
+    }
+  }
+
+  void VM::load() {
     auto header = read<uint64_t>();
     assert(header == Section::Header);
 
     loadStrings();
     loadFunctions();
+    loadLines();
     loadText();
   }
 
+  void VM::execute() {
+    Phases::Timer loading(Phases::Loading);
+    load();
+    loading.stop();
+
+    if (m_stack) {
+      if (m_sampler) {
+        m_sampler->start(reinterpret_cast<void *>(m_stack->top()));
+      }
+      Phases::Timer execution(Phases::Execution);
+      ::Verve::execute(m_bytecode + m_text, this, m_bytecode, m_lookupTable.data(), m_stack->top());
+      m_scheduler.finish();
+      execution.stop();
+      if (m_sampler) {
+        m_sampler->stop();
+      }
+    }
+
+    if (m_profiler) {
+      m_profiler->report();
+    }
+    if (m_sampler) {
+      m_sampler->report();
+    }
+    if (m_opStats) {
+      m_opStats->report();
+    }
+    if (m_gcStatsOutput) {
+      gcStats.report(m_gcStatsOutput, heapSize, heapLimit);
+    }
+  }
+
   inline void VM::loadStrings() {
     auto header = read<uint64_t>();
     if (header != Section::Strings) {
@@ -114,30 +228,50 @@ uintptr_t allocate(VM *vm, unsigned size) {
       return;
     }
 
-    auto initialHeader = read<uint64_t>();
-    assert(initialHeader == Section::FunctionHeader);
-
     while (true) {
-      auto fnid = read<uint64_t>();
-      auto nargs = read<uint64_t>();
+      auto header = read<uint64_t>();
+      if (header == Section::Header) {
+        return;
+      }
+      assert(header == Section::FunctionHeader);
+
+      auto fnid = read<uint32_t>();
+      auto nargs = read<uint32_t>();
 
       std::vector<String> args;
       for (unsigned i = 0; i < nargs; i++) {
-        auto argID = read<uint64_t>();
+        auto argID = read<uint32_t>();
         args.push_back(m_stringTable[argID]);
       }
-      m_userFunctions.push_back(Function(fnid, nargs, pc, std::move(args)));
-
-      linkBytecode();
-      while (true) {
-        auto opcode = read<uint64_t>();
-        if (opcode == Section::Header) {
-          return;
-        } else if (opcode == Section::FunctionHeader) {
-          break;
-        }
+      auto size = read<uint32_t>();
+      m_userFunctions.push_back(Function(fnid, nargs, pc, size, std::move(args)));
+      pc += size;
+    }
+  }
+
+  inline void VM::loadLines() {
+    auto header = read<uint64_t>();
+    if (header != Section::Lines) {
+      pc -= WORD_SIZE;
+      return;
+    }
+
+    auto tableCount = read<uint64_t>();
+    for (unsigned i = 0; i < tableCount; i++) {
+      auto chunk = read<int32_t>();
+      auto entryCount = read<uint32_t>();
+      auto &lines = chunk < 0 ? m_textLines : m_lines;
+      auto base = chunk < 0 ? 0 : m_userFunctions[chunk].offset;
+      for (unsigned j = 0; j < entryCount; j++) {
+        auto offset = read<uint32_t>();
+        auto file = read<uint32_t>();
+        auto line = read<uint32_t>();
+        lines.push_back({ base + offset, file, line });
       }
     }
+
+    header = read<uint64_t>();
+    assert(header == Section::Header);
   }
 
   inline void VM::loadText()  {
@@ -148,62 +282,287 @@ uintptr_t allocate(VM *vm, unsigned size) {
     }
 
     auto lookupTableSize = read<uint64_t>();
-    void *lookupTable = calloc(lookupTableSize * WORD_SIZE, 1);
-    linkBytecode();
-    ::Verve::execute(m_bytecode + pc, &m_stringTable[0], this, m_bytecode, lookupTable);
-  }
-
-  void VM::linkBytecode() {
-    if (m_needsLinking) {
-      auto bytecode = (uint64_t *)m_bytecode;
-      for (auto i = pc; i < length; i += WORD_SIZE) {
-        auto value = bytecode[i / WORD_SIZE];
-        if (value == Section::Header || value == Section::FunctionHeader) {
-          return;
-        }
-        auto opcode = (Opcode::Type)value;
-        bytecode[i / WORD_SIZE] = Opcode::address(opcode);
-        i += Opcode::size(opcode) * WORD_SIZE;
+    m_lookupTable.assign(lookupTableSize, 0);
+    m_stack.reset(new Stack(m_stackSize));
+
+    for (auto line : m_textLines) {
+      line.pc += pc;
+      m_lines.push_back(line);
+    }
+    std::sort(m_lines.begin(), m_lines.end(), [](const Line &a, const Line &b) {
+      return a.pc < b.pc;
+    });
+
+    m_interpreter.strings = m_stringTable.data();
+    m_interpreter.stackLimit = m_stack->limit();
+    if (m_jit) {
+      // the isolates start from the code as it was before it's patched
+      if (m_parallelism > 1) {
+        m_module = std::make_shared<const std::string>(reinterpret_cast<char *>(m_bytecode), length);
       }
+      m_jit->install();
+      m_interpreter.jitEntries = m_jit->entries();
+    }
+
+    // wraps whichever handlers are installed at this point
+    if (m_opStats) {
+      m_opStats->install();
     }
+    m_text = pc;
   }
 
-  void VM::trackAllocation(void *ptr, size_t size) {
+  void VM::inherit(const VM &parent) {
+    m_strings.copy(parent.m_strings);
+    m_globalScope->parent = parent.m_globalScope;
+  }
+
+  std::shared_ptr<const std::string> VM::module() {
+    if (!m_module) {
+      m_module = std::make_shared<const std::string>(reinterpret_cast<char *>(m_bytecode), length);
+    }
+    return m_module;
+  }
+
+  WorkerPool &VM::workers() {
+    if (!m_workers) {
+      m_workers.reset(new WorkerPool(m_parallelism, this));
+      m_workers->setHeapPolicy(m_heapPolicy);
+      m_workers->setStackSize(m_stackSize);
+      if (m_jit) {
+        m_workers->enableJIT();
+      }
+    }
+    return *m_workers;
+  }
+
+  // runs `push arg, ..., push callee, call argc, exit` on the program's
+  // stack, the same code the generator emits for a call
+  Value VM::call(const char *name, const std::vector<Value> &args) {
+    auto key = m_strings.find(name);
+    auto callee = key.str() ? m_scope->get(key) : Value();
+    if (!callee.isClosure() && !callee.isBuiltin()) {
+      throw std::runtime_error(std::string("Symbol not found: ") + name);
+    }
+    return call(callee, args);
+  }
+
+  Value VM::call(Value callee, const std::vector<Value> &args) {
+    assert(m_stack && "the program must be loaded before calling into it");
+
+    std::vector<uint8_t> stub;
+    auto emit = [&stub](Opcode::Type opcode, const void *operands, size_t size) {
+      stub.push_back(opcode);
+      stub.insert(stub.end(), (const uint8_t *)operands, (const uint8_t *)operands + size);
+    };
+    for (auto it = args.rbegin(); it != args.rend(); it++) {
+      auto arg = Value(*it).encode();
+      emit(Opcode::push, &arg, sizeof(arg));
+    }
+    auto encoded = callee.encode();
+    emit(Opcode::push, &encoded, sizeof(encoded));
+    uint32_t argc = args.size();
+    emit(Opcode::call, &argc, sizeof(argc));
+    emit(Opcode::exit, nullptr, 0);
+
+    // called from a builtin or a fiber, the stub runs below the caller
+    auto &stack = m_scheduler.stack();
+    uintptr_t top = stack.top();
+    uintptr_t rsp;
+    asm("movq %%rsp, %0" : "=r"(rsp));
+    if (stack.contains(rsp)) {
+      top = (rsp - 0x100) & ~0xF;
+    }
+
+    return Value::decode(::Verve::execute(stub.data(), this, m_bytecode, m_lookupTable.data(), top));
+  }
+
+  const VM::Line *VM::lineFor(unsigned pc) const {
+    auto it = std::upper_bound(m_lines.begin(), m_lines.end(), pc, [](unsigned pc, const Line &line) {
+      return pc < line.pc;
+    });
+    return it == m_lines.begin() ? nullptr : &*(it - 1);
+  }
+
+  // functions are laid out in order, anything past them is the text
+  const Function *VM::functionFor(unsigned pc) const {
+    auto it = std::upper_bound(m_userFunctions.begin(), m_userFunctions.end(), pc, [](unsigned pc, const Function &fn) {
+      return pc < fn.offset;
+    });
+    if (it == m_userFunctions.begin() || pc >= (it - 1)->offset + (it - 1)->size) {
+      return nullptr;
+    }
+    return &*(it - 1);
+  }
+
+  // collects before whatever is being allocated is part of the heap
+  inline void VM::countAllocation(size_t size) {
     heapSize += size;
+    if (Phases::enabled) {
+      Phases::countAllocation(size);
+    }
+
+    if (m_gc.phase() != GC::Phase::Idle ? heapSize >= m_nextStep : heapSize > heapLimit) {
+      collectStep();
+    }
+  }
 
-    if (heapSize > heapLimit) {
-      collect();
-      heapLimit = std::max(heapLimit, 2 * heapSize);
+  void *VM::allocate(size_t size) {
+    auto cellSize = PageHeap::cellSize(size);
+    if (!cellSize) {
+      auto block = calloc(size, 1);
+      trackAllocation(block, size);
+      return block;
     }
+    countAllocation(cellSize);
+    return m_pages.allocate(size, gcStats);
+  }
 
+  void VM::trackAllocation(void *ptr, size_t size) {
+    countAllocation(size);
     blocks.push_back(std::make_pair(size, ptr));
   }
 
+  void VM::adopt(const Heap &allocations) {
+    blocks.insert(blocks.end(), allocations.begin(), allocations.end());
+    for (const auto &allocation : allocations) {
+      heapSize += allocation.first;
+      // the copy's reference to the channel is now the handle's
+      if (auto channel = Channel::fromCopy(allocation)) {
+        m_channels.push_back({ allocation.second, channel });
+      }
+    }
+
+    if (m_gc.phase() != GC::Phase::Idle ? heapSize >= m_nextStep : heapSize > heapLimit) {
+      collectStep();
+    }
+  }
+
+  void VM::resizeHeap(size_t before) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    auto gcTimeShare = elapsed ? (double)(gcStats.markNanos + gcStats.sweepNanos) / elapsed : 0;
+
+    auto limit = m_heapPolicy.limitAfterCollection(before, heapSize, heapLimit, gcTimeShare);
+    if (m_heapPolicy.maximum && heapSize > m_heapPolicy.maximum) {
+      fprintf(stderr, "Out of memory: %zu bytes are still in use after collecting, the maximum heap size is %zu\n", heapSize, m_heapPolicy.maximum);
+      throw;
+    }
+
+    if (limit != heapLimit) {
+      gcStats.recordLimit(heapSize, heapLimit, limit);
+      heapLimit = limit;
+    }
+  }
+
   void VM::collect() {
-    GC::start();
+    if (m_gc.phase() != GC::Phase::Idle) {
+      runCollection(GC::Deadline::max());
+    }
+    runCollection(GC::Deadline::max());
+  }
 
-    volatile void **rsp;
-    asm("movq %%rsp, %0" : "=r"(rsp));
+  void VM::collectStep() {
+    auto deadline = GC::Deadline::max();
+    // the program allocates faster than the steps collect: catch up
+    if (m_heapPolicy.pauseMicros && heapSize < 2 * heapLimit) {
+      deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(m_heapPolicy.pauseMicros);
+    }
+    runCollection(deadline);
+
+    // steps are spread over a sixteenth of the heap's limit
+    m_nextStep = heapSize + std::max<size_t>(heapLimit / 16, 4096);
+  }
+
+  // starts a collection or takes it a step further, it's over once it's
+  // been swept
+  void VM::runCollection(GC::Deadline deadline) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (m_gc.phase() == GC::Phase::Idle) {
+      m_collectionStart = heapSize;
+      m_gc.start(blocks, &m_pages);
+      markRoots();
+      m_interpreter.marking = 1;
+    }
+
+    if (m_gc.phase() == GC::Phase::Marking && m_gc.step(deadline)) {
+      m_gc.finish();
+      m_gc.dropUnmarkedBuffers();
+      dropUnreachableHandles();
+      m_interpreter.marking = 0;
+      // the pages are swept later, as they're allocated from
+      heapSize -= m_pages.finishMarking(gcStats);
+    }
+    auto marked = std::chrono::steady_clock::now();
+
+    if (m_gc.phase() == GC::Phase::Sweeping && m_gc.sweep(blocks, &heapSize, gcStats, deadline)) {
+      gcStats.collections++;
+      resizeHeap(m_collectionStart);
+    }
+    auto swept = std::chrono::steady_clock::now();
+
+    gcStats.recordPause(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(marked - start).count(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(swept - marked).count());
+  }
+
+  // the channels and files whose handles are about to be swept
+  void VM::dropUnreachableHandles() {
+    auto live = m_channels.begin();
+    for (const auto &handle : m_channels) {
+      if (m_gc.isLive(handle.first)) {
+        *live++ = handle;
+      } else {
+        handle.second->release();
+      }
+    }
+    m_channels.erase(live, m_channels.end());
+
+    auto file = m_files.begin();
+    for (auto &handle : m_files) {
+      if (m_gc.isLive(handle.first) || handle.second->pending) {
+        *file++ = std::move(handle);
+      }
+    }
+    m_files.erase(file, m_files.end());
+  }
+
+  void VM::markRoots() {
+    auto markStack = [this](uintptr_t begin, uintptr_t end) {
+      auto slot = reinterpret_cast<volatile uintptr_t *>(begin);
+      auto top = reinterpret_cast<volatile uintptr_t *>(end);
+      while (slot != top) {
+        m_gc.markValue(Value::decode(*slot));
+        slot++;
+      }
+    };
+
+    // the program's values are on its own stack, along with the frames of
+    // the builtin that triggered the collection, and on its fibers' stacks
+    // (unless it's the embedder allocating, off the VM's stack)
+    if (m_stack) {
+      uintptr_t rsp;
+      asm("movq %%rsp, %0" : "=r"(rsp));
+      if (m_scheduler.stack().contains(rsp)) {
+        markStack(rsp, m_scheduler.stack().top());
+      }
+      m_gc.markValue(m_scheduler.current().closure);
+
+      m_scheduler.visitSuspended([&](const Fiber &fiber, uintptr_t begin, uintptr_t end) {
+        markStack(begin, end);
+        m_gc.markValue(fiber.closure);
+        m_gc.markScope(fiber.scope);
+      });
+    }
+
+    // and the lines files are read into, see LineReader
+    for (auto &handle : m_files) {
+      if (handle.second->reader.buffer()) {
+        m_gc.markValue(Value(handle.second->reader.buffer()));
+      }
+    }
+    m_gc.markValue(m_stdin);
 
-    pthread_t self = pthread_self();
-#if __APPLE__
-    void *stackBottom = pthread_get_stackaddr_np(self);
-#else
-    pthread_attr_t attr;
-    pthread_getattr_np(self, &attr);
-    void *stackBottom;
-    size_t stackSize;
-    pthread_attr_getstack(&attr, &stackBottom, &stackSize);
-    stackBottom = (char *)stackBottom + stackSize;
-#endif
-    while (rsp != stackBottom) {
-      GC::markValue(Value::decode((uintptr_t)*rsp), blocks);
-      rsp++;
-    }
-
-    GC::markScope(m_scope, blocks);
-
-    GC::sweep(blocks, &heapSize);
+    m_gc.markScope(m_scope);
   }
 
 }
@@ -1,40 +1,124 @@
 #include "builtins.h"
+#include "channels.h"
 #include "verve_string.h"
 #include "closure.h"
+#include "fibers.h"
 #include "gc.h"
 #include "function.h"
+#include "io.h"
+#include "jit.h"
+#include "opstats.h"
+#include "profiler.h"
+#include "sampler.h"
 #include "scope.h"
+#include "stack.h"
 #include "value.h"
 
+#include "utils/phases.h"
+
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
 #pragma once
 
 namespace Verve {
 
+  class WorkerPool;
+
+  // Everything a running program uses belongs to its VM: the heap, the
+  // interned names, the scopes and the interpreter's state, so VMs can run
+  // side by side, each on its own thread.
   class VM {
     public:
-      VM(uint8_t *bytecode, size_t len, bool needsLinking = false):
-        m_scope(new Scope(32)),
-        pc(0),
-        length(len),
-        heapSize(0),
-        heapLimit(10240),
-        m_needsLinking(needsLinking),
-        m_bytecode(bytecode)
-      {
-        registerBuiltins(*this);
+      VM(uint8_t *bytecode, size_t len);
+      ~VM();
+
+      void enableJIT() {
+        m_jit.reset(new JIT(this, m_bytecode));
+      }
+
+      void enableProfiler(FILE *output = stderr) {
+        m_profiler.reset(new Profiler(this, output));
+        m_profiler->install();
+      }
+
+      void enableOpStats(FILE *output = stderr) {
+        m_opStats.reset(new OpStats(this, output));
+      }
+
+      void setHeapPolicy(const HeapPolicy &policy) {
+        m_heapPolicy = policy;
+        heapLimit = policy.initial;
+        m_gc.setThreads(policy.gcThreads);
+      }
+
+      void enableGCStats(FILE *output = stderr) {
+        m_gcStatsOutput = output;
+      }
+
+      void setStackSize(size_t size) {
+        m_stackSize = size;
+      }
+
+      // threads `parallel_map` may use, 1 runs it on the VM's own thread
+      void setParallelism(unsigned threads) {
+        m_parallelism = threads;
+      }
+
+      unsigned parallelism() const {
+        return m_parallelism;
+      }
+
+      void enableSampler(FILE *output) {
+        m_sampler.reset(new Sampler(this, output));
       }
 
       void execute();
-      void linkBytecode();
+      // everything but running the text
+      void load();
+
+      // calls a function defined at the top level of the program, which
+      // must have been executed already. The result lives in this VM's heap,
+      // it's only safe to use until the VM runs again
+      Value call(const char *name, const std::vector<Value> &args);
+      // also works from a builtin, below the frames of the running program
+      Value call(Value callee, const std::vector<Value> &args);
+
+      // Makes the globals of `parent`, a VM running the same program, visible
+      // to this one, which is meant to be loaded but never executed: it
+      // shares the parent's names and looks up what isn't bound in its own
+      // scopes in the parent's global scope. `parent` must outlive it and
+      // can't run while this VM does.
+      void inherit(const VM &parent);
+
+      // the isolates `parallel_map` runs on, created on first use
+      WorkerPool &workers();
+      // a copy of the program's bytecode as it was loaded, for the isolates
+      std::shared_ptr<const std::string> module();
+
       inline void loadStrings();
       inline void loadFunctions();
+      inline void loadLines();
       inline void loadText();
+      // `size` zeroed bytes in the heap, a cell of a page unless it's
+      // larger than any: it may collect before returning
+      void *allocate(size_t size);
+      // a block allocated with malloc, the heap frees it
       void trackAllocation(void *, size_t);
+      // takes ownership of blocks allocated off the heap, which must be
+      // reachable from the program by the time the next allocation happens
+      void adopt(const Heap &allocations);
+      // a whole collection, finishing the one in progress first
       void collect();
+      // as much of a collection as HeapPolicy::pauseMicros allows
+      void collectStep();
+      void resizeHeap(size_t before);
 
       template<typename T>
       inline T read() {
@@ -46,22 +130,94 @@ namespace Verve {
       String readStr() {
         char *v = (char *)(m_bytecode + pc);
         pc += strlen(v) + 1;
-        return String(v);
+        return m_strings.intern(v);
       }
 
       Scope *m_scope; // first thing, easy to access from asm
 
+      // read by the interpreter through the VM register, its layout is known
+      // by interpreter.S
+      struct Interpreter {
+        const String *strings;
+        uintptr_t *jitEntries;
+        // calls fail below it
+        uintptr_t stackLimit;
+        OpStats::Counters *opStats;
+        // set while a collection is marking, stores report to the GC
+        uintptr_t marking;
+        uintptr_t dispatchTable[256];
+      } m_interpreter;
+
       unsigned pc;
       size_t length;
       size_t heapSize;
       size_t heapLimit;
       std::vector<std::pair<size_t, void *>> blocks;
+      PageHeap m_pages;
+      GCStats gcStats;
 
-      bool m_needsLinking;
       std::vector<String> m_stringTable;
       std::vector<Function> m_userFunctions;
+      StringTable m_strings;
+      ScopePool m_scopePool;
+      // where the builtins and the program's top level are bound
+      Scope *m_globalScope;
+      GC m_gc;
+      Scheduler m_scheduler;
+      // the channel handles in the heap, each holding a reference to its
+      // channel until it's swept, see channelValue
+      std::vector<std::pair<const void *, Channel *>> m_channels;
+      // and the file handles, which own their files, see fileValue
+      std::vector<std::pair<const void *, std::unique_ptr<File>>> m_files;
+      // the handle `stdin` returns every time, its reader may have read ahead
+      Value m_stdin;
+      // destroyed before the fibers, its threads may write to their stacks
+      EventLoop m_events;
+
+      std::unique_ptr<JIT> m_jit;
+      std::unique_ptr<Profiler> m_profiler;
+      std::unique_ptr<Sampler> m_sampler;
+      std::unique_ptr<OpStats> m_opStats;
+      FILE *m_gcStatsOutput = nullptr;
+
+      // the program runs on it, it's created when the text is loaded
+      std::unique_ptr<Stack> m_stack;
+
+      // source location of the instructions starting at `pc`, sorted by pc
+      struct Line {
+        unsigned pc;
+        unsigned file;
+        unsigned line;
+      };
+      std::vector<Line> m_lines;
+      const Line *lineFor(unsigned pc) const;
+      const Function *functionFor(unsigned pc) const;
+
+      uint8_t *bytecode() const { return m_bytecode; }
 
     private:
+      inline void countAllocation(size_t size);
+      void runCollection(GC::Deadline deadline);
+      void markRoots();
+      void dropUnreachableHandles();
+
+      HeapPolicy m_heapPolicy;
+      // the heap's size when the collection in progress started
+      size_t m_collectionStart = 0;
+      size_t m_nextStep = 0;
+      size_t m_stackSize = Stack::DEFAULT_STACK_SIZE;
+      unsigned m_parallelism = std::max(1u, std::thread::hardware_concurrency());
+      std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
       uint8_t *m_bytecode;
+      // cached lookups, one slot per `lookup` instruction in the program
+      std::vector<uintptr_t> m_lookupTable;
+      // where the text starts, once it's loaded
+      unsigned m_text = 0;
+
+      std::shared_ptr<const std::string> m_module;
+      // destroyed first, the isolates look into this VM
+      std::unique_ptr<WorkerPool> m_workers;
+      // the text's offsets are only known once its section is reached
+      std::vector<Line> m_textLines;
   };
 }
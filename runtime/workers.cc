@@ -0,0 +1,247 @@
+#include "workers.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace Verve {
+
+WorkerPool::WorkerPool(unsigned workers, const VM *parent) :
+  m_parent(parent)
+{
+  for (unsigned i = 0; i < workers; i++) {
+    m_workers.emplace_back(new Worker());
+  }
+  // every worker exists before any of them looks for jobs to steal
+  for (unsigned i = 0; i < workers; i++) {
+    m_workers[i]->thread = std::thread(&WorkerPool::run, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+  for (auto &worker : m_workers) {
+    worker->thread.join();
+  }
+}
+
+void WorkerPool::submit(Job job) {
+  unsigned next;
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_queued++;
+    m_pending++;
+    next = m_next++;
+  }
+
+  auto &worker = *m_workers[next % m_workers.size()];
+  {
+    std::lock_guard<std::mutex> lock(worker.lock);
+    worker.jobs.push_back(std::move(job));
+  }
+  m_wake.notify_one();
+}
+
+void WorkerPool::wait() {
+  std::unique_lock<std::mutex> lock(m_lock);
+  m_idle.wait(lock, [this] { return m_pending == 0; });
+
+  if (m_error) {
+    auto error = m_error;
+    m_error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+bool WorkerPool::take(unsigned index, Job &job) {
+  for (unsigned i = 0; i < m_workers.size(); i++) {
+    auto &worker = *m_workers[(index + i) % m_workers.size()];
+    std::lock_guard<std::mutex> lock(worker.lock);
+    if (worker.jobs.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      job = std::move(worker.jobs.back());
+      worker.jobs.pop_back();
+    } else {
+      job = std::move(worker.jobs.front());
+      worker.jobs.pop_front();
+    }
+    return true;
+  }
+  return false;
+}
+
+void WorkerPool::run(unsigned index) {
+  auto &worker = *m_workers[index];
+
+  while (true) {
+    Job job;
+    if (!take(index, job)) {
+      std::unique_lock<std::mutex> lock(m_lock);
+      m_wake.wait(lock, [this] { return m_stopping || m_queued > 0; });
+      if (m_queued == 0) {
+        return;
+      }
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      m_queued--;
+    }
+
+    std::exception_ptr error;
+    try {
+      auto &vm = isolate(worker, job.bytecode);
+      if (job.task) {
+        job.task(vm);
+      } else {
+        auto result = vm.call(job.function.c_str(), job.args);
+        if (job.done) {
+          job.done(result);
+        }
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (error && !m_error) {
+      m_error = error;
+    }
+    if (--m_pending == 0) {
+      m_idle.notify_all();
+    }
+  }
+}
+
+VM &WorkerPool::isolate(Worker &worker, const std::shared_ptr<const std::string> &bytecode) {
+  auto &isolate = worker.isolates[bytecode.get()];
+  if (isolate.vm) {
+    return *isolate.vm;
+  }
+
+  // holding on to the bytecode also keeps its address from being reused by
+  // another module while the isolate exists
+  isolate.bytecode = bytecode;
+  auto data = reinterpret_cast<uint8_t *>(const_cast<char *>(bytecode->data()));
+  if (m_jit) {
+    isolate.copy = *bytecode;
+    data = reinterpret_cast<uint8_t *>(&isolate.copy[0]);
+  }
+
+  isolate.vm.reset(new VM(data, bytecode->size()));
+  // the pool's threads keep the cores busy already, isolates mark alone
+  auto heapPolicy = m_heapPolicy;
+  heapPolicy.gcThreads = 1;
+  isolate.vm->setHeapPolicy(heapPolicy);
+  isolate.vm->setStackSize(m_stackSize);
+  isolate.vm->setParallelism(1);
+  if (m_jit) {
+    isolate.vm->enableJIT();
+  }
+  if (m_parent) {
+    isolate.vm->inherit(*m_parent);
+    isolate.vm->load();
+  } else {
+    isolate.vm->execute();
+  }
+  return *isolate.vm;
+}
+
+namespace {
+  // closures with a scope can only run in the VM they were created in
+  bool isShareable(Value value) {
+    if (value.isClosure()) {
+      return value.encode() & 1;
+    } else if (value.isList()) {
+      for (unsigned i = 0; i < value.asList()->length; i++) {
+        if (!isShareable(value.asList()->at(i))) {
+          return false;
+        }
+      }
+    } else if (value.isObject()) {
+      // only the VM that opened a file uses it
+      if (File::isHandle(value.asObject())) {
+        return false;
+      }
+      for (unsigned i = 0; i < value.asObject()->size; i++) {
+        if (!isShareable(value.asObject()->at(i))) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  Value mapSequentially(VM &vm, Value list, Value fn) {
+    auto length = list.asList()->length;
+    auto result = (uint64_t *)vm.allocate((length + 1) * 8);
+    result[0] = length;
+
+    // on the stack, where collections find it
+    volatile uint64_t root = Value((List *)result).encode();
+    for (unsigned i = 0; i < length; i++) {
+      result[i + 1] = vm.call(fn, { list.asList()->at(i) }).encode();
+    }
+    return Value::decode(root);
+  }
+}
+
+Value parallelMap(VM &vm, Value list, Value fn) {
+  auto length = list.asList()->length;
+  if (vm.parallelism() < 2 || length < 2 || !isShareable(fn) || !isShareable(list)) {
+    return mapSequentially(vm, list, fn);
+  }
+
+  auto &pool = vm.workers();
+  auto module = vm.module();
+
+  // a few chunks per thread, so the threads that finish early steal some
+  unsigned chunks = std::min<size_t>(length, pool.size() * 4);
+  std::vector<Heap> allocations(chunks);
+  std::vector<uint64_t> results(length);
+  for (unsigned chunk = 0; chunk < chunks; chunk++) {
+    size_t begin = length * chunk / chunks;
+    size_t end = length * (chunk + 1) / chunks;
+
+    Job job;
+    job.bytecode = module;
+    job.task = [&, chunk, begin, end](VM &isolate) {
+      for (auto i = begin; i < end; i++) {
+        auto value = isolate.call(fn, { list.asList()->at(i) });
+        results[i] = copyValue(value, allocations[chunk]).encode();
+      }
+    };
+    pool.submit(std::move(job));
+  }
+
+  try {
+    pool.wait();
+  } catch (const std::runtime_error &error) {
+    for (const auto &heap : allocations) {
+      freeCopy(heap);
+    }
+    fprintf(stderr, "parallel_map: %s\n", error.what());
+    throw;
+  }
+
+  // the copies aren't part of the heap yet, a collection here leaves them be
+  auto result = (uint64_t *)vm.allocate((length + 1) * 8);
+  result[0] = length;
+  memcpy(result + 1, results.data(), length * 8);
+
+  volatile uint64_t root = Value((List *)result).encode();
+  for (const auto &heap : allocations) {
+    vm.adopt(heap);
+  }
+  return Value::decode(root);
+}
+
+}
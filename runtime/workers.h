@@ -0,0 +1,105 @@
+#include "vm.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+namespace Verve {
+
+  // Calls `function` with `args` in a VM running `bytecode`. `done` gets the
+  // result on the worker's thread, before its VM runs anything else: heap
+  // values in the result are only valid until `done` returns. String
+  // arguments aren't copied, they must outlive the job. A job with a `task`
+  // runs it with the VM instead.
+  struct Job {
+    std::shared_ptr<const std::string> bytecode;
+    std::string function;
+    std::vector<Value> args;
+    std::function<void(Value)> done;
+    std::function<void(VM &)> task;
+  };
+
+  // Runs jobs on a pool of threads. Every thread keeps an isolate per module
+  // it has run: a VM with its own heap, scopes and stack, created the first
+  // time the module is needed, which runs the module's top level once. The
+  // bytecode is shared by the isolates, which only read it (with the JIT
+  // enabled every isolate patches its own copy). Isolates run `parallel_map`
+  // on their own thread.
+  //
+  // A pool with a `parent` VM runs its program's functions for it: the
+  // isolates inherit the parent's globals instead of running the top level
+  // (see VM::inherit), and the parent must not run while they do.
+  //
+  // Jobs are dealt to the threads' queues in turns. Threads run the most
+  // recent job in their own queue and, once it's empty, steal the oldest one
+  // from another thread's queue, so slow jobs don't hold up the rest.
+  class WorkerPool {
+    public:
+      WorkerPool(unsigned workers, const VM *parent = nullptr);
+      // runs the jobs left before returning
+      ~WorkerPool();
+
+      // the isolates' options, set them before submitting jobs
+      void enableJIT() { m_jit = true; }
+      void setHeapPolicy(const HeapPolicy &policy) { m_heapPolicy = policy; }
+      void setStackSize(size_t size) { m_stackSize = size; }
+
+      void submit(Job job);
+
+      // blocks until every job submitted so far is done, rethrows the first
+      // error a job raised since the last call
+      void wait();
+
+      unsigned size() const { return m_workers.size(); }
+
+    private:
+      struct Isolate {
+        std::shared_ptr<const std::string> bytecode;
+        std::string copy;
+        std::unique_ptr<VM> vm;
+      };
+
+      struct Worker {
+        std::mutex lock;
+        std::deque<Job> jobs;
+        std::map<const std::string *, Isolate> isolates;
+        std::thread thread;
+      };
+
+      void run(unsigned index);
+      bool take(unsigned index, Job &job);
+      VM &isolate(Worker &worker, const std::shared_ptr<const std::string> &bytecode);
+
+      std::vector<std::unique_ptr<Worker>> m_workers;
+
+      // guards everything below but the options, idle threads wait on it
+      std::mutex m_lock;
+      std::condition_variable m_wake;
+      std::condition_variable m_idle;
+      unsigned m_next = 0;
+      unsigned m_queued = 0;
+      unsigned m_pending = 0;
+      bool m_stopping = false;
+      std::exception_ptr m_error;
+
+      const VM *m_parent;
+      bool m_jit = false;
+      HeapPolicy m_heapPolicy;
+      size_t m_stackSize = Stack::DEFAULT_STACK_SIZE;
+  };
+
+  // `parallel_map`: calls `fn` with every element of `list` on `vm`'s
+  // isolates, in chunks, and copies the results into a new list in `vm`'s
+  // heap. It runs on `vm` itself when `fn` or the elements capture scopes,
+  // which only `vm` can use.
+  Value parallelMap(VM &vm, Value list, Value fn);
+}
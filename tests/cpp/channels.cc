@@ -0,0 +1,201 @@
+#include "runtime/channels.h"
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+namespace Verve {
+
+class ChannelsTest {
+  public:
+
+  static const char *source() {
+    return
+      "fn produce(c: channel<list<int>>, from: int, n: int) -> int {\n"
+      "  if n == 0 0 else {\n"
+      "    send(c, [from, from * 2])\n"
+      "    produce(c, from + 1, n - 1)\n"
+      "  }\n"
+      "}\n"
+      "fn consume(c: channel<list<int>>, n: int, total: int) -> int {\n"
+      "  if n == 0 total else {\n"
+      "    let l = recv(c) {\n"
+      "      consume(c, n - 1, total + head(l) + head(tail(l)))\n"
+      "    }\n"
+      "  }\n"
+      "}\n"
+      "fn fill(c: channel<int>) -> int {\n"
+      "  send(c, 1)\n"
+      "  1\n"
+      "}\n"
+      "fn fill_all(cs: list<channel<int>>) -> list<int> { parallel_map(cs, fill) }\n";
+  }
+
+  static std::unique_ptr<VM> createVM(const std::string &bc) {
+    std::unique_ptr<VM> vm(new VM((uint8_t *)bc.data(), bc.size()));
+    // every message received is adopted, collections happen all along
+    HeapPolicy policy;
+    policy.initial = 1024;
+    vm->setHeapPolicy(policy);
+    vm->execute();
+    return vm;
+  }
+
+  // producers and consumers on their own threads, each in a VM of its own
+  static void testAcrossThreads() {
+    auto bc = Test::compile(source());
+    // the test's own reference, the VMs' handles have theirs
+    auto channel = new SharedChannel(8);
+    channel->retain();
+
+    const unsigned pairs = 2;
+    const int messages = 2000;
+    std::vector<std::unique_ptr<VM>> vms;
+    for (unsigned i = 0; i < 2 * pairs; i++) {
+      vms.push_back(createVM(bc));
+    }
+
+    std::vector<int> totals(pairs);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < pairs; i++) {
+      auto &producer = *vms[2 * i];
+      auto &consumer = *vms[2 * i + 1];
+      threads.emplace_back([&, i] {
+        producer.call("produce", { channelValue(producer, channel), (int)i * messages, messages });
+      });
+      threads.emplace_back([&, i] {
+        totals[i] = consumer.call("consume", { channelValue(consumer, channel), messages, 0 }).asInt();
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    // every message was received once, whoever received it
+    int expected = 0;
+    for (int n = 0; n < (int)pairs * messages; n++) {
+      expected += 3 * n;
+    }
+    assert(totals[0] + totals[1] == expected);
+    for (unsigned i = 1; i < vms.size(); i += 2) {
+      assert(vms[i]->gcStats.collections > 0);
+    }
+
+    Value value;
+    assert(!channel->receive(*vms[0], value));
+    channel->release();
+  }
+
+  static void testCapacity() {
+    auto bc = Test::compile(source());
+    auto vm = createVM(bc);
+
+    // rounded up to a power of two
+    SharedChannel channel(3);
+    for (int i = 0; i < 4; i++) {
+      assert(channel.send(*vm, Value(i)));
+    }
+    assert(!channel.send(*vm, Value(4)));
+
+    Value value;
+    assert(channel.receive(*vm, value) && value.asInt() == 0);
+    assert(channel.send(*vm, Value(4)));
+    for (int i = 1; i < 5; i++) {
+      assert(channel.receive(*vm, value) && value.asInt() == i);
+    }
+    assert(!channel.receive(*vm, value));
+
+    // pending messages are freed along with the channel
+    char message[] = "pending";
+    assert(channel.send(*vm, Value(message)));
+  }
+
+  // isolates send to the channel they get as an argument
+  static void testIsolates() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    vm.setParallelism(4);
+    vm.execute();
+
+    auto channel = new SharedChannel(16);
+    auto handle = channelValue(vm, channel);
+    auto list = (uint64_t *)calloc(11, 8);
+    list[0] = 10;
+    for (unsigned i = 1; i <= 10; i++) {
+      list[i] = handle.encode();
+    }
+    vm.trackAllocation(list, 11 * 8);
+
+    auto results = vm.call("fill_all", { Value((List *)list) }).asList();
+    assert(results->length == 10);
+
+    Value value;
+    for (unsigned i = 0; i < 10; i++) {
+      assert(channel->receive(vm, value) && value.asInt() == 1);
+    }
+    assert(!channel->receive(vm, value));
+  }
+
+  struct CountedChannel : LocalChannel {
+    static unsigned deleted;
+
+    CountedChannel(VM *vm) : LocalChannel(vm, 1) {}
+    ~CountedChannel() { deleted++; }
+  };
+
+  // a channel lives as long as its handle, and keeps what it holds alive
+  static void testLifetime() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    HeapPolicy policy;
+    policy.initial = 1 << 30;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+    auto before = vm.m_channels.size();
+
+    auto kept = new CountedChannel(&vm);
+    vm.m_scope->set(vm.m_strings.intern("kept"), channelValue(vm, kept));
+    auto list = (uint64_t *)vm.allocate(16);
+    list[0] = 1;
+    list[1] = Value(42).encode();
+    assert(kept->send(vm, Value((List *)list)));
+
+    for (unsigned i = 0; i < 100; i++) {
+      auto channel = new CountedChannel(&vm);
+      channelValue(vm, channel);
+      auto garbage = (uint64_t *)vm.allocate(16);
+      assert(channel->send(vm, Value((List *)garbage)));
+    }
+    assert(vm.m_channels.size() == before + 101);
+
+    vm.collect();
+    assert(CountedChannel::deleted == 100);
+    assert(vm.m_channels.size() == before + 1);
+    assert(vm.gcStats.objectsFreed == 200);
+
+    for (unsigned i = 0; i < 1000; i++) {
+      memset(vm.allocate(16), 7, 16);
+    }
+    Value value;
+    assert(kept->receive(vm, value));
+    assert(value.asList()->length == 1 && value.asList()->at(0).asInt() == 42);
+  }
+
+  static void test() {
+    testAcrossThreads();
+    testCapacity();
+    testIsolates();
+    testLifetime();
+  }
+};
+
+unsigned ChannelsTest::CountedChannel::deleted = 0;
+
+}
+
+int main() {
+  Verve::ChannelsTest::test();
+  return 0;
+}
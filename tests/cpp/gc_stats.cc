@@ -0,0 +1,61 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+
+namespace Verve {
+
+class GCStatsTest {
+  public:
+
+  static GCStats run(const char *source) {
+    Test::Program program(source);
+    program.vm.execute();
+    return program.vm.gcStats;
+  }
+
+  static void testGarbage() {
+    auto stats = run(
+        "fn build(n: int, acc: list<int>) -> list<int> {\n"
+        "  if n == 0 acc else build(n - 1, [n, n, n, n])\n"
+        "}\n"
+        "build(5000, [])\n");
+
+    assert(stats.collections > 0);
+    assert(stats.objectsFreed > 0);
+    assert(stats.bytesFreed > stats.bytesMarked);
+
+    uint64_t pauses = 0;
+    for (auto count : stats.pauses) {
+      pauses += count;
+    }
+    assert(pauses == stats.collections);
+  }
+
+  static void testGrowth() {
+    // every list is kept alive by a frame until the recursion unwinds
+    auto stats = run(
+        "fn keep(n: int, l: list<int>) -> int {\n"
+        "  if n == 0 0 else keep(n - 1, [n, n, n, n]) + 1\n"
+        "}\n"
+        "keep(3000, [])\n");
+
+    assert(stats.limitChanges.size() > 0);
+    for (const auto &change : stats.limitChanges) {
+      assert(change.newLimit > change.oldLimit);
+      assert(change.collection <= stats.collections);
+    }
+  }
+
+  static void test() {
+    testGarbage();
+    testGrowth();
+  }
+};
+
+}
+
+int main() {
+  Verve::GCStatsTest::test();
+  return 0;
+}
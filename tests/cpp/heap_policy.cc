@@ -0,0 +1,58 @@
+#include "runtime/gc.h"
+
+#include <cassert>
+
+namespace Verve {
+
+class HeapPolicyTest {
+  public:
+
+  static void testOptions() {
+    HeapPolicy policy;
+    assert(policy.set("--heap-initial", "4k") && policy.initial == 4096);
+    assert(policy.set("--heap-max", "2M") && policy.maximum == 2 << 20);
+    assert(policy.set("--heap-growth", "1.5") && policy.growth == 1.5);
+    assert(policy.set("--gc-target", "5") && policy.gcTimePercent == 5);
+    assert(policy.set("--gc-threads", "2") && policy.gcThreads == 2);
+    assert(policy.set("--gc-pause", "500") && policy.pauseMicros == 500);
+
+    assert(!policy.set("--heap-initial", "lots"));
+    assert(!policy.set("--heap-growth", "1"));
+    assert(!policy.set("--gc-target", "100"));
+    assert(!policy.set("--gc-threads", "-1"));
+    assert(!policy.set("--gc-pause", "1ms"));
+    assert(!policy.set("--heap-size", "1k"));
+  }
+
+  static void testLimits() {
+    HeapPolicy policy;
+    policy.initial = 1000;
+
+    // little survives: stay at the initial size
+    assert(policy.limitAfterCollection(2000, 100, 1000, 0) == 1000);
+    // grow to about twice what survived
+    assert(policy.limitAfterCollection(10000, 1000, 1000, 0) == 1000 + 1111);
+    // most of it survives: leave a lot more room
+    assert(policy.limitAfterCollection(2000, 1800, 1000, 0) == 1800 + 18000);
+
+    // collections take too long: double the limit
+    policy.gcTimePercent = 10;
+    assert(policy.limitAfterCollection(2000, 100, 1000, 0.05) == 1000);
+    assert(policy.limitAfterCollection(2000, 100, 1000, 0.5) == 2000);
+
+    policy.maximum = 1500;
+    assert(policy.limitAfterCollection(2000, 100, 1000, 0.5) == 1500);
+  }
+
+  static void test() {
+    testOptions();
+    testLimits();
+  }
+};
+
+}
+
+int main() {
+  Verve::HeapPolicyTest::test();
+  return 0;
+}
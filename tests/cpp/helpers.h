@@ -0,0 +1,57 @@
+#include "bytecode/generator.h"
+#include "parser/lexer.h"
+#include "parser/parser.h"
+#include "runtime/vm.h"
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#pragma once
+
+namespace Verve {
+namespace Test {
+
+  // The bytecode of `source`, read as the file `filename` in `dirname`.
+  // ROOT_DIR and the type checker's names are process wide, tests that run
+  // VMs on several threads compile their programs up front.
+  inline std::string compile(const char *source, const char *filename = "test.vrv", const std::string &dirname = ".") {
+    ROOT_DIR = ".";
+    Lexer lexer(filename, source);
+    Parser parser(lexer, dirname);
+    auto ast = parser.parse();
+
+    std::stringstream bytecode;
+    Generator::generate(ast, &bytecode);
+    return bytecode.str();
+  }
+
+  // a VM loaded with `source`, it runs the bytecode kept alongside it
+  struct Program {
+    explicit Program(const char *source, const char *filename = "test.vrv", const std::string &dirname = ".") :
+      bytecode(compile(source, filename, dirname)),
+      vm(reinterpret_cast<uint8_t *>(&bytecode[0]), bytecode.size()) {}
+
+    std::string bytecode;
+    VM vm;
+  };
+
+  // what `write` wrote to the temporary file it's given
+  template<typename F>
+  std::string capture(F write) {
+    auto output = tmpfile();
+    write(output);
+
+    std::string written;
+    char buffer[4096];
+    size_t size;
+    rewind(output);
+    while ((size = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+      written.append(buffer, size);
+    }
+    fclose(output);
+    return written;
+  }
+
+}
+}
@@ -0,0 +1,127 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace Verve {
+
+class IncrementalGCTest {
+  public:
+
+  static char *string(Heap &heap, const char *value) {
+    auto copy = strdup(value);
+    heap.push_back({ strlen(value) + 1, copy });
+    return copy;
+  }
+
+  static bool contains(const Heap &heap, void *block) {
+    for (const auto &entry : heap) {
+      if (entry.second == block) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // a value only the list referred to when marking started, moved out of
+  // it before the tracing got there
+  static void testBarrier() {
+    Heap heap;
+    auto moved = string(heap, "moved");
+    auto dropped = string(heap, "dropped");
+
+    const unsigned length = 2000;
+    auto list = (uint64_t *)calloc(length + 1, 8);
+    list[0] = length;
+    list[1] = Value(moved).encode();
+    for (unsigned i = 2; i <= length; i++) {
+      list[i] = Value(string(heap, "filler")).encode();
+    }
+    heap.push_back({ (length + 1) * 8, list });
+
+    GC gc;
+    gc.setThreads(1);
+    gc.start(heap);
+    gc.markValue(Value((List *)list));
+    assert(!gc.step(std::chrono::steady_clock::now()));
+
+    // the program stores over it, `moved` now lives off the heap
+    gc.markValue(Value::decode(list[1]));
+    list[1] = 0;
+
+    // allocated while marking, nothing refers to it either
+    auto fresh = string(heap, "fresh");
+
+    assert(gc.step(GC::Deadline::max()));
+    gc.finish();
+    size_t heapSize = 0;
+    for (const auto &entry : heap) {
+      heapSize += entry.first;
+    }
+    GCStats stats;
+    assert(gc.sweep(heap, &heapSize, stats));
+
+    assert(contains(heap, moved));
+    assert(contains(heap, fresh));
+    assert(!contains(heap, dropped));
+    assert(stats.objectsFreed == 1);
+    for (const auto &entry : heap) {
+      free(entry.second);
+    }
+  }
+
+  static GCStats run(const std::string &bc, unsigned pauseMicros, int n) {
+    VM vm((uint8_t *)bc.data(), bc.size());
+    HeapPolicy policy;
+    policy.initial = 1024;
+    policy.pauseMicros = pauseMicros;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+
+    auto result = vm.call("start", { n }).asInt();
+    assert(result == n * (n + 1) / 2 - 1 + 2 * n);
+    return vm.gcStats;
+  }
+
+  // the program runs between the steps, binding values and dropping them
+  // as the recursion unwinds, the lists are read after the collections.
+  // The garbage in between makes them frequent.
+  static void testSteps() {
+    auto bc = Test::compile(
+        "fn keep(n: int, l: list<list<int>>) -> int {\n"
+        "  if n == 0 0 else {\n"
+        "    let m = [[n], [n + 1]] {\n"
+        "      let garbage = length([n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n]) - 16 {\n"
+        "        keep(n - 1 + garbage, m) + head(head(l)) + length(l)\n"
+        "      }\n"
+        "    }\n"
+        "  }\n"
+        "}\n"
+        "fn start(n: int) -> int { keep(n, [[0], [0]]) }\n");
+
+    auto whole = run(bc, 0, 20000);
+    auto stepped = run(bc, 1, 20000);
+
+    uint64_t wholePauses = 0, steppedPauses = 0;
+    for (unsigned i = 0; i < GCStats::PAUSE_BUCKETS; i++) {
+      wholePauses += whole.pauses[i];
+      steppedPauses += stepped.pauses[i];
+    }
+    assert(wholePauses == whole.collections);
+    assert(stepped.collections > 3);
+    assert(steppedPauses > stepped.collections);
+  }
+
+  static void test() {
+    testBarrier();
+    testSteps();
+  }
+};
+
+}
+
+int main() {
+  Verve::IncrementalGCTest::test();
+  return 0;
+}
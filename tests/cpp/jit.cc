@@ -0,0 +1,77 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace Verve {
+
+class JITTest {
+  public:
+
+  // the permissions /proc/self/maps lists for the mapping `address` is in
+  static std::string permissions(uintptr_t address) {
+    auto maps = fopen("/proc/self/maps", "r");
+    assert(maps);
+    char line[512];
+    std::string found;
+    while (fgets(line, sizeof(line), maps)) {
+      unsigned long begin, end;
+      char perms[5];
+      if (sscanf(line, "%lx-%lx %4s", &begin, &end, perms) == 3 && address >= begin && address < end) {
+        found = perms;
+        break;
+      }
+    }
+    fclose(maps);
+    return found;
+  }
+
+  // W^X: the native code is never writable once it runs, including the
+  // functions compiled into a chunk after it
+  static void testCodeIsNotWritable() {
+    Test::Program program(
+      "fn double(n: int) -> int { n + n }\n"
+      "fn triple(n: int) -> int { n + n + n }\n"
+      "print(double(2))\n");
+    auto &vm = program.vm;
+    vm.enableJIT();
+    vm.execute();
+    assert(vm.call("triple", { Value(2) }).asInt() == 6);
+
+    unsigned compiled = 0;
+    for (unsigned i = 0; i < vm.m_userFunctions.size(); i++) {
+      if (auto entry = vm.m_jit->entries()[i]) {
+        assert(permissions(entry) == "r-xp");
+        compiled++;
+      }
+    }
+    assert(compiled >= 2);
+  }
+
+  // `ret` is compiled to a jump to its handler unless --opstats counts it
+  static void testOpStatsCountReturns() {
+    Test::Program program(
+      "fn add(a: int, b: int) -> int { a + b }\n"
+      "add(1, add(2, 3))\n");
+    auto report = Test::capture([&](FILE *output) {
+      program.vm.enableJIT();
+      program.vm.enableOpStats(output);
+      program.vm.execute();
+    });
+    assert(report.find("op\tret\t2\n") != std::string::npos);
+  }
+
+  static void test() {
+    testCodeIsNotWritable();
+    testOpStatsCountReturns();
+  }
+};
+
+}
+
+int main() {
+  Verve::JITTest::test();
+  return 0;
+}
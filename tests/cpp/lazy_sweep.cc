@@ -0,0 +1,93 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+
+namespace Verve {
+
+class LazySweepTest {
+  public:
+
+  static void testSizeClasses() {
+    assert(PageHeap::cellSize(0) == 16);
+    assert(PageHeap::cellSize(16) == 16);
+    assert(PageHeap::cellSize(17) == 32);
+    assert(PageHeap::cellSize(128) == 128);
+    assert(PageHeap::cellSize(129) == 160);
+    assert(PageHeap::cellSize(257) == 320);
+    assert(PageHeap::cellSize(PageHeap::MAX_CELL_SIZE) == PageHeap::MAX_CELL_SIZE);
+    assert(PageHeap::cellSize(PageHeap::MAX_CELL_SIZE + 1) == 0);
+
+    for (size_t size = 1; size <= PageHeap::MAX_CELL_SIZE; size++) {
+      auto cellSize = PageHeap::cellSize(size);
+      assert(cellSize >= size && cellSize % 16 == 0);
+      assert(cellSize - size < 16 || cellSize - size < size / 4);
+    }
+  }
+
+  // one-element lists, every other one kept by a global list
+  static void testSweepOnAllocation() {
+    Test::Program program("1\n");
+    auto &vm = program.vm;
+    // nothing collects but the test
+    HeapPolicy policy;
+    policy.initial = 1 << 30;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+
+    const unsigned cells = 2 * PageHeap::PAGE_SIZE / 16;
+    auto kept = (uint64_t *)vm.allocate((cells / 2 + 1) * 8);
+    kept[0] = cells / 2;
+    vm.m_scope->set(vm.m_strings.intern("kept"), Value((List *)kept));
+    for (unsigned i = 0; i < cells; i++) {
+      auto cell = (uint64_t *)vm.allocate(16);
+      cell[0] = 1;
+      cell[1] = i;
+      if (i % 2 == 0) {
+        kept[i / 2 + 1] = Value((List *)cell).encode();
+      }
+    }
+    for (unsigned i = 0; i < 100; i++) {
+      vm.allocate(100);
+    }
+    assert(vm.m_pages.pages() == 3);
+
+    // the collection doesn't sweep the pages, it only counts what survived
+    vm.collect();
+    assert(vm.m_pages.unsweptPages() == 3);
+    assert(vm.gcStats.objectsFreed == cells / 2 + 100);
+    assert(vm.heapSize == (cells / 2) * 16 + (cells / 2 + 1) * 8);
+
+    // filling the first page's free cells only sweeps that page
+    for (unsigned i = 0; i < cells / 4; i++) {
+      auto cell = (uint64_t *)vm.allocate(16);
+      assert(cell[0] == 0 && cell[1] == 0);
+    }
+    assert(vm.m_pages.unsweptPages() == 2);
+    assert(vm.m_pages.pages() == 3);
+    vm.allocate(16);
+    assert(vm.m_pages.unsweptPages() == 1);
+
+    for (unsigned i = 0; i < cells / 2; i++) {
+      auto list = Value::decode(kept[i + 1]).asList();
+      assert(list->length == 1 && list->at(0).asInt() == (int)(2 * i));
+    }
+
+    // the page nothing allocated from since is swept when the next
+    // collection starts, and given back, it's empty
+    vm.collect();
+    assert(vm.m_pages.pages() == 2);
+  }
+
+  static void test() {
+    testSizeClasses();
+    testSweepOnAllocation();
+  }
+};
+
+}
+
+int main() {
+  Verve::LazySweepTest::test();
+  return 0;
+}
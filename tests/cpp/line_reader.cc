@@ -0,0 +1,164 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace Verve {
+
+class LineReaderTest {
+  public:
+
+  static std::string writeLines(const std::vector<std::string> &lines, bool trailingNewline) {
+    char path[] = "/tmp/verve_line_reader_XXXXXX";
+    auto fd = mkstemp(path);
+    auto stream = fdopen(fd, "w");
+    for (unsigned i = 0; i < lines.size(); i++) {
+      fputs(lines[i].c_str(), stream);
+      if (i + 1 < lines.size() || trailingNewline) {
+        fputc('\n', stream);
+      }
+    }
+    fclose(stream);
+    return path;
+  }
+
+  static void testLines() {
+    // lines that straddle buffers, and one longer than a buffer
+    std::vector<std::string> lines;
+    for (unsigned i = 0; i < 30000; i++) {
+      lines.push_back(std::string(i % 97, 'a' + i % 26));
+    }
+    lines.push_back(std::string(LineReader::BUFFER_SIZE * 5 / 2, 'x'));
+    lines.push_back("");
+    lines.push_back("last, without a newline");
+    auto path = writeLines(lines, false);
+
+    Test::Program program("1\n");
+    auto &vm = program.vm;
+    vm.execute();
+
+    auto file = new File();
+    file->stream = fopen(path.c_str(), "r");
+    vm.m_scope->set(vm.m_strings.intern("file"), fileValue(vm, file));
+
+    auto &reader = file->reader;
+    std::vector<const char *> read;
+    unsigned refills = 0;
+    while (!reader.atEnd()) {
+      if (auto line = reader.next()) {
+        read.push_back(line);
+        continue;
+      }
+      assert(reader.refill(fileno(file->stream)));
+      reader.adopt(vm);
+      refills++;
+    }
+
+    // lines from earlier buffers are left untouched
+    assert(read.size() == lines.size());
+    for (unsigned i = 0; i < lines.size(); i++) {
+      assert(read[i] == lines[i]);
+    }
+    assert(refills > 3);
+    unlink(path.c_str());
+  }
+
+  static void testStreaming() {
+    // the kept line is in the middle of the second buffer: the line at the
+    // start of a buffer shares its address, which may be left on the stack
+    std::vector<std::string> lines;
+    for (unsigned i = 0; i < 300000; i++) {
+      lines.push_back("a line of a large input, read and dropped " + std::to_string(i));
+    }
+    lines.insert(lines.begin() + 30000, std::string(500, 'k'));
+    auto path = writeLines(lines, true);
+
+    Test::Program program(
+        "fn drop(f: file, n: int) -> int {\n"
+        "  if n == 0 0 else {\n"
+        "    read_line(f)\n"
+        "    drop(f, n - 1)\n"
+        "  }\n"
+        "}\n"
+        "fn skip(f: file, n: int) -> int {\n"
+        "  let line = read_line(f) {\n"
+        "    if length(line) == 0 n else skip(f, n + 1)\n"
+        "  }\n"
+        "}\n"
+        "fn check(path: string) -> list<int> {\n"
+        "  let f = open(path, \"r\") {\n"
+        "    drop(f, 30000)\n"
+        "    let kept = head(read_line(f)) {\n"
+        "      let n = skip(f, 30001) {\n"
+        "        close(f)\n"
+        "        [count(kept), n]\n"
+        "      }\n"
+        "    }\n"
+        "  }\n"
+        "}\n");
+    auto &vm = program.vm;
+    // fails if the buffers pile up, the input is several times larger
+    HeapPolicy policy;
+    policy.initial = 1024;
+    policy.maximum = 4 * LineReader::BUFFER_SIZE;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+
+    char argument[256];
+    strcpy(argument, path.c_str());
+    auto result = vm.call("check", { Value(argument) }).asList();
+    assert(result->at(0).asInt() == (int)lines[30000].size());
+    assert(result->at(1).asInt() == (int)lines.size());
+
+    // the buffers of the lines that were dropped were collected along the
+    // way, the second one was kept while the line was in use
+    assert(vm.gcStats.collections > 3);
+    unlink(path.c_str());
+  }
+
+  // the files whose handles were swept are deleted, closed or not
+  static void testDroppedFiles() {
+    auto path = writeLines({ "one", "two" }, true);
+    Test::Program program(
+        "fn use(f: file, n: int) -> int {\n"
+        "  if n % 2 == 0 {\n"
+        "    close(f)\n"
+        "    0\n"
+        "  } else length(read_line(f))\n"
+        "}\n"
+        "fn churn(path: string, n: int) -> int {\n"
+        "  if n == 0 0 else {\n"
+        "    use(open(path, \"r\"), n)\n"
+        "    churn(path, n - 1)\n"
+        "  }\n"
+        "}\n");
+    auto &vm = program.vm;
+    HeapPolicy policy;
+    policy.initial = 1 << 30;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+
+    char argument[256];
+    strcpy(argument, path.c_str());
+    vm.call("churn", { Value(argument), 1000 });
+    assert(vm.m_files.size() == 1000);
+
+    vm.collect();
+    assert(vm.m_files.empty());
+    unlink(path.c_str());
+  }
+
+  static void test() {
+    testLines();
+    testStreaming();
+    testDroppedFiles();
+  }
+};
+
+}
+
+int main() {
+  Verve::LineReaderTest::test();
+  return 0;
+}
@@ -0,0 +1,54 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+namespace Verve {
+
+class ModulesTest {
+  public:
+
+  static void write(const std::string &path, const char *source) {
+    auto file = fopen(path.c_str(), "w");
+    assert(file);
+    fputs(source, file);
+    fclose(file);
+  }
+
+  static int run(const std::string &dirname) {
+    auto path = dirname + "/main.vrv";
+    Test::Program program("import { answer } from \"answer\"\nanswer()\n", path.c_str(), dirname);
+    program.vm.execute();
+    return program.vm.call("answer", {}).asInt();
+  }
+
+  // each compilation reads the modules it imports, a module parsed for an
+  // earlier program isn't reused
+  static void testCompilationsDontShareModules() {
+    char dirname[] = "/tmp/verve_modules_XXXXXX";
+    assert(mkdtemp(dirname));
+    auto module = std::string(dirname) + "/answer.vrv";
+
+    write(module, "fn answer() -> int { 1 }\n");
+    assert(run(dirname) == 1);
+    write(module, "fn answer() -> int { 2 }\n");
+    assert(run(dirname) == 2);
+
+    unlink(module.c_str());
+    rmdir(dirname);
+  }
+
+  static void test() {
+    testCompilationsDontShareModules();
+  }
+};
+
+}
+
+int main() {
+  Verve::ModulesTest::test();
+  return 0;
+}
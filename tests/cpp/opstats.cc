@@ -0,0 +1,64 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace Verve {
+
+class OpStatsTest {
+  public:
+
+  static std::string stats(const char *source) {
+    Test::Program program(source);
+    return Test::capture([&](FILE *output) {
+      program.vm.enableOpStats(output);
+      program.vm.execute();
+    });
+  }
+
+  // the count at the end of the row whose fields start with `key`
+  static unsigned long long count(const std::string &report, const std::string &key) {
+    std::stringstream lines(report);
+    std::string line;
+    while (std::getline(lines, line)) {
+      auto tab = line.rfind('\t');
+      if (line.compare(0, tab, key) == 0) {
+        return std::stoull(line.substr(tab + 1));
+      }
+    }
+    return 0;
+  }
+
+  static void testCounts() {
+    const char *count0 =
+        "fn count(n: int) -> int { if n == 0 0 else count(n - 1) }\n"
+        "count(0)\n";
+    const char *count100 =
+        "fn count(n: int) -> int { if n == 0 0 else count(n - 1) }\n"
+        "count(100)\n";
+    auto base = stats(count0);
+    auto report = stats(count100);
+
+    // each extra iteration makes one tail call and pushes `n` twice
+    assert(count(report, "op\ttail_call") - count(base, "op\ttail_call") == 100);
+    assert(count(report, "op\tpush_arg") - count(base, "op\tpush_arg") == 200);
+    assert(count(report, "pair\tlookup\ttail_call") - count(base, "pair\tlookup\ttail_call") == 100);
+    // `==` and `-` are only looked up from the scope the first time, but
+    // `count` has no cache slot
+    assert(count(report, "lookup\thit") - count(base, "lookup\thit") == 199);
+    assert(count(report, "lookup\tmiss") - count(base, "lookup\tmiss") == 101);
+  }
+
+  static void test() {
+    testCounts();
+  }
+};
+
+}
+
+int main() {
+  Verve::OpStatsTest::test();
+  return 0;
+}
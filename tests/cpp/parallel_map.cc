@@ -0,0 +1,114 @@
+#include "runtime/workers.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace Verve {
+
+class ParallelMapTest {
+  public:
+
+  static int fib(int n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+  }
+
+  static const char *source() {
+    return
+      "type pair {\n"
+      "  Pair(string, int)\n"
+      "}\n"
+      "fn fib(n: int) -> int {\n"
+      "  if n < 2 n else fib(n - 1) + fib(n - 2)\n"
+      "}\n"
+      "fn build(n: int, acc: string) -> string {\n"
+      "  if n == 0 acc else build(n - 1, concat_string(acc, int_to_string(n % 10)))\n"
+      "}\n"
+      "fn describe(n: int) -> pair {\n"
+      "  Pair(build(n, \"\"), fib(n % 20))\n"
+      "}\n"
+      "fn range(n: int) -> list<int> {\n"
+      "  [n, n + 1, n + 2, n + 3, n + 4, n + 5, n + 6, n + 7, n + 8, n + 9]\n"
+      "}\n"
+      "fn scale(l: list<int>, k: int) -> list<int> {\n"
+      "  fn times(x: int) -> int { x * k }\n"
+      "  parallel_map(l, times)\n"
+      "}\n"
+      "fn fibs() -> list<int> { parallel_map(range(10), fib) }\n"
+      "fn pairs() -> list<pair> { parallel_map(range(100), describe) }\n"
+      "fn ranges() -> list<list<int>> { parallel_map(range(0), range) }\n"
+      "fn scaled() -> list<int> { scale(range(0), 3) }\n"
+      "fn strings() -> list<string> { parallel_map(range(0), int_to_string) }\n";
+  }
+
+  static void testParallelMap() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    vm.setParallelism(4);
+    vm.execute();
+
+    auto fibs = vm.call("fibs", {}).asList();
+    assert(fibs->length == 10);
+    assert(fibs->at(0).asInt() == 55);
+    assert(fibs->at(9).asInt() == 4181);
+
+    // builtins can be mapped too
+    auto strings = vm.call("strings", {}).asList();
+    assert(strcmp(strings->at(7).asString(), "7") == 0);
+
+    // nested lists are copied back
+    auto ranges = vm.call("ranges", {}).asList();
+    assert(ranges->at(3).asList()->at(9).asInt() == 12);
+
+    // closures that capture variables run on the VM itself
+    auto scaled = vm.call("scaled", {}).asList();
+    assert(scaled->at(9).asInt() == 27);
+  }
+
+  static void testResultsSurviveCollections() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    HeapPolicy policy;
+    policy.initial = 1024;
+    vm.setHeapPolicy(policy);
+    vm.setParallelism(4);
+    vm.execute();
+
+    auto before = vm.gcStats.collections;
+    for (unsigned round = 0; round < 5; round++) {
+      auto pairs = vm.call("pairs", {}).asList();
+      assert(pairs->length == 10);
+      for (unsigned i = 0; i < pairs->length; i++) {
+        auto n = 100 + i;
+        auto pair = pairs->at(i).asObject();
+        assert(strlen(pair->at(0).asString()) == n);
+        assert(pair->at(1).asInt() == fib(n % 20));
+      }
+    }
+    // adopting the copies counts towards the heap
+    assert(vm.gcStats.collections > before);
+  }
+
+  static void testSequential() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    vm.setParallelism(1);
+    vm.execute();
+
+    auto fibs = vm.call("fibs", {}).asList();
+    assert(fibs->at(9).asInt() == 4181);
+  }
+
+  static void test() {
+    testParallelMap();
+    testResultsSurviveCollections();
+    testSequential();
+  }
+};
+
+}
+
+int main() {
+  Verve::ParallelMapTest::test();
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+
+namespace Verve {
+
+class ParallelMarkTest {
+  public:
+
+  // every list passed down is kept alive by a frame until the recursion
+  // unwinds, the later collections see a heap past GC::PARALLEL_THRESHOLD.
+  // The garbage in between makes them frequent.
+  static GCStats run(const std::string &bc, unsigned threads, int n) {
+    VM vm((uint8_t *)bc.data(), bc.size());
+    HeapPolicy policy;
+    policy.growth = 1.2;
+    policy.gcThreads = threads;
+    vm.setHeapPolicy(policy);
+    vm.execute();
+
+    // the lists are read once the calls return, after the collections
+    auto result = vm.call("start", { n }).asInt();
+    assert(result == (long long)n * (n + 1) / 2 - 1 + 3 * n);
+    return vm.gcStats;
+  }
+
+  static void testMarks() {
+    auto bc = Test::compile(
+        "fn keep(n: int, l: list<list<int>>) -> int {\n"
+        "  if n == 0 0 else {\n"
+        "    let garbage = length([n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n]) - 16 {\n"
+        "      keep(n - 1 + garbage, [[n], [n], [n]]) + head(head(l)) + length(l)\n"
+        "    }\n"
+        "  }\n"
+        "}\n"
+        "fn start(n: int) -> int { keep(n, [[0], [0], [0]]) }\n");
+
+    const int n = 40000;
+    auto alone = run(bc, 1, n);
+    auto parallel = run(bc, 4, n);
+
+    // the same blocks are found whichever thread traces them
+    assert(alone.collections > 10);
+    assert(parallel.collections == alone.collections);
+    assert(parallel.objectsMarked == alone.objectsMarked);
+    assert(parallel.bytesMarked == alone.bytesMarked);
+    assert(parallel.objectsFreed == alone.objectsFreed);
+  }
+
+  // an isolate's collection stops at its parent's globals, marking them
+  // would make the parent's next collection take them as marked already
+  static void testInheritedScopes() {
+    auto bc = Test::compile("fn id(n: int) -> int { n }\n");
+    VM parent((uint8_t *)bc.data(), bc.size());
+    parent.execute();
+    auto kept = (uint64_t *)parent.allocate(2 * 8);
+    kept[0] = 1;
+    kept[1] = 42;
+    parent.m_globalScope->set(parent.m_strings.intern("kept"), Value((List *)kept));
+
+    VM isolate((uint8_t *)bc.data(), bc.size());
+    isolate.inherit(parent);
+    isolate.load();
+    isolate.collect();
+
+    parent.collect();
+    assert(parent.gcStats.objectsFreed == 0);
+    for (unsigned i = 0; i < 1000; i++) {
+      auto garbage = (uint64_t *)parent.allocate(2 * 8);
+      garbage[0] = garbage[1] = 7;
+    }
+    assert(kept[0] == 1 && kept[1] == 42);
+  }
+
+  static void test() {
+    testMarks();
+    testInheritedScopes();
+  }
+};
+
+}
+
+int main() {
+  Verve::ParallelMarkTest::test();
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+#include "utils/phases.h"
+
+#include <cassert>
+#include <thread>
+
+namespace Verve {
+
+class PhasesTest {
+  public:
+
+  static void run(const char *source) {
+    Test::Program program(source);
+    program.vm.execute();
+  }
+
+  static void testDisabled() {
+    Phases::enable();
+    Phases::enabled = false;
+    run("1 + 1\n");
+    for (unsigned i = 0; i < Phases::Count; i++) {
+      assert(Phases::stats(static_cast<Phases::Phase>(i)).entries == 0);
+    }
+  }
+
+  static void testPhases() {
+    Phases::enable();
+    run(
+        "interface sized<t> {\n"
+        "  virtual size(t) -> int\n"
+        "}\n"
+        "implementation sized<string> {\n"
+        "  fn size(s) { count(s) }\n"
+        "}\n"
+        "fn twice(x: sized) -> int { size(x) * 2 }\n"
+        "twice(to_string(123))\n");
+    Phases::enabled = false;
+
+    // every phase ran
+    for (unsigned i = 0; i < Phases::Count; i++) {
+      assert(Phases::stats(static_cast<Phases::Phase>(i)).entries > 0);
+    }
+    // the program and the prelude, which is imported once
+    assert(Phases::stats(Phases::Parsing).entries == 2);
+    assert(Phases::stats(Phases::Imports).entries == 1);
+    assert(Phases::stats(Phases::TypeChecking).entries == 2);
+    assert(Phases::stats(Phases::Instantiation).entries == 1);
+
+    // importing the prelude parses and checks it
+    const auto &imports = Phases::stats(Phases::Imports);
+    const auto &parsing = Phases::stats(Phases::Parsing);
+    assert(imports.totalNanos > imports.selfNanos);
+    assert(parsing.totalNanos > imports.totalNanos);
+
+    // the front end allocates its trees, the program allocates a string
+    assert(Phases::stats(Phases::Parsing).allocations > 0);
+    assert(Phases::stats(Phases::Generation).allocations > 0);
+    assert(Phases::stats(Phases::Execution).allocations > 0);
+  }
+
+  // isolates and helper threads run while the main thread is in a phase
+  static void testOtherThreads() {
+    Phases::enable();
+    {
+      Phases::Timer timer(Phases::Execution);
+      std::thread thread([] {
+        Phases::Timer timer(Phases::Parsing);
+        Phases::allocated(16);
+      });
+      thread.join();
+      Phases::allocated(16);
+    }
+    Phases::enabled = false;
+
+    assert(Phases::stats(Phases::Parsing).entries == 0);
+    assert(Phases::stats(Phases::Parsing).allocations == 0);
+    assert(Phases::stats(Phases::Execution).entries == 1);
+    // the thread's own
+    assert(Phases::stats(Phases::Execution).allocations == 1);
+  }
+
+  static void test() {
+    testPhases();
+    testDisabled();
+    testOtherThreads();
+  }
+};
+
+}
+
+int main() {
+  Verve::PhasesTest::test();
+  return 0;
+}
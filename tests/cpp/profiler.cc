@@ -0,0 +1,60 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace Verve {
+
+class ProfilerTest {
+  public:
+
+  static std::string profile(const char *source) {
+    Test::Program program(source);
+    return Test::capture([&](FILE *output) {
+      program.vm.enableProfiler(output);
+      program.vm.execute();
+    });
+  }
+
+  static unsigned long long calls(const std::string &report, const char *fn) {
+    std::stringstream lines(report);
+    std::string line;
+    while (std::getline(lines, line)) {
+      char name[128];
+      unsigned long long calls, self, total;
+      float percent;
+      if (sscanf(line.c_str(), "%llu %llu %f%% %llu %127s", &calls, &self, &percent, &total, name) == 5 &&
+          strcmp(name, fn) == 0) {
+        return calls;
+      }
+    }
+    return 0;
+  }
+
+  static void testCallCounts() {
+    auto report = profile(
+        "fn fib(n: int) -> int { if (n < 2) n else fib(n - 1) + fib(n - 2) }\n"
+        "fn count(n: int) -> int { if n == 0 0 else count(n - 1) }\n"
+        "fib(10)\n"
+        "count(100)\n");
+
+    assert(calls(report, "fib") == 177);
+    // tail calls are counted as calls too
+    assert(calls(report, "count") == 101);
+    // builtins aren't reported
+    assert(calls(report, "+") == 0);
+  }
+
+  static void test() {
+    testCallCounts();
+  }
+};
+
+}
+
+int main() {
+  Verve::ProfilerTest::test();
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+namespace Verve {
+
+class SamplerTest {
+  public:
+
+  static std::string sample(const char *source) {
+    Test::Program program(source, "sampler_test.vrv");
+    return Test::capture([&](FILE *output) {
+      program.vm.enableSampler(output);
+      program.vm.execute();
+    });
+  }
+
+  static void testSourceLocations() {
+    auto report = sample(
+        "fn fib(n: int) -> int {\n"
+        "  if (n < 2) n\n"
+        "  else fib(n - 1) + fib(n - 2)\n"
+        "}\n"
+        "fib(30)\n");
+
+    // every stack starts at the call in the text
+    assert(report.find("main (sampler_test.vrv:5);") == 0);
+    // and the recursive calls are attributed to the line making them
+    assert(report.find("fib (sampler_test.vrv:3);fib (sampler_test.vrv:3)") != std::string::npos);
+  }
+
+  static void test() {
+    testSourceLocations();
+  }
+};
+
+}
+
+int main() {
+  Verve::SamplerTest::test();
+  return 0;
+}
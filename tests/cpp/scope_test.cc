@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
+#include <vector>
 
 namespace Verve {
 
@@ -10,16 +12,18 @@ class ScopeTest {
   public:
 
   static void testScopeCreate() {
-    Scope *global = new Scope();
+    ScopePool pool;
+    Scope *global = new Scope(&pool);
     auto tmp = global->create();
     tmp->restore();
     assert(tmp->refCount == 0);
   }
 
   static void testClosure() {
+    ScopePool pool;
     {
       // parent == previous
-      auto global = new Scope();
+      auto global = new Scope(&pool);
       auto closure = new Closure(global);
       auto tmp = global->create(closure->scope);
       tmp->restore();
@@ -31,7 +35,7 @@ class ScopeTest {
 
     {
       // parent != previous
-      auto global = new Scope();
+      auto global = new Scope(&pool);
       auto tmp = global->create();
       auto closure = new Closure(global);
       auto tmp2 = tmp->create(closure->scope);
@@ -53,9 +57,28 @@ class ScopeTest {
     }
   }
 
+  static void testGrowth() {
+    ScopePool pool;
+    Scope scope(&pool, 4);
+    StringTable strings;
+    std::vector<std::string> names;
+    for (int i = 0; i < 100; i++) {
+      names.push_back("name" + std::to_string(i));
+    }
+    for (int i = 0; i < 100; i++) {
+      scope.set(strings.intern(names[i].c_str()), Value(i));
+    }
+
+    assert(scope.length == 100);
+    for (int i = 0; i < 100; i++) {
+      assert(scope.get(strings.intern(names[i].c_str())).asInt() == i);
+    }
+  }
+
   static void test() {
     testScopeCreate();
     testClosure();
+    testGrowth();
   }
 
 };
@@ -0,0 +1,110 @@
+#include "runtime/stack.h"
+
+#include <cassert>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Verve {
+
+class StackTest {
+  public:
+
+  // what `body` writes to stderr in a child process, which must die of a
+  // segfault
+  static std::string crash(void (*body)()) {
+    int output[2];
+    assert(pipe(output) == 0);
+    auto child = fork();
+    if (child == 0) {
+      dup2(output[1], STDERR_FILENO);
+      body();
+      _exit(0);
+    }
+    close(output[1]);
+
+    std::string written;
+    char buffer[256];
+    ssize_t size;
+    while ((size = read(output[0], buffer, sizeof(buffer))) > 0) {
+      written.append(buffer, size);
+    }
+    close(output[0]);
+
+    int status;
+    waitpid(child, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    return written;
+  }
+
+  static void touchGuardPage(const Stack &stack) {
+    *reinterpret_cast<volatile char *>(stack.top() - stack.size() - 1) = 0;
+  }
+
+  // isolates' stacks are destroyed in any order, the ones left still report
+  static void testOutOfOrder() {
+    auto output = crash([] {
+      std::unique_ptr<Stack> first(new Stack(Stack::MINIMUM_STACK_SIZE));
+      std::unique_ptr<Stack> second(new Stack(2 * Stack::MINIMUM_STACK_SIZE));
+      std::unique_ptr<Stack> third(new Stack(3 * Stack::MINIMUM_STACK_SIZE));
+      first.reset();
+      third.reset();
+      touchGuardPage(*second);
+    });
+    assert(output == Stack(2 * Stack::MINIMUM_STACK_SIZE, false).overflowMessage());
+  }
+
+  // the thread's signal stack outlives the stack that installed it
+  static void testSignalStack() {
+    stack_t before;
+    assert(sigaltstack(nullptr, &before) == 0);
+    {
+      std::unique_ptr<Stack> first(new Stack(Stack::MINIMUM_STACK_SIZE));
+      std::unique_ptr<Stack> second(new Stack(Stack::MINIMUM_STACK_SIZE));
+      stack_t installed;
+      assert(sigaltstack(nullptr, &installed) == 0);
+      assert(!(installed.ss_flags & SS_DISABLE));
+
+      first.reset();
+      stack_t current;
+      assert(sigaltstack(nullptr, &current) == 0);
+      assert(current.ss_sp == installed.ss_sp && !(current.ss_flags & SS_DISABLE));
+    }
+    stack_t after;
+    assert(sigaltstack(nullptr, &after) == 0);
+    assert(!(after.ss_flags & SS_DISABLE));
+  }
+
+  // a worker's isolates are destroyed once it has exited, by the thread
+  // that owns the pool
+  static void testExitedThread() {
+    std::unique_ptr<Stack> first, second;
+    std::thread worker([&] {
+      first.reset(new Stack(Stack::MINIMUM_STACK_SIZE));
+      second.reset(new Stack(Stack::MINIMUM_STACK_SIZE));
+    });
+    worker.join();
+    first.reset();
+
+    Stack own(Stack::MINIMUM_STACK_SIZE);
+    second.reset();
+  }
+
+  static void test() {
+    testOutOfOrder();
+    testSignalStack();
+    testExitedThread();
+  }
+};
+
+}
+
+int main() {
+  Verve::StackTest::test();
+  return 0;
+}
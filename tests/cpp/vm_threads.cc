@@ -0,0 +1,71 @@
+#include "runtime/vm.h"
+#include "tests/cpp/helpers.h"
+
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+namespace Verve {
+
+class VMThreadsTest {
+  public:
+
+  static void testThreads() {
+    // allocates plenty, so every VM collects many times while the others run
+    auto bc = Test::compile(
+        "fn build(n: int, acc: string) -> string {\n"
+        "  if n == 0 acc else build(n - 1, int_to_string(n))\n"
+        "}\n"
+        "fn loop(n: int, acc: int) -> int {\n"
+        "  if n == 0 acc else loop(n - 1, acc + count(build(100, \"\")))\n"
+        "}\n"
+        "loop(2000, 0)\n");
+
+    const unsigned count = 4;
+    std::vector<std::unique_ptr<VM>> vms;
+    for (unsigned i = 0; i < count; i++) {
+      vms.emplace_back(new VM((uint8_t *)bc.data(), bc.size()));
+    }
+
+    std::vector<std::thread> threads;
+    for (auto &vm : vms) {
+      threads.emplace_back([&vm] { vm->execute(); });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    for (auto &vm : vms) {
+      assert(vm->gcStats.collections > 0);
+      assert(vm->gcStats.collections == vms[0]->gcStats.collections);
+      assert(vm->heapSize == vms[0]->heapSize);
+    }
+  }
+
+  static void testDispatchTables() {
+    auto bc = Test::compile("1 + 1\n");
+    VM profiled((uint8_t *)bc.data(), bc.size());
+    VM plain((uint8_t *)bc.data(), bc.size());
+
+    profiled.enableProfiler(tmpfile());
+    assert(memcmp(profiled.m_interpreter.dispatchTable, plain.m_interpreter.dispatchTable, sizeof(plain.m_interpreter.dispatchTable)) != 0);
+
+    // the interned names are per VM too
+    char first[] = "interned";
+    char second[] = "interned";
+    assert(profiled.m_strings.intern(first).str() == first);
+    assert(plain.m_strings.intern(second).str() == second);
+  }
+
+  static void test() {
+    testThreads();
+    testDispatchTables();
+  }
+};
+
+}
+
+int main() {
+  Verve::VMThreadsTest::test();
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "runtime/workers.h"
+#include "tests/cpp/helpers.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+namespace Verve {
+
+class WorkersTest {
+  public:
+
+  // jobs share the bytecode with the pool
+  static std::shared_ptr<const std::string> compile(const char *source) {
+    return std::make_shared<const std::string>(Test::compile(source));
+  }
+
+  static const char *source() {
+    return
+      "fn fib(n: int) -> int {\n"
+      "  if n < 2 n else fib(n - 1) + fib(n - 2)\n"
+      "}\n"
+      "fn build(n: int, acc: string) -> string {\n"
+      "  if n == 0 acc else build(n - 1, concat_string(acc, int_to_string(n % 10)))\n"
+      "}\n"
+      "fn greet(a: string, b: string) -> string {\n"
+      "  concat_string(a, b)\n"
+      "}\n";
+  }
+
+  static void testCall() {
+    Test::Program program(source());
+    auto &vm = program.vm;
+    vm.execute();
+
+    assert(vm.call("fib", { Value(10) }).asInt() == 55);
+    // arguments are passed in order
+    assert(strcmp(vm.call("greet", { Value("a"), Value("b") }).asString(), "ab") == 0);
+    // builtins can be called too
+    assert(vm.call("count", { Value("four") }).asInt() == 4);
+
+    bool threw = false;
+    try {
+      vm.call("missing", {});
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  static void testPool() {
+    auto bc = compile(source());
+    WorkerPool pool(4);
+    pool.setHeapPolicy(HeapPolicy());
+
+    const unsigned count = 200;
+    std::vector<int> fibs(count);
+    std::vector<size_t> lengths(count);
+    for (unsigned i = 0; i < count; i++) {
+      // a few slow jobs among many quick ones
+      pool.submit({ bc, "fib", { Value(i % 50 == 0 ? 25 : 10) }, [&fibs, i](Value v) { fibs[i] = v.asInt(); }, nullptr });
+      // allocates enough for every isolate to collect
+      pool.submit({ bc, "build", { Value(500), Value("") }, [&lengths, i](Value v) { lengths[i] = strlen(v.asString()); }, nullptr });
+    }
+    pool.wait();
+
+    for (unsigned i = 0; i < count; i++) {
+      assert(fibs[i] == (i % 50 == 0 ? 75025 : 55));
+      assert(lengths[i] == 500);
+    }
+  }
+
+  static void testErrors() {
+    auto bc = compile(source());
+    WorkerPool pool(2);
+    std::atomic<unsigned> done(0);
+    pool.submit({ bc, "missing", {}, [&done](Value) { done++; }, nullptr });
+    pool.submit({ bc, "fib", { Value(5) }, [&done](Value) { done++; }, nullptr });
+
+    bool threw = false;
+    try {
+      pool.wait();
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+    assert(done == 1);
+
+    // the error is only reported once
+    pool.submit({ bc, "fib", { Value(5) }, [&done](Value) { done++; }, nullptr });
+    pool.wait();
+    assert(done == 2);
+  }
+
+  static void testJIT() {
+    auto bc = compile(source());
+    auto original = *bc;
+    WorkerPool pool(2);
+    pool.enableJIT();
+
+    std::atomic<int> sum(0);
+    for (unsigned i = 0; i < 20; i++) {
+      pool.submit({ bc, "fib", { Value(15) }, [&sum](Value v) { sum += v.asInt(); }, nullptr });
+    }
+    pool.wait();
+    assert(sum == 20 * 610);
+    // the isolates patch their own copies
+    assert(*bc == original);
+  }
+
+  static void test() {
+    testCall();
+    testPool();
+    testErrors();
+    testJIT();
+  }
+};
+
+}
+
+int main() {
+  Verve::WorkersTest::test();
+  return 0;
+}
@@ -9,7 +9,7 @@
 
 namespace Verve {
 
-Parser parseFile(std::string filename, std::string dirname, std::string ns) {
+Parser parseFile(std::string filename, std::string dirname, std::string ns, Parser::CompilationPtr compilation) {
   filename = dirname + "/" + filename + ".vrv";
 
   FILE *source = fopen(filename.c_str(), "r");
@@ -24,7 +24,7 @@ Parser parseFile(std::string filename, std::string dirname, std::string ns) {
   fclose(source);
 
   Lexer lexer(filename, input);
-  Parser parser(lexer, dirname, ns);
+  Parser parser(lexer, dirname, ns, compilation);
 
   parser.parse();
 
@@ -1,7 +1,8 @@
+#include "parser/parser.h"
+
 #include <string>
 
 namespace Verve {
-  class Parser;
-
-  Parser parseFile(std::string filename, std::string dirname, std::string ns);
+  // the module `filename` names, parsed as part of `compilation`
+  Parser parseFile(std::string filename, std::string dirname, std::string ns, Parser::CompilationPtr compilation);
 }
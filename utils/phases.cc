@@ -0,0 +1,139 @@
+#include "phases.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace Verve {
+namespace Phases {
+
+  std::atomic<bool> enabled(false);
+
+  namespace {
+    // imports nest a full front end pass per imported file
+    const unsigned MAX_DEPTH = 256;
+
+    struct Activation {
+      Phase phase;
+      uint64_t start;
+    };
+
+    // the thread that called `enable`, the only one that touches the rest
+    thread_local bool t_timed = false;
+
+    Stats s_stats[Count];
+    unsigned s_active[Count];
+    Activation s_stack[MAX_DEPTH];
+    unsigned s_depth = 0;
+    uint64_t s_last = 0;
+
+    uint64_t now() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // charges the time since the last phase change to the innermost phase
+    uint64_t charge() {
+      auto time = now();
+      if (s_depth && s_depth <= MAX_DEPTH) {
+        s_stats[s_stack[s_depth - 1].phase].selfNanos += time - s_last;
+      }
+      s_last = time;
+      return time;
+    }
+  }
+
+  void enable() {
+    memset(s_stats, 0, sizeof(s_stats));
+    memset(s_active, 0, sizeof(s_active));
+    s_depth = 0;
+    t_timed = true;
+    enabled = true;
+  }
+
+  const char *name(Phase phase) {
+    switch (phase) {
+      case Lexing: return "lexing";
+      case Parsing: return "parsing";
+      case Imports: return "imports";
+      case Naming: return "naming";
+      case TypeChecking: return "type checking";
+      case Instantiation: return "  generic instances";
+      case Generation: return "code generation";
+      case Loading: return "loading";
+      case Execution: return "execution";
+      case Count: break;
+    }
+    return "";
+  }
+
+  const Stats &stats(Phase phase) {
+    return s_stats[phase];
+  }
+
+  void Timer::enter(Phase phase) {
+    if (!t_timed) {
+      return;
+    }
+    auto time = charge();
+    s_stats[phase].entries++;
+    if (s_depth < MAX_DEPTH) {
+      s_stack[s_depth] = { phase, time };
+    }
+    s_depth++;
+    s_active[phase]++;
+  }
+
+  void Timer::leave() {
+    if (!t_timed) {
+      return;
+    }
+    auto time = charge();
+    s_depth--;
+    if (s_depth < MAX_DEPTH) {
+      auto &activation = s_stack[s_depth];
+      // recursive activations are accounted for by the outermost one
+      if (--s_active[activation.phase] == 0) {
+        s_stats[activation.phase].totalNanos += time - activation.start;
+      }
+    }
+  }
+
+  void countAllocation(size_t bytes) {
+    if (t_timed && s_depth && s_depth <= MAX_DEPTH) {
+      auto &stats = s_stats[s_stack[s_depth - 1].phase];
+      stats.allocations++;
+      stats.allocatedBytes += bytes;
+    }
+  }
+
+  void report(FILE *output) {
+    enabled = false;
+
+    Stats total;
+    memset(&total, 0, sizeof(total));
+
+    fprintf(output, "%-20s %10s %12s %12s %12s %14s\n", "phase", "calls", "self ms", "total ms", "allocations", "bytes");
+    for (unsigned i = 0; i < Count; i++) {
+      auto phase = static_cast<Phase>(i);
+      const auto &stats = s_stats[phase];
+      fprintf(output, "%-20s %10llu %12.3f %12.3f %12llu %14llu\n",
+          name(phase),
+          (unsigned long long)stats.entries,
+          stats.selfNanos / 1e6,
+          stats.totalNanos / 1e6,
+          (unsigned long long)stats.allocations,
+          (unsigned long long)stats.allocatedBytes);
+
+      total.selfNanos += stats.selfNanos;
+      total.allocations += stats.allocations;
+      total.allocatedBytes += stats.allocatedBytes;
+    }
+    fprintf(output, "%-20s %10s %12.3f %12s %12llu %14llu\n",
+        "total", "",
+        total.selfNanos / 1e6,
+        "",
+        (unsigned long long)total.allocations,
+        (unsigned long long)total.allocatedBytes);
+  }
+}
+}
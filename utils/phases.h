@@ -0,0 +1,90 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include <atomic>
+
+#pragma once
+
+namespace Verve {
+namespace Phases {
+
+  enum Phase {
+    Lexing,
+    Parsing,
+    Imports,
+    Naming,
+    TypeChecking,
+    Instantiation,
+    Generation,
+    Loading,
+    Execution,
+    Count,
+  };
+
+  struct Stats {
+    uint64_t entries;
+    // time spent in the phase itself, nested phases excluded
+    uint64_t selfNanos;
+    // time spent in the outermost activations of the phase, nested phases
+    // included, e.g. imports include parsing and checking the imported files
+    uint64_t totalNanos;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+  };
+
+  extern std::atomic<bool> enabled;
+
+  // Times the phases run by the calling thread. The isolates, collector
+  // helpers and I/O threads it starts aren't timed, their allocations aren't
+  // counted either.
+  void enable();
+  const char *name(Phase);
+  const Stats &stats(Phase);
+
+  // Charged to the innermost running phase. The front end counts its AST
+  // nodes, types and environments, the generator the strings and code it
+  // keeps, and the VM every object allocated in its heap.
+  void countAllocation(size_t bytes);
+
+  // only checks a flag when timing is off
+  inline void allocated(size_t bytes) {
+    if (enabled) {
+      countAllocation(bytes);
+    }
+  }
+
+  void report(FILE *output);
+
+  // Times whatever runs until it goes out of scope (or `stop` is called)
+  // as `phase`. Phases nest: time spent in an inner phase is not charged
+  // to the phases around it. It only checks a flag when timing is off.
+  class Timer {
+    public:
+      Timer(Phase phase) :
+        m_running(enabled)
+      {
+        if (m_running) {
+          enter(phase);
+        }
+      }
+
+      ~Timer() {
+        stop();
+      }
+
+      void stop() {
+        if (m_running) {
+          m_running = false;
+          leave();
+        }
+      }
+
+    private:
+      static void enter(Phase);
+      static void leave();
+
+      bool m_running;
+  };
+}
+}
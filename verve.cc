@@ -1,8 +1,13 @@
 #define _DARWIN_BETTER_REALPATH
 #include <cassert>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <deque>
 #include <fstream>
+#include <iostream>
 #include <libgen.h>
+#include <stdexcept>
 
 #if __APPLE__
 #include <mach-o/dyld.h>
@@ -18,10 +23,12 @@
 #include "bytecode/generator.h"
 #include "bytecode/disassembler.h"
 #include "runtime/vm.h"
+#include "runtime/workers.h"
+#include "utils/phases.h"
 
 void printUsage() {
   puts("Usage:");
-  printf("  %-30s", "verve <input>");
+  printf("  %-30s", "verve [options] <input>");
   puts("Execute <input> as verve source code");
 
   printf("  %-30s", "verve -d <input>");
@@ -30,11 +37,130 @@ void printUsage() {
   printf("  %-30s", "verve -c <input> <output>");
   puts("Generate bytecode for <input> and save it at <output>");
 
-  printf("  %-30s", "verve -b <input>");
+  printf("  %-30s", "verve [options] -b <input>");
   puts("Execute <input> as verve bytecode");
 
   printf("  %-30s", "verve --print-ast <input>");
   puts("Print the Abstract Syntax Tree for <input>");
+
+  puts("\nOptions:");
+  printf("  %-30s", "--jit");
+  puts("Compile functions to machine code on their first call");
+
+  printf("  %-30s", "--profile");
+  puts("Print the calls and cycles spent in each function on exit");
+
+  printf("  %-30s", "--opstats");
+  puts("Print how many times each opcode and pair of opcodes ran on exit");
+
+  printf("  %-30s", "--gc-stats");
+  puts("Print garbage collection statistics on exit");
+
+  printf("  %-30s", "--heap-initial <size>");
+  puts("Heap size before the first collection (default 10k)");
+
+  printf("  %-30s", "--heap-max <size>");
+  puts("Fail when more than <size> is in use after a collection");
+
+  printf("  %-30s", "--heap-growth <factor>");
+  puts("Grow the heap to <factor> times what survives a collection (default 2)");
+
+  printf("  %-30s", "--gc-target <percent>");
+  puts("Grow the heap faster while collecting takes more than <percent> of the time");
+
+  printf("  %-30s", "--gc-threads <n>");
+  puts("Mark large heaps on <n> threads (default: one per core, up to 8)");
+
+  printf("  %-30s", "--gc-pause <us>");
+  puts("Collect in steps of about <us> microseconds while the program runs");
+
+  printf("  %-30s", "--stack-size <size>");
+  puts("Stack available to the program (default 64m)");
+
+  printf("  %-30s", "--sample <file>");
+  puts("Sample the running program and save the folded stacks at <file>");
+
+  printf("  %-30s", "--workers <n>");
+  puts("Run the jobs read from stdin on <n> threads, see below");
+
+  printf("  %-30s", "--time-phases");
+  puts("Print the time and allocations of each compilation phase on exit");
+
+  puts("\nThe heap and stack options can also be set with VERVE_HEAP_INITIAL,");
+  puts("VERVE_HEAP_MAX, VERVE_HEAP_GROWTH, VERVE_GC_TARGET, VERVE_GC_THREADS,");
+  puts("VERVE_GC_PAUSE and VERVE_STACK_SIZE.");
+
+  puts("\nWith --workers, every line of stdin is a job, `<function> <arguments>...`,");
+  puts("which calls a function defined by <input>. Integer arguments are passed as");
+  puts("ints, the others as strings. Every thread runs the top level of <input>");
+  puts("once, and the results are printed in the order of the jobs. The reports of");
+  puts("--profile, --sample, --opstats and --gc-stats are one VM's, they can't be used");
+  puts("with --workers.");
+}
+
+static bool parseInt(const std::string &str, int *value) {
+  char *end;
+  errno = 0;
+  auto result = strtol(str.c_str(), &end, 10);
+  if (str.empty() || *end || errno || result < INT32_MIN || result > INT32_MAX) {
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+static int runJobs(const std::string &bytecode, Verve::WorkerPool &pool) {
+  auto module = std::make_shared<const std::string>(bytecode);
+
+  // the jobs' string arguments point into it
+  std::deque<std::string> words;
+  std::vector<std::string> results;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::istringstream input(line);
+    std::string word;
+
+    Verve::Job job;
+    job.bytecode = module;
+    if (!(input >> job.function)) {
+      continue;
+    }
+    while (input >> word) {
+      int value;
+      if (parseInt(word, &value)) {
+        job.args.push_back(Verve::Value(value));
+      } else {
+        words.push_back(word);
+        job.args.push_back(Verve::Value(words.back().c_str()));
+      }
+    }
+
+    auto index = results.size();
+    auto function = job.function;
+    results.emplace_back();
+    job.done = [&results, index, function](Verve::Value result) {
+      if (result.isInt()) {
+        results[index] = std::to_string(result.asInt());
+      } else if (result.isString()) {
+        results[index] = result.asString();
+      } else {
+        throw std::runtime_error("`" + function + "` must return an int or a string");
+      }
+    };
+    pool.submit(std::move(job));
+  }
+
+  try {
+    pool.wait();
+  } catch (const std::runtime_error &error) {
+    fprintf(stderr, "Error: %s\n", error.what());
+    return EXIT_FAILURE;
+  }
+
+  for (const auto &result : results) {
+    puts(result.c_str());
+  }
+  return EXIT_SUCCESS;
 }
 
 #if !__APPLE__
@@ -54,6 +180,76 @@ int main(int argc, char **argv) {
   realpath(buffer, buffer2);
   ROOT_DIR = dirname(buffer2);
 
+  // options for executing the program come before everything else
+  bool jit = false;
+  bool profile = false;
+  bool opstats = false;
+  bool gcStats = false;
+  unsigned workers = 0;
+  FILE *samples = nullptr;
+  auto heapPolicy = Verve::HeapPolicy::fromEnvironment();
+  auto stackSize = Verve::Stack::sizeFromEnvironment();
+  while (argc > 1) {
+    if (strcmp(argv[1], "--jit") == 0) {
+      jit = true;
+    } else if (strcmp(argv[1], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[1], "--opstats") == 0) {
+      opstats = true;
+    } else if (strcmp(argv[1], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strcmp(argv[1], "--time-phases") == 0) {
+      if (!Verve::Phases::enabled) {
+        Verve::Phases::enable();
+        atexit([] { Verve::Phases::report(stderr); });
+      }
+    } else if (strncmp(argv[1], "--heap-", 7) == 0 || strcmp(argv[1], "--gc-target") == 0 || strcmp(argv[1], "--gc-threads") == 0 || strcmp(argv[1], "--gc-pause") == 0) {
+      if (argc < 3 || !heapPolicy.set(argv[1], argv[2])) {
+        printf("Error: Invalid value for `%s`\n", argv[1]);
+        return EXIT_FAILURE;
+      }
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--stack-size") == 0) {
+      if (argc < 3 || !Verve::parseSize(argv[2], &stackSize) || stackSize < Verve::Stack::MINIMUM_STACK_SIZE) {
+        printf("Error: Invalid value for `%s`\n", argv[1]);
+        return EXIT_FAILURE;
+      }
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--workers") == 0) {
+      int count;
+      if (argc < 3 || !parseInt(argv[2], &count) || count < 1) {
+        printf("Error: Invalid value for `%s`\n", argv[1]);
+        return EXIT_FAILURE;
+      }
+      workers = count;
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--sample") == 0 && argc > 2) {
+      samples = fopen(argv[2], "w");
+      if (!samples) {
+        printf("Error: Cannot open file at `%s`\n", argv[2]);
+        return EXIT_FAILURE;
+      }
+      argv++;
+      argc--;
+    } else {
+      break;
+    }
+    argv++;
+    argc--;
+  }
+
+  // the reports are one VM's, the isolates would each write their own
+  if (workers) {
+    const char *report = profile ? "--profile" : samples ? "--sample" : opstats ? "--opstats" : gcStats ? "--gc-stats" : nullptr;
+    if (report) {
+      printf("Error: `%s` can't be used with `--workers`\n", report);
+      return EXIT_FAILURE;
+    }
+  }
+
   char *first = argv[1];
   bool isDebug = first && strcmp(first, "-d") == 0;
   bool isCompile = first && strcmp(first, "-c") == 0;
@@ -93,8 +289,48 @@ int main(int argc, char **argv) {
 
   fclose(source);
 
+  // what the options set up in the VM running the program
+  auto configure = [&](Verve::VM &vm) {
+    vm.setHeapPolicy(heapPolicy);
+    vm.setStackSize(stackSize);
+    if (jit) {
+      vm.enableJIT();
+    }
+    if (profile) {
+      vm.enableProfiler();
+    }
+    if (samples) {
+      vm.enableSampler(samples);
+    }
+    if (opstats) {
+      vm.enableOpStats();
+    }
+    if (gcStats) {
+      vm.enableGCStats();
+    }
+  };
+
+  // the isolates only take the options that make sense for many VMs, the
+  // others were rejected with the options
+  auto runWorkers = [&](const std::string &bytecode) {
+    Verve::WorkerPool pool(workers);
+    pool.setHeapPolicy(heapPolicy);
+    pool.setStackSize(stackSize);
+    if (jit) {
+      pool.enableJIT();
+    }
+    return runJobs(bytecode, pool);
+  };
+
+  if (isBytecode && workers) {
+    auto status = runWorkers(std::string(input, sourceSize));
+    free(input);
+    return status;
+  }
+
   if (isBytecode) {
-    Verve::VM vm((uint8_t *)input, sourceSize, true);
+    Verve::VM vm((uint8_t *)input, sourceSize);
+    configure(vm);
     vm.execute();
     free(input);
     return EXIT_SUCCESS;
@@ -110,7 +346,7 @@ int main(int argc, char **argv) {
   }
 
   std::stringstream bytecode;
-  Verve::Generator::generate(ast, !isDebug && !isCompile, &bytecode);
+  Verve::Generator::generate(ast, &bytecode);
 
   if (isDebug) {
     Verve::Disassembler disassembler(bytecode);
@@ -118,9 +354,14 @@ int main(int argc, char **argv) {
   } else if (isCompile) {
     std::ofstream output(argv[3], std::ios_base::binary);
     output << bytecode.str();
+  } else if (workers) {
+    auto status = runWorkers(bytecode.str());
+    free(input);
+    return status;
   } else {
     auto bc = bytecode.str();
     Verve::VM vm((uint8_t *)bc.data(), bc.size());
+    configure(vm);
     vm.execute();
   }
 